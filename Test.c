@@ -1,592 +1,220 @@
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
-#include <sys/types.h>
 #include <unistd.h>
-#include <sys/wait.h>
-#include <glob.h>
+#include "myshell.h"
 
-char SHELL_NAME[50] = "myShell";
-int QUIT = 0;
-int LastComStat = 0;
-
-#define MAX_COMMAND_LENGTH 1024
-#define BUFFER_SIZE 4096
-
-// Function to read a line from command into the buffer
-char *readLine() {
-    char *line = (char *)malloc(sizeof(char) * 1024);
-    char c;
-    int pos = 0, bufsize = 1024;
-    if (!line) {
-        printf("\nBuffer Allocation Error.");
-        exit(EXIT_FAILURE);
-    }
-    while (1) {
-        c = getchar();
-        if (c == EOF || c == '\n') {
-            line[pos] = '\0';
-            return line;
-        } else {
-            line[pos] = c;
-        }
-        pos++;
-        if (pos >= bufsize) {
-            bufsize += 1024;
-            line = realloc(line, sizeof(char) * bufsize);
-            if (!line) {
-                printf("\nBuffer Allocation Error.");
-                exit(EXIT_FAILURE);
-            }
-        }
-    }
-}
-
-// Function to split a line into constituent commands
-char **splitLine(char *line) {
-    char **tokens = (char **)malloc(sizeof(char *) * 64);
-    char *token;
-    char delim[10] = " \t\n\r\a";
-    int pos = 0, bufsize = 64;
-    if (!tokens) {
-        printf("\nBuffer Allocation Error.");
-        exit(EXIT_FAILURE);
-    }
-    token = strtok(line, delim);
-    while (token != NULL) {
-        tokens[pos] = token;
-        pos++;
-        if (pos >= bufsize) {
-            bufsize += 64;
-            line = realloc(line, bufsize * sizeof(char *));
-            if (!line) {
-                printf("\nBuffer Allocation Error.");
-                exit(EXIT_FAILURE);
-            }
-        }
-        token = strtok(NULL, delim);
-    }
-    tokens[pos] = NULL;
-    return tokens;
-}
-
-void input_redirection_files(char ** args, int index){
-    char *first_file = args[index]; // Assuming the first file is at index 1
-    
-    // Open the first file for appending
-    int output_fd = open(first_file, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (output_fd == -1) {
-        perror("Error opening first file");
-        exit(EXIT_FAILURE);
-    }
-
-    // Iterate through input files starting from the second one
-    for (int i = index+1; args[i] != NULL && strcmp(args[i], ">") != 0 && strcmp(args[i], "|") != 0; i++) {
-        // Open the current input file for reading
-        int input_fd = open(args[i], O_RDONLY);
-        if (input_fd == -1) {
-            perror("Error opening input file");
-            exit(EXIT_FAILURE);
-        }
-
-        // Move to the end of the first file
-        if (lseek(output_fd, 0, SEEK_END) == -1) {
-            perror("Error seeking first file");
-            exit(EXIT_FAILURE);
-        }
-
-        // Copy content of input file to the end of the first file
-        char buffer[4096];
-        ssize_t bytes_read;
-        while ((bytes_read = read(input_fd, buffer, sizeof(buffer))) > 0) {
-            if (write(output_fd, buffer, bytes_read) == -1) {
-                perror("Error writing to first file");
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        close(input_fd);
-    }
-
-    close(output_fd);
-
-
-}
-
-// Function Declarations
-int myShell_cd(char **args);
-int myShell_exit();
-int myShell_execute(char **args);
-int myShell_pwd();
-int myShell_which(char **args);
-
-
-// Definitions
-char *builtin_cmd[] = {"cd", "exit", "pwd", "which"};
-
-int (*builtin_func[])(char **) = {&myShell_cd, &myShell_exit, &myShell_pwd, &myShell_which};
-
-int numBuiltin() {
-    return sizeof(builtin_cmd) / sizeof(char *);
-}
-
-// Builtin command definitions
-int myShell_cd(char **args) {
-    if (args[1] == NULL) {
-        printf("myShell: expected argument to \"cd\"\n");
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("myShell: ");
-        }
-    }
-    return 1;
-}
-
-int myShell_exit() {
-    printf("Exiting Shell... See you soon!!\n");
-    QUIT = 1;
-    return 0;
-}
-
-int myShell_pwd(){
-    // dynamic array?????
-    char pwd[1024]; 
-
-    if (getcwd(pwd, sizeof(pwd)) != NULL) {
-        printf("%s\n", pwd);
-    } else {
-        perror("pwd error");
-        return 1;
-    }
-
-    return 0;
-}
-
-int myShell_which(char **args) {
-    int argc = 0;
-
-    // Count the number of arguments
-    while (args[argc] != NULL) {
-        argc++;
-    }
-
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <program_name>\n", args[0]);
-        return 1; // Return error code 1 for wrong number of arguments
-    }
-
-    char *program_name = args[1];
-    
-    /*
-    if(strcmp(program_name, "exit") == 0 || strcmp(program_name, "cd") == 0 || strcmp(program_name, "pwd") == 0 || strcmp(program_name, "which") == 0) {
-        printf("Built-in Command does not have Path\n");
-        return 1; 
-    }
-    */
-    
-
-    char *path = getenv("PATH");
-
-    if (path == NULL) {
-        fprintf(stderr, "Error: PATH environment variable is not set.\n");
-        return 1;
-    }
-
-    char *path_copy = strdup(path);
-    if (path_copy == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed.\n");
-        return 1;
-    }
-
-    char *token;
-    char file_path[1024];
-
-    token = strtok(path_copy, ":");
-    while (token != NULL) {
-        snprintf(file_path, 1024, "%s/%s", token, program_name);
-        if (access(file_path, X_OK) == 0) {
-            printf("%s\n", file_path);
-            free(path_copy);
-            return 0;
-        }
-        token = strtok(NULL, ":");
-    }
-
-    free(path_copy);
-
-    fprintf(stderr, "%s: program not found\n", args[1]);
-    return 1;
-}
-
-
-
-int myShell_execute(char **args) {
-    int i = 0;
-    int redirect_input = 0, redirect_output = 0, piping = 0;
-    char *input_file = NULL, *output_file = NULL, *pipe_file_1 = NULL, *pipe_file_2 = NULL;
-    char input_buffer[BUFFER_SIZE];
-    ssize_t input_buffer_size = 0;
-
-    // Find input and output files
-    while (args[i] != NULL) {
-        if (strcmp(args[i], "<") == 0) {
-            if (args[i + 1] == NULL) {
-                printf("Missing filename after <\n");
-                return 1;
-            }
-            input_file = args[i+1];
-            redirect_input = 1;
-
-            // Read the contents of the input file into the buffer
-            int input_fd = open(input_file, O_RDONLY);
-            if (input_fd == -1) {
-                perror("open");
-                return 1;
-            }
-            ssize_t bytes_read;
-            while ((bytes_read = read(input_fd, input_buffer + input_buffer_size, BUFFER_SIZE - input_buffer_size)) > 0) {
-                input_buffer_size += bytes_read;
-                if (input_buffer_size >= BUFFER_SIZE) {
-                    printf("Input file too large to handle\n");
-                    close(input_fd);
-                    return 1;
-                }
-            }
-            close(input_fd);
-            if (bytes_read == -1) {
-                perror("read");
-                return 1;
-            }
-
-            input_redirection_files(args, i+1);
-        } else if (strcmp(args[i], ">") == 0) {
-            if (args[i + 1] == NULL) {
-                printf("Missing filename after >\n");
-                return 1;
-            }
-            output_file = args[i + 1];
-            redirect_output = 1;
-        } else if (strcmp(args[i], "|") == 0){
-            if (args[i + 1] == NULL) {
-                printf("Missing command after |\n");
-                return 1;
-            }
-            pipe_file_1 = args[i - 1];
-            pipe_file_2 = args[i + 1];
-
-            piping = 1;
-        }
-        i++;
-    }
-
-    int pid;
-    int pipefd[2];
-    
-    if (piping) {
-        if (pipe(pipefd) == -1) {
-            perror("pipe");
-            return 1;
-        }
-    }
-
-    pid = fork();
-
-    if (pid == 0) {
-        // Child process
-        if (redirect_input) {
-            int input_fd = open(input_file, O_RDONLY);
-            if (input_fd == -1) {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-            dup2(input_fd, STDIN_FILENO);
-            close(input_fd);
-        }
-
-        if (piping) {
-            close(pipefd[0]); // Close unused read end of the pipe
-            dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to the write end of the pipe
-            close(pipefd[1]); // Close the write end of the pipe
-        }
-
-        execvp(args[0], args);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        // Forking Error
-        perror("fork");
-        return 1;
-    } else {
-        // Inside the parent process
-        int status;
-        waitpid(pid, &status, 0); // Wait for the child process to complete
-
-        if (piping) {
-            int pid2 = fork();
-            if (pid2 == 0) {
-                // Child process for the second command in the pipeline
-                close(pipefd[1]); // Close unused write end of the pipe
-                dup2(pipefd[0], STDIN_FILENO); // Redirect stdin to the read end of the pipe
-                close(pipefd[0]); // Close the read end of the pipe
-
-                if (redirect_output) {
-                    int output_fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-                    if (output_fd == -1) {
-                        perror("open");
-                        exit(EXIT_FAILURE);
-                    }
-                    dup2(output_fd, STDOUT_FILENO);
-                    close(output_fd);
-                }
-
-                char *args2[] = {pipe_file_2, NULL};
-                execvp(args2[0], args2);
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            } else if (pid2 < 0) {
-                perror("fork");
-                return 1;
-            }
-            close(pipefd[0]); // Close the read end of the pipe in the parent process
-            close(pipefd[1]); // Close the write end of the pipe in the parent process
-            waitpid(pid2, &status, 0); // Wait for the second child process to complete
-        } else if (redirect_output) {
-            int pid3 = fork();
-            if (pid3 == 0) {
-                // Child process for redirecting output to file without piping
-                int output_fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-                if (output_fd == -1) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(output_fd, STDOUT_FILENO);
-                close(output_fd);
-
-                execvp(args[0], args);
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            } else if (pid3 < 0) {
-                perror("fork");
-                return 1;
-            }
-            waitpid(pid3, &status, 0); // Wait for the child process to complete
-        }
-
-        // If input redirection is enabled, overwrite the input file with the buffer contents
-        if (redirect_input) {
-            int input_fd = open(input_file, O_WRONLY | O_TRUNC);
-            if (input_fd == -1) {
-                perror("open");
-                return 1;
-            }
-            if (write(input_fd, input_buffer, input_buffer_size) == -1) {
-                perror("write");
-                return 1;
-            }
-            close(input_fd);
-        }
-
-        return 1;
-    }
-
-    return 0;
-}
-
-char **expand_wildcards(char *tokens[]) {
-    glob_t glob_result;
-    int i, flags = 0;
-    char **expanded_strings = NULL;
-    size_t num_strings = 0;
-
-    // Iterate over tokens until NULL is encountered
-    for (i = 0; tokens[i] != NULL; i++) {
-        // If the token contains wildcard characters
-        if (strchr(tokens[i], '*') != NULL || strchr(tokens[i], '?') != NULL) {
-            // Use glob to expand the wildcard pattern
-            if (glob(tokens[i], flags, NULL, &glob_result) == 0) {
-                // Allocate memory for expanded strings
-                expanded_strings = (char **)realloc(expanded_strings, (num_strings + glob_result.gl_pathc) * sizeof(char *));
-                if (expanded_strings == NULL) {
-                    perror("Memory allocation failed");
-                    return NULL;
-                }
-                // Copy expanded filenames
-                for (int j = 0; j < glob_result.gl_pathc; j++) {
-                    expanded_strings[num_strings++] = strdup(glob_result.gl_pathv[j]);
-                    if (expanded_strings[num_strings - 1] == NULL) {
-                        perror("Memory allocation failed");
-                        return NULL;
-                    }
-                }
-                // Free memory allocated by glob
-                globfree(&glob_result);
-            }
-        } else {
-            // No wildcards, just copy the token
-            expanded_strings = (char **)realloc(expanded_strings, (num_strings + 1) * sizeof(char *));
-            if (expanded_strings == NULL) {
-                perror("Memory allocation failed");
-                return NULL;
-            }
-            expanded_strings[num_strings++] = strdup(tokens[i]);
-            if (expanded_strings[num_strings - 1] == NULL) {
-                perror("Memory allocation failed");
-                return NULL;
-            }
-        }
-    }
-    // Add a NULL terminator to the expanded strings array
-    expanded_strings = (char **)realloc(expanded_strings, (num_strings + 1) * sizeof(char *));
-    if (expanded_strings == NULL) {
-        perror("Memory allocation failed");
-        return NULL;
-    }
-    expanded_strings[num_strings] = NULL;
-    return expanded_strings;
-}
-
-int myShellLaunch(char **args) {
-    pid_t pid, wpid;
+// Test driver for libmyshell. With arguments, runs each one as a line in a
+// single context and prints its status. Without, runs the checks below,
+// each line paired with the status it should leave.
+struct check {
+    const char *line;
     int status;
-    pid = fork();
-    if (pid == 0) {
-        // The Child Process
-        if (execvp(args[0], args) == -1) {
-            perror("myShell: ");
-            exit(EXIT_FAILURE);
-            LastComStat = 0;
-        }
-        exit(EXIT_SUCCESS);
-        LastComStat = 1;
-    } else if (pid < 0) {
-        // Forking Error
-        perror("myShell: ");
-    } else {
-        // The Parent Process
-        do {
-            wpid = waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-    }
-    return 1;
-}
+};
+
+// Scripts some checks run through ./myshll, written out before the checks
+struct script {
+    const char *path;
+    const char *text;
+};
+
+struct script SCRIPTS[] = {
+    {"/tmp/msh_test_tail_call.sh", "set -o tailexec\nf() { return 3; }\nf\n"},
+    {"/tmp/msh_test_tail_loop.sh", "set -o tailexec\nfor i in 1 2; do test $i -eq 1; done\n"},
+    {"/tmp/msh_test_slow.sh", "sleep 0.2\necho a\n"},
+    {"/tmp/msh_test_fast.sh", "echo b\nexit 3\n"},
+    {"/tmp/msh_test_core.sh", "ulimit -c\n"},
+    {"/tmp/msh_test_exit11", "#!/bin/sh\nexit 11\n"},
+    {"/tmp/msh_test_exit12", "#!/bin/sh\nexit 12\n"},
+    {"/tmp/msh_test_memo_ok", "#!/bin/sh\necho run >> /tmp/msh_test_memo_runs\necho out\n"},
+    {"/tmp/msh_test_history_in", "echo one\necho two\n!1\nhistory\n!9\nexit 5\n"},
+    {"/tmp/msh_test_memo_fail", "#!/bin/sh\necho run >> /tmp/msh_test_memo_runs\nexit 3\n"},
+    {"/tmp/msh_test_read_in", "a\\ b c\\\nd\nsecond line\nx:y:z\n"},
+    {"/tmp/msh_test_trace.sh", "echo a | tr a b\nx\"y\\\\z 2> /dev/null\n"},
+};
+
+struct check CHECKS[] = {
+    {"true", 0},
+    {"false", 1},
+    {"echo $?", 0},
+    {"false || true", 0},
+    {"true && false", 1},
+    {"echo hi | tr a-z A-Z > /dev/null", 0},
+    {"nosuchcommand", 127},
+    {"set -o pipefail", 0},
+    {"false | true", 1},
+    {"./myshll /tmp/msh_test_tail_call.sh > /dev/null", 3},
+    {"./myshll /tmp/msh_test_tail_loop.sh > /dev/null", 1},
+    {"./myshll -P 2 /tmp/msh_test_slow.sh /tmp/msh_test_fast.sh > /tmp/msh_test_out 2> /dev/null", 3},
+    {"read first < /tmp/msh_test_out && rm /tmp/msh_test_out && test $first = a", 0},
+    {"./myshll --trace /tmp/msh_test_trace.json /tmp/msh_test_trace.sh > /dev/null", 127},
+    {"python3 -m json.tool /tmp/msh_test_trace.json > /dev/null && rm /tmp/msh_test_trace.json", 0},
+    {"saved_home=$HOME && cd /", 0},
+    {"test -d proc", 0},
+    {"pwd > /dev/null", 0},
+    {"pwd > /tmp/msh_test_pwd && read d < /tmp/msh_test_pwd && rm /tmp/msh_test_pwd && test $d = /", 0},
+    {"echo x | read v && test $v = x", 0},
+    {"pwd | read d && test $d = /", 0},
+    {"true | false", 1},
+    {"pwd | false", 1},
+    {"false | pwd > /dev/null", 1},
+    {"exit 3 | true", 3},
+    {"true | exit 4", 4},
+    {"diff <(echo a) <(echo a)", 0},
+    {"diff <(echo a) <(echo b) > /dev/null", 1},
+    {"echo hi > >(cat > /tmp/msh_test_subst) && read v < /tmp/msh_test_subst && rm /tmp/msh_test_subst && test $v = hi", 0},
+    {"( exec > /tmp/msh_test_exec; echo x; echo y ) && wc -l < /tmp/msh_test_exec | read lines && rm /tmp/msh_test_exec && test $lines -eq 2", 0},
+    {"exec nosuchcmd", 127},
+    {"limit core=0 sh /tmp/msh_test_core.sh 2> /dev/null | read c && test $c = 0", 0},
+    {"limit mem=unlimited true 2> /dev/null", 0},
+    {"limit mem=1G cpu=unlimited true 2> /dev/null", 0},
+    {"limit nosuchkey=1 true 2> /dev/null", 2},
+    {"( ulimit -c 0 && ulimit -c | read c && test $c = 0 )", 0},
+    {"empty= && ulimit -c $empty 2> /dev/null", 1},
+    {"ulimit -c 1x 2> /dev/null", 1},
+    {"ls /nonexistent 2>&/tmp/msh_test_redir", 2},
+    {"ls /nonexistent >&/tmp/msh_test_redir; test -s /tmp/msh_test_redir && rm /tmp/msh_test_redir", 0},
+    {"ls /nonexistent 2> /dev/null 1>&2", 2},
+    {"mkdir /tmp/msh_test_p1 /tmp/msh_test_p2 && chmod +x /tmp/msh_test_exit11 /tmp/msh_test_exit12", 0},
+    {"cp /tmp/msh_test_exit11 /tmp/msh_test_p1/mshcmd && cp /tmp/msh_test_exit12 /tmp/msh_test_p2/mshcmd", 0},
+    {"saved=$PATH && PATH=/tmp/msh_test_p1:$saved && mshcmd", 11},
+    {"PATH=/tmp/msh_test_p2:$saved && mshcmd", 12},
+    {"PATH=/tmp/msh_test_p1:$saved && mshcmd", 11},
+    {"rm /tmp/msh_test_p1/mshcmd && mshcmd 2> /dev/null", 127},
+    {"PATH=$saved && rm -r /tmp/msh_test_p1 /tmp/msh_test_p2", 0},
+    {"batch-args echo a b | read x y && test $y = b", 0},
+    {"mkdir /tmp/msh_test_many && seq -f /tmp/msh_test_many/%0200g 12000 | xargs touch", 0},
+    {"echo /tmp/msh_test_many/* > /dev/null 2> /dev/null", 126},
+    {"batch-args echo /tmp/msh_test_many/* | wc -l | read batches && test $batches -ge 2", 0},
+    {"batch-args -j 2 echo /tmp/msh_test_many/* | wc -w | read words && test $words -eq 12000", 0},
+    {"batch-args -j 2 /tmp/msh_test_exit11 /tmp/msh_test_many/*", 11},
+    {"rm -r /tmp/msh_test_many", 0},
+    {"mkdir -p /tmp/msh_test_tree/a/b && touch /tmp/msh_test_tree/top.c /tmp/msh_test_tree/a/x.c", 0},
+    {"touch /tmp/msh_test_tree/a/b/y.c /tmp/msh_test_tree/a/b/z.h", 0},
+    {"ls /tmp/msh_test_tree/**/*.c | wc -l | read cfiles && test $cfiles -eq 3", 0},
+    {"echo /tmp/msh_test_tree/**/b/* | read first second && test $second = /tmp/msh_test_tree/a/b/z.h", 0},
+    {"echo /tmp/msh_test_tree/**/*.none | read kept && test $kept = /tmp/msh_test_tree/**/*.none", 0},
+    {"ls /tmp/msh_test_tree/**/*.none 2> /dev/null", 2},
+    {"rm -r /tmp/msh_test_tree", 0},
+    {"memo --clear && chmod +x /tmp/msh_test_memo_ok /tmp/msh_test_memo_fail", 0},
+    {"memo -f true", 0},
+    {"memo /tmp/msh_test_memo_ok | read out && test $out = out", 0},
+    {"memo /tmp/msh_test_memo_ok | read out && test $out = out", 0},
+    {"wc -l < /tmp/msh_test_memo_runs | read runs && test $runs -eq 1", 0},
+    {"memo /tmp/msh_test_memo_fail", 3},
+    {"memo /tmp/msh_test_memo_fail", 3},
+    {"memo -f /tmp/msh_test_memo_fail", 3},
+    {"memo -f /tmp/msh_test_memo_fail", 3},
+    {"wc -l < /tmp/msh_test_memo_runs | read runs && test $runs -eq 4", 0},
+    {"memo --clear && rm -r /tmp/msh_test_memo /tmp/msh_test_memo_runs", 0},
+    {"mkdir /tmp/msh_test_home && cd /tmp/msh_test_home && HOME=/tmp/msh_test_home && $MSH_TEST -i < /tmp/msh_test_history_in > out 2> err", 5},
+    {"grep -q ^one$ /tmp/msh_test_home/out && grep -q 3..echo.one$ /tmp/msh_test_home/out", 0},
+    {"grep -q 9:.event.not.found /tmp/msh_test_home/err", 0},
+    {"cd / && HOME=$saved_home && rm -r /tmp/msh_test_home", 0},
+    {"sched nice=5 nice | read level && test $level -eq 5", 0},
+    {"sched cpus=0 grep -q Cpus_allowed_list:.0$ /proc/self/status", 0},
+    {"sched bogus=1 true 2> /dev/null", 2},
+    {"sched -b nice=3", 0},
+    {"nice > /tmp/msh_test_nice & wait", 0},
+    {"read level < /tmp/msh_test_nice && rm /tmp/msh_test_nice && test $level -eq 3", 0},
+    {"sched -b nice=0", 0},
+    {"mkdir /tmp/msh_test_watch && on-change -n 1 /tmp/msh_test_watch -- exit 6", 6},
+    {"on-change -n 3 -d 0 /tmp/msh_test_watch/f -- echo run >> /tmp/msh_test_watch/f", 0},
+    {"wc -l < /tmp/msh_test_watch/f | read runs && test $runs -eq 3", 0},
+    {"( on-change -n 1 /tmp/msh_test_watch ) 2> /dev/null", 2},
+    {"rm -r /tmp/msh_test_watch", 0},
+    {"read p q r < /tmp/msh_test_read_in && test $q = cd", 0},
+    {"read -r p q r < /tmp/msh_test_read_in && test $p = a\\ && test $q = b && test $r = c\\", 0},
+    {"( read p && read -r q && cat | read rest && test $rest = x:y:z ) < /tmp/msh_test_read_in", 0},
+    {"( read p && read q && read -d : r && cat | read rest && test $rest = y:z ) < /tmp/msh_test_read_in", 0},
+    {"echo x:y:z | ( read -d : p && read -d : q && test $q = y )", 0},
+    {"echo x::z | ( IFS=: && read a b c && test $c = z )", 0},
+    {"echo x:y:z | ( IFS=: && read a rest && test $rest = y:z )", 0},
+    {"read -d 2> /dev/null", 2},
+    {"timeout 0.1 sleep 5", 124},
+    {"timeout 0.1 sleep 0.2 | read x < <(sleep 0.3 && echo hi)", 124},
+    {"{ true; false; } > /dev/null", 1},
+    {"( cd /tmp; false ) || test -d proc", 0},
+    {"let x=(1+2)*3 && (x=1) && test $x -eq 9", 0},
+    {"f() { local x=1; return $((x + 3)); }; f", 4},
+    {"seq 1000 | meter -n t 2> /dev/null | wc -l > /dev/null", 0},
+    {"for i in 1 2 3; do let n=n+i; done; test $n -eq 6", 0},
+    {"i=0; while let 3-i; do let i=i+1; done; test $i -eq 3", 0},
+    {"until let i==0; do let i=i-1; done; test $i -eq 0", 0},
+    {"if false; then v=1; elif true; then v=2; else v=3; fi; test $v -eq 2", 0},
+    {"if true\nthen\n  for w in a b\n  do\n    false\n  done\nfi", 1},
+    {"while true; do", 2},
+    {"exit 7", 7},
+};
 
-// Function to execute command from terminal
-int execShell(char **args) {
-    if (args[0] == NULL) {
+int main(int argc, char **argv) {
+    struct msh_ctx *ctx;
+    int status, failed = 0;
+    char cwd[4096], after[4096];
+    // Lookups and memo go through caches of the checks' own
+    if (argc == 1) {
+        setenv("MYSHLL_CMD_CACHE", "/tmp/msh_test_cmdcache", 1);
+        setenv("MYSHLL_MEMO_DIR", "/tmp/msh_test_memo", 1);
+        // For checks that run this driver again, as $MSH_TEST -i
+        char *self = realpath(argv[0], NULL);
+        setenv("MSH_TEST", self ? self : argv[0], 1);
+        free(self);
+        unlink("/tmp/msh_test_cmdcache");
+    }
+    if ((ctx = msh_ctx_new()) == NULL) {
+        perror("msh_ctx_new");
         return 1;
     }
-    char **expanded_args = expand_wildcards(args); // Now expand_wildcards returns char **
-    if (expanded_args == NULL) {
-        return 1;
+    // With -i, an interactive session on stdin, for what only those have
+    if (argc == 2 && strcmp(argv[1], "-i") == 0) {
+        if (msh_interact(ctx, &status) == -1) {
+            status = 1;
+        }
+        msh_ctx_free(ctx);
+        return status;
     }
-
-    // Loop to check for builtin functions
-    for (int i = 1; i < numBuiltin(); i++) {
-        if (strcmp(expanded_args[0], builtin_cmd[i]) == 0) {
-            int result = (*builtin_func[i])(expanded_args);
-            free(expanded_args); // Free memory allocated by expand_wildcards
-            return result;
+    if (argc > 1) {
+        for (int i = 1; i < argc && !msh_quit(ctx); i++) {
+            msh_run_line(ctx, argv[i], &status);
+            printf("[%d] %s\n", status, argv[i]);
         }
+        msh_ctx_free(ctx);
+        return 0;
     }
 
-    // Handle redirection
-    if (myShell_execute(expanded_args)) {
-        free(expanded_args); // Free memory allocated by expand_wildcards
-        LastComStat = 1;
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd");
         return 1;
     }
-
-    // If no piping or redirection, launch command normally
-    int result = myShellLaunch(expanded_args);
-    free(expanded_args); // Free memory allocated by expand_wildcards
-    return result;
-}
-
-// When myShell is called Interactively
-int myShellInteract() {
-    char *line;
-    char **args;
-    while (QUIT == 0) {
-        printf("%s> ", SHELL_NAME);
-        line = readLine();
-        args = splitLine(line);
-        //Do Shell
-        if (strcmp(args[0], "then") == 0 && LastComStat == 0){
-            printf("nope\n");
-            LastComStat = 0;
-        } else if (strcmp(args[0], "else") == 0 && LastComStat == 1){
-            printf("nope\n");
-            LastComStat = 0;
-        } else if (strcmp(args[0], "then") == 0 || strcmp(args[0], "else") == 0){
-            execShell(args + 1);
-        } else {
-            execShell(args);
+    for (size_t i = 0; i < sizeof(SCRIPTS) / sizeof(SCRIPTS[0]); i++) {
+        FILE *f = fopen(SCRIPTS[i].path, "w");
+        if (f == NULL) {
+            perror(SCRIPTS[i].path);
+            return 1;
         }
-        free(line);
-        free(args);
+        fputs(SCRIPTS[i].text, f);
+        fclose(f);
     }
-    return 1;
-}
-
-// When myShell is called with a Script as Argument
-int myShellBatch(FILE *filename) {
-    char line[MAX_COMMAND_LENGTH];
-    char **args;
-    if (filename == NULL) {
-        printf("\nUnable to open file.");
-        return 1;
-    } else {
-        printf("\nFile Opened. Parsing. Parsed commands displayed first.");
-        while (fgets(line, sizeof(line), filename) != NULL) {
-            printf("\n%s", line);
-            args = splitLine(line);
-            execShell(args);
+    for (size_t i = 0; i < sizeof(CHECKS) / sizeof(CHECKS[0]); i++) {
+        if (msh_run_line(ctx, CHECKS[i].line, &status) == -1 || status != CHECKS[i].status) {
+            printf("FAIL: %s: status %d, expected %d\n", CHECKS[i].line, status, CHECKS[i].status);
+            failed++;
         }
     }
-    free(args);
-    fclose(filename);
-    return 1;
-}
-
-int BMCheck(int argc, char *argv[]) {
-    // Check if there are command-line arguments
-    if (argc > 1) {
-        return 1; // Running in batch mode
+    // The context's cd and exit must not leak into the caller
+    if (msh_run_line(ctx, "true", &status) != -1) {
+        printf("FAIL: context ran a line after exit\n");
+        failed++;
     }
-
-    // Check if input is being piped
-    if (!isatty(fileno(stdin))) {
-        return 1; // Running in batch mode
+    if (getcwd(after, sizeof(after)) == NULL || strcmp(cwd, after) != 0) {
+        printf("FAIL: cd changed the caller's directory\n");
+        failed++;
     }
-
-    return 0; // Running in interactive mode
-}
-
-int main(int argc, char **argv) {
-    // Parsing commands Interactive mode or Script Mode
-    if (BMCheck(argc, argv)) {
-        if (argc > 1) {
-            printf("Running in batch mode with file: %s\n", argv[1]);
-            FILE *file = fopen(argv[1], "r");
-            if (file == NULL) {
-                perror("Error opening file");
-                return 1;
-            }
-            myShellBatch(file);
-        } else {
-            printf("Running in batch mode with piped input\n");
-            myShellBatch(stdin);
-        }
-
-    } else {
-        printf("Running in interactive mode\n");
-        printf("Welcome to your personal Shell!!\n");
-        myShellInteract();
-
+    msh_ctx_free(ctx);
+    for (size_t i = 0; i < sizeof(SCRIPTS) / sizeof(SCRIPTS[0]); i++) {
+        unlink(SCRIPTS[i].path);
     }
-    
-    // Exit the Shell
-    return EXIT_SUCCESS;
+    unlink("/tmp/msh_test_cmdcache");
+    printf("%d of %zu checks failed\n", failed, sizeof(CHECKS) / sizeof(CHECKS[0]) + 2);
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,7404 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <termios.h>
+#include "myshell.h"
+
+static char SHELL_NAME[50] = "myShell";
+static int QUIT = 0;
+static int LastComStat = 0;   // 1 if the last command succeeded, for then/else
+static int LastStatus = 0;    // exit status of the last command, as $?
+static int PIPEFAIL = 0;      // a pipeline fails if any stage fails, not just the last
+static int TAIL_EXEC = 0;     // a script's last command replaces the shell instead of being forked
+
+#define MAX_COMMAND_LENGTH 1024
+
+// An allocation failure unwinds to the library call running on this
+// thread, which then returns -1. Only a forked child exits.
+static __thread jmp_buf *ALLOC_UNWIND;
+static pid_t ALLOC_PID;
+
+static void allocUnwind() {
+    if (ALLOC_UNWIND != NULL && getpid() == ALLOC_PID) {
+        longjmp(*ALLOC_UNWIND, 1);
+    }
+    exit(EXIT_FAILURE);
+}
+
+static void allocFailed() {
+    fprintf(stderr, "%s: Buffer Allocation Error.\n", SHELL_NAME);
+    allocUnwind();
+}
+
+// Function to read a line from command into the buffer
+static char *readLine() {
+    char *line = (char *)malloc(sizeof(char) * 1024);
+    char c;
+    int pos = 0, bufsize = 1024;
+    if (!line) {
+        allocFailed();
+    }
+    while (1) {
+        c = getchar();
+        if (c == EOF || c == '\n') {
+            line[pos] = '\0';
+            return line;
+        } else {
+            line[pos] = c;
+        }
+        pos++;
+        if (pos >= bufsize) {
+            bufsize += 1024;
+            line = realloc(line, sizeof(char) * bufsize);
+            if (!line) {
+                allocFailed();
+            }
+        }
+    }
+}
+
+// Operators that always form a token of their own, longest first
+static char *OPERATORS[] = {"&&", "||", ";", "|", "&", "(", ")", NULL};
+
+static int redirLength(const char *p);
+static size_t groupLength(const char *p);
+
+// Function to split a line into tokens. Words are separated by whitespace
+// and operators; a newline between two lines of a command is a token of its
+// own, including redirections such as 2>&1, split off even
+// without surrounding spaces; an arithmetic expansion $(( ... )) or a
+// process substitution <( ... ) is never split. The token array
+// and the token text share one allocation, so the caller frees the result
+// once and the line itself is left untouched.
+static char **splitLine(char *line) {
+    size_t len = strlen(line);
+    char **tokens = (char **)malloc(sizeof(char *) * (len + 1) + 2 * len + 1);
+    char *text;
+    char delim[10] = " \t\n\r\a";
+    int pos = 0;
+    if (!tokens) {
+        allocFailed();
+    }
+    text = (char *)(tokens + len + 1);
+    while (*line) {
+        // A newline inside a command spanning lines separates like ;
+        if (*line == '\n' && pos > 0 && line[strspn(line, delim)] != '\0') {
+            tokens[pos++] = text;
+            *text++ = *line++;
+            *text++ = '\0';
+            continue;
+        }
+        if (strchr(delim, *line)) {
+            line++;
+            continue;
+        }
+        tokens[pos++] = text;
+        // Process substitution, which would otherwise start with a redirection
+        if ((line[0] == '<' || line[0] == '>') && line[1] == '(') {
+            size_t n = groupLength(line);
+            memcpy(text, line, n);
+            text += n;
+            line += n;
+            goto done;
+        }
+        int n = redirLength(line);
+        if (n > 0) {
+            memcpy(text, line, n);
+            text += n;
+            line += n;
+            goto done;
+        }
+        for (int i = 0; OPERATORS[i] != NULL; i++) {
+            size_t n = strlen(OPERATORS[i]);
+            if (strncmp(line, OPERATORS[i], n) == 0) {
+                memcpy(text, line, n);
+                text += n;
+                line += n;
+                goto done;
+            }
+        }
+        // Once a word has an =, as in let x=(1+2)*3, balanced parentheses
+        // belong to it; a ) it did not open still ends it, as in (x=1)
+        for (int assign = 0, depth = 0; *line && !strchr(delim, *line); ) {
+            if (strchr(";|&<>", *line) || (*line == '(' && !assign) || (*line == ')' && depth == 0)) {
+                break;
+            }
+            assign |= *line == '=';
+            depth += (*line == '(') - (*line == ')');
+            // $(( ... )) stays in one word whatever it contains
+            if (strncmp(line, "$((", 3) == 0) {
+                size_t n = groupLength(line);
+                memcpy(text, line, n);
+                text += n;
+                line += n;
+                continue;
+            }
+            *text++ = *line++;
+        }
+    done:
+        *text++ = '\0';
+    }
+    tokens[pos] = NULL;
+    return tokens;
+}
+
+static int isOperator(char *token, char *op) {
+    return token != NULL && op != NULL && strcmp(token, op) == 0;
+}
+
+// Command lists. A line parses into a tree of commands joined by ; && ||
+// or newlines, with & running the preceding and-or list in the background.
+// A list in { ... } runs as a group in the shell and one in ( ... ) in a
+// forked subshell. Those, if/elif/else/fi and the for, while and until
+// loops are compound commands: each may be followed by redirections that
+// apply to all of it, and be a stage of a pipeline. Loop bodies are parsed
+// once and the tree is run again on every iteration. NAME() followed by a
+// compound command defines a function with it as the body.
+// Commands are slices of the token array: the parser overwrites each list
+// operator with NULL, so a command's words are NULL-terminated in place.
+enum node_type {
+    NODE_COMMAND, NODE_AND, NODE_OR, NODE_SEQ, NODE_BACKGROUND, NODE_GROUP, NODE_SUBSHELL, NODE_PIPE,
+    NODE_IF, NODE_WHILE, NODE_UNTIL, NODE_FOR, NODE_FUNCTION
+};
+
+struct node {
+    enum node_type type;
+    char **args;            // NODE_COMMAND; the words after "in" for NODE_FOR, NULL without "in"
+    char **redirs;          // after a compound command, NULL if none
+    char *name;             // NODE_FOR's variable, NODE_FUNCTION's name
+    struct node *left;      // NODE_AND, NODE_OR, NODE_SEQ, NODE_BACKGROUND, NODE_PIPE; a group's
+    struct node *right;     //   list; the condition of if, while and until; for's body in right;
+                            //   a function's body in left
+    struct node *alt;       // NODE_IF: the elif or else branch, NULL if none
+    int builtin;            // NODE_COMMAND: see plainBuiltin(), -2 until first run
+};
+
+static struct node *newNode(enum node_type type, char **args, struct node *left, struct node *right) {
+    struct node *n = malloc(sizeof(struct node));
+    if (!n) {
+        allocFailed();
+    }
+    n->type = type;
+    n->args = args;
+    n->redirs = NULL;
+    n->name = NULL;
+    n->left = left;
+    n->right = right;
+    n->alt = NULL;
+    n->builtin = -2;
+    return n;
+}
+
+static void freeNode(struct node *n) {
+    if (n == NULL) {
+        return;
+    }
+    freeNode(n->left);
+    freeNode(n->right);
+    freeNode(n->alt);
+    free(n);
+}
+
+// Set on threads that parse ahead of execution; the error is reported
+// when the line's turn comes
+static __thread int SYNTAX_QUIET = 0;
+
+static void syntaxError(char *token) {
+    if (SYNTAX_QUIET) {
+        return;
+    }
+    fprintf(stderr, "%s: syntax error near unexpected token `%s'\n", SHELL_NAME, token ? token : "newline");
+}
+
+// Set by the parser when the tokens end inside a command that is not
+// finished, such as an if without its fi; the next line continues it
+static __thread int PARSE_INCOMPLETE = 0;
+
+// Set by parseLines() when a line with words in it did not parse. The
+// parser overwrites tokens as it goes, so they cannot tell afterwards.
+static __thread int PARSE_FAILED = 0;
+
+// A syntax error at the end of the tokens only means more is to come
+static void parseError(char *token) {
+    if (token == NULL) {
+        PARSE_INCOMPLETE = 1;
+    } else {
+        syntaxError(token);
+    }
+}
+
+static int isListOperator(char *token) {
+    return isOperator(token, ";") || isOperator(token, "&") || isOperator(token, "&&") || isOperator(token, "||") ||
+           isOperator(token, "\n");
+}
+
+// Whether token is one of the space-separated words
+static int isKeyword(char *token, char *words) {
+    size_t len;
+    if (token == NULL || words == NULL) {
+        return 0;
+    }
+    len = strlen(token);
+    for (char *w = strstr(words, token); w != NULL; w = strstr(w + 1, token)) {
+        if ((w == words || w[-1] == ' ') && (w[len] == ' ' || w[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Words that start a compound command
+static int startsCompound(char *token) {
+    return isKeyword(token, "{ ( if while until for");
+}
+
+static void skipNewlines(char **tokens, int *pos) {
+    while (isOperator(tokens[*pos], "\n")) {
+        tokens[(*pos)++] = NULL;
+    }
+}
+
+static int redirTakesTarget(char *token);
+static int isName(const char *word);
+static struct node *parseList(char **tokens, int *pos, char *close);
+static struct node *parseStage(char **tokens, int *pos);
+
+// The redirections after a compound command, into n->redirs
+static int parseRedirs(char **tokens, int *pos, struct node *n) {
+    int start = *pos;
+    while (tokens[*pos] != NULL && !isListOperator(tokens[*pos]) && !isOperator(tokens[*pos], "|") &&
+           !isOperator(tokens[*pos], ")") && !isOperator(tokens[*pos], "}")) {
+        int needs_target = redirTakesTarget(tokens[*pos]);
+        if (needs_target == -1) {
+            parseError(tokens[*pos]);
+            return -1;
+        }
+        if (needs_target && (++(*pos), tokens[*pos] == NULL || isListOperator(tokens[*pos]) ||
+                             isOperator(tokens[*pos], "|") || isOperator(tokens[*pos], ")"))) {
+            // A missing file name is an error even at the end of the line
+            syntaxError(tokens[*pos]);
+            return -1;
+        }
+        (*pos)++;
+    }
+    n->redirs = *pos > start ? tokens + start : NULL;
+    return 0;
+}
+
+// A list ended by one of the words in close, which is consumed. NULL if the
+// list is empty or missing its end.
+static struct node *parseBody(char **tokens, int *pos, char *close) {
+    struct node *list = parseList(tokens, pos, close);
+    if (list == NULL || !isKeyword(tokens[*pos], close)) {
+        if (!PARSE_INCOMPLETE && (list != NULL || isKeyword(tokens[*pos], close))) {
+            parseError(tokens[*pos]);
+        }
+        freeNode(list);
+        return NULL;
+    }
+    return list;
+}
+
+// A { ... } or ( ... )
+static struct node *parseGroup(char **tokens, int *pos) {
+    char *close = isOperator(tokens[*pos], "{") ? "}" : ")";
+    enum node_type type = *close == '}' ? NODE_GROUP : NODE_SUBSHELL;
+    tokens[(*pos)++] = NULL;
+    struct node *list = parseBody(tokens, pos, close);
+    if (list == NULL) {
+        return NULL;
+    }
+    tokens[(*pos)++] = NULL;
+    return newNode(type, NULL, list, NULL);
+}
+
+// if list then list [elif list then list]... [else list] fi, from the
+// word after if or elif
+static struct node *parseIf(char **tokens, int *pos) {
+    struct node *n = newNode(NODE_IF, NULL, NULL, NULL);
+    tokens[(*pos)++] = NULL;
+    if ((n->left = parseBody(tokens, pos, "then")) == NULL) {
+        freeNode(n);
+        return NULL;
+    }
+    tokens[(*pos)++] = NULL;
+    if ((n->right = parseBody(tokens, pos, "elif else fi")) == NULL) {
+        freeNode(n);
+        return NULL;
+    }
+    if (isOperator(tokens[*pos], "elif")) {
+        // The elif's own if takes the fi
+        n->alt = parseIf(tokens, pos);
+        if (n->alt == NULL) {
+            freeNode(n);
+            return NULL;
+        }
+        return n;
+    }
+    if (isOperator(tokens[*pos], "else")) {
+        tokens[(*pos)++] = NULL;
+        if ((n->alt = parseBody(tokens, pos, "fi")) == NULL) {
+            freeNode(n);
+            return NULL;
+        }
+    }
+    tokens[(*pos)++] = NULL;
+    return n;
+}
+
+// while list do list done, or until
+static struct node *parseWhile(char **tokens, int *pos) {
+    struct node *n = newNode(isOperator(tokens[*pos], "while") ? NODE_WHILE : NODE_UNTIL, NULL, NULL, NULL);
+    tokens[(*pos)++] = NULL;
+    if ((n->left = parseBody(tokens, pos, "do")) == NULL) {
+        freeNode(n);
+        return NULL;
+    }
+    tokens[(*pos)++] = NULL;
+    if ((n->right = parseBody(tokens, pos, "done")) == NULL) {
+        freeNode(n);
+        return NULL;
+    }
+    tokens[(*pos)++] = NULL;
+    return n;
+}
+
+// for NAME [in WORD...] do list done, with ; or a newline before do
+static struct node *parseFor(char **tokens, int *pos) {
+    struct node *n = newNode(NODE_FOR, NULL, NULL, NULL);
+    tokens[(*pos)++] = NULL;
+    if (tokens[*pos] == NULL || !isName(tokens[*pos])) {
+        parseError(tokens[*pos]);
+        freeNode(n);
+        return NULL;
+    }
+    n->name = tokens[(*pos)++];
+    if (isOperator(tokens[*pos], "in")) {
+        tokens[(*pos)++] = NULL;
+        n->args = tokens + *pos;
+        while (tokens[*pos] != NULL && !isOperator(tokens[*pos], ";") && !isOperator(tokens[*pos], "\n")) {
+            if (isListOperator(tokens[*pos]) || isOperator(tokens[*pos], "|") || isOperator(tokens[*pos], "(") ||
+                isOperator(tokens[*pos], ")") || redirLength(tokens[*pos]) > 0) {
+                parseError(tokens[*pos]);
+                freeNode(n);
+                return NULL;
+            }
+            (*pos)++;
+        }
+    }
+    if (isOperator(tokens[*pos], ";")) {
+        tokens[(*pos)++] = NULL;
+    }
+    skipNewlines(tokens, pos);
+    if (!isOperator(tokens[*pos], "do")) {
+        parseError(tokens[*pos]);
+        freeNode(n);
+        return NULL;
+    }
+    tokens[(*pos)++] = NULL;
+    if ((n->right = parseBody(tokens, pos, "done")) == NULL) {
+        freeNode(n);
+        return NULL;
+    }
+    tokens[(*pos)++] = NULL;
+    return n;
+}
+
+// NAME ( ) compound-command. The body keeps its own redirections, which
+// apply on every call.
+static struct node *parseFunction(char **tokens, int *pos) {
+    struct node *n = newNode(NODE_FUNCTION, NULL, NULL, NULL);
+    n->name = tokens[*pos];
+    for (int i = 0; i < 3; i++) {
+        tokens[(*pos)++] = NULL;
+    }
+    skipNewlines(tokens, pos);
+    if (!startsCompound(tokens[*pos])) {
+        parseError(tokens[*pos]);
+        freeNode(n);
+        return NULL;
+    }
+    if ((n->left = parseStage(tokens, pos)) == NULL) {
+        freeNode(n);
+        return NULL;
+    }
+    return n;
+}
+
+// A pipeline stage: a compound command with its redirections, or words up
+// to a list operator. The words may hold a whole pipeline of simple
+// commands, which is split when it runs; a | is only taken here when a
+// compound command follows it.
+static struct node *parseStage(char **tokens, int *pos) {
+    int start = *pos;
+    struct node *n = NULL;
+    if (isOperator(tokens[*pos], "{") || isOperator(tokens[*pos], "(")) {
+        n = parseGroup(tokens, pos);
+    } else if (isOperator(tokens[*pos], "if")) {
+        n = parseIf(tokens, pos);
+    } else if (isOperator(tokens[*pos], "while") || isOperator(tokens[*pos], "until")) {
+        n = parseWhile(tokens, pos);
+    } else if (isOperator(tokens[*pos], "for")) {
+        n = parseFor(tokens, pos);
+    } else if (tokens[*pos] != NULL && isName(tokens[*pos]) && isOperator(tokens[*pos + 1], "(") &&
+               isOperator(tokens[*pos + 2], ")")) {
+        return parseFunction(tokens, pos);
+    } else if (isKeyword(tokens[*pos], "do done elif fi")) {
+        // Closes nothing here; then and else still work as line prefixes
+        parseError(tokens[*pos]);
+        return NULL;
+    } else {
+        while (tokens[*pos] != NULL && !isListOperator(tokens[*pos]) && !isOperator(tokens[*pos], "(") &&
+               !isOperator(tokens[*pos], ")") && !(isOperator(tokens[*pos], "|") && startsCompound(tokens[*pos + 1]))) {
+            (*pos)++;
+        }
+        if (*pos == start || isOperator(tokens[*pos], "(")) {
+            parseError(tokens[*pos]);
+            return NULL;
+        }
+        return newNode(NODE_COMMAND, tokens + start, NULL, NULL);
+    }
+    if (n != NULL && parseRedirs(tokens, pos, n) == -1) {
+        freeNode(n);
+        return NULL;
+    }
+    return n;
+}
+
+// stage ('|' stage)*, for pipelines with a compound command in them
+static struct node *parseCommand(char **tokens, int *pos) {
+    struct node *left = parseStage(tokens, pos);
+    if (left != NULL && isOperator(tokens[*pos], "|")) {
+        tokens[(*pos)++] = NULL;
+        skipNewlines(tokens, pos);
+        struct node *right = parseCommand(tokens, pos);
+        if (right == NULL) {
+            freeNode(left);
+            return NULL;
+        }
+        left = newNode(NODE_PIPE, NULL, left, right);
+    }
+    return left;
+}
+
+// command (('&&' | '||') command)*
+static struct node *parseAndOr(char **tokens, int *pos) {
+    struct node *left = parseCommand(tokens, pos);
+    while (left != NULL && (isOperator(tokens[*pos], "&&") || isOperator(tokens[*pos], "||"))) {
+        enum node_type type = isOperator(tokens[*pos], "&&") ? NODE_AND : NODE_OR;
+        tokens[(*pos)++] = NULL;
+        skipNewlines(tokens, pos);
+        struct node *right = parseCommand(tokens, pos);
+        if (right == NULL) {
+            freeNode(left);
+            return NULL;
+        }
+        left = newNode(type, NULL, left, right);
+    }
+    return left;
+}
+
+// and_or ((';' | '&' | newline) and_or)* [';' | '&'], up to the end of the
+// tokens or to one of the words in close, such as the fi ending an if.
+// Returns NULL for an empty list or on a syntax error, which has already
+// been reported unless PARSE_INCOMPLETE is set.
+static struct node *parseList(char **tokens, int *pos, char *close) {
+    struct node *list = NULL;
+    skipNewlines(tokens, pos);
+    while (tokens[*pos] != NULL && !isKeyword(tokens[*pos], close)) {
+        struct node *item = parseAndOr(tokens, pos);
+        if (item == NULL) {
+            freeNode(list);
+            return NULL;
+        }
+        if (isOperator(tokens[*pos], "&")) {
+            item = newNode(NODE_BACKGROUND, NULL, item, NULL);
+        }
+        list = list ? newNode(NODE_SEQ, NULL, list, item) : item;
+        if (isOperator(tokens[*pos], ";") || isOperator(tokens[*pos], "&") || isOperator(tokens[*pos], "\n")) {
+            tokens[(*pos)++] = NULL;
+            skipNewlines(tokens, pos);
+        } else if (tokens[*pos] != NULL && !isKeyword(tokens[*pos], close)) {
+            // A ) or } that closes nothing
+            parseError(tokens[*pos]);
+            freeNode(list);
+            return NULL;
+        }
+    }
+    if (close != NULL && tokens[*pos] == NULL) {
+        PARSE_INCOMPLETE = 1;
+    }
+    return list;
+}
+
+static struct node *parseLine(char **tokens) {
+    int pos = 0;
+    PARSE_INCOMPLETE = 0;
+    return parseList(tokens, &pos, NULL);
+}
+
+// Function Declarations
+static int myShell_cd(char **args);
+static int myShell_exit(char **args);
+static char **expand_wildcards(char *tokens[]);
+static int countArgs(char **args);
+static void freeArgs(char **args);
+static int myShell_pwd();
+static int myShell_which(char **args);
+static int myShell_history(char **args);
+static int myShell_set(char **args);
+static int myShell_ulimit(char **args);
+static int myShell_sched(char **args);
+static int myShell_wait(char **args);
+static int myShell_jobs(char **args);
+static int myShell_memo(char **args);
+static int myShell_onchange(char **args);
+static int myShell_let(char **args);
+static int myShell_read(char **args);
+static int myShell_exec(char **args);
+static int myShell_local(char **args);
+static int myShell_return(char **args);
+static int myShell_alias(char **args);
+static int myShell_unalias(char **args);
+static int myShell_call(char **args);
+static int myShell_meter(char **args);
+static int lookupCommand(const char *name, char *out, size_t size);
+
+
+// Definitions
+static char *builtin_cmd[] = {"cd", "exit", "pwd", "which", "history", "set", "ulimit", "sched", "wait", "jobs", "memo", "on-change", "let", "read", "exec", "local", "return", "alias", "unalias", "meter"};
+
+static int (*builtin_func[])(char **) = {&myShell_cd, &myShell_exit, &myShell_pwd, &myShell_which, &myShell_history, &myShell_set, &myShell_ulimit, &myShell_sched, &myShell_wait, &myShell_jobs, &myShell_memo, &myShell_onchange, &myShell_let, &myShell_read, &myShell_exec, &myShell_local, &myShell_return, &myShell_alias, &myShell_unalias, &myShell_meter, &myShell_call};
+
+static int numBuiltin() {
+    return sizeof(builtin_cmd) / sizeof(char *);
+}
+
+// builtinIndex() of a call to a shell function. Its entry, past the named
+// builtins, runs the function named by args[0].
+#define FUNC_CALL numBuiltin()
+
+// Builtin command definitions
+static int myShell_cd(char **args) {
+    if (args[1] == NULL) {
+        printf("myShell: expected argument to \"cd\"\n");
+    } else {
+        if (chdir(args[1]) != 0) {
+            perror("myShell: ");
+            return 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+static int myShell_exit(char **args) {
+    QUIT = 1;
+    // The shell exits with the given status, or that of the last command
+    return args[1] != NULL ? atoi(args[1]) & 0xff : LastStatus;
+}
+
+static int myShell_set(char **args) {
+    if (args[1] == NULL || args[2] == NULL) {
+        printf("pipefail\t%s\n", PIPEFAIL ? "on" : "off");
+        printf("tailexec\t%s\n", TAIL_EXEC ? "on" : "off");
+        return 0;
+    }
+    if (strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0) {
+        fprintf(stderr, "set: usage: set [-o|+o] pipefail|tailexec\n");
+        return 1;
+    }
+    if (strcmp(args[2], "pipefail") == 0) {
+        PIPEFAIL = args[1][0] == '-';
+    } else if (strcmp(args[2], "tailexec") == 0) {
+        TAIL_EXEC = args[1][0] == '-';
+    } else {
+        fprintf(stderr, "set: usage: set [-o|+o] pipefail|tailexec\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int myShell_pwd(){
+    // dynamic array?????
+    char pwd[1024]; 
+
+    if (getcwd(pwd, sizeof(pwd)) != NULL) {
+        printf("%s\n", pwd);
+    } else {
+        perror("pwd error");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int myShell_which(char **args) {
+    int argc = 0;
+
+    // Count the number of arguments
+    while (args[argc] != NULL) {
+        argc++;
+    }
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <program_name>\n", args[0]);
+        return 1; // Return error code 1 for wrong number of arguments
+    }
+
+    char *program_name = args[1];
+    
+    /*
+    if(strcmp(program_name, "exit") == 0 || strcmp(program_name, "cd") == 0 || strcmp(program_name, "pwd") == 0 || strcmp(program_name, "which") == 0) {
+        printf("Built-in Command does not have Path\n");
+        return 1; 
+    }
+    */
+    
+
+    char file_path[1024];
+
+    if (getenv("PATH") == NULL) {
+        fprintf(stderr, "Error: PATH environment variable is not set.\n");
+        return 1;
+    }
+
+    if (lookupCommand(program_name, file_path, sizeof(file_path)) == 0) {
+        printf("%s\n", file_path);
+        return 0;
+    }
+
+    fprintf(stderr, "%s: program not found\n", args[1]);
+    return 1;
+}
+
+// History is an append-only log of NUL-terminated entries plus a side index
+// of 64-bit entry offsets. Both files are mmap'd, so opening a history of any
+// size costs O(1) and entry n is a single array lookup. Appends hold an flock,
+// so concurrent sessions never interleave entries. The log is O_APPEND; an
+// index entry is written at the index size rounded down to a whole entry,
+// so a torn entry is overwritten by the next rather than shifting them all.
+#define HISTORY_FILE ".myshll_history"
+#define HISTORY_SEARCH_WINDOW (1 << 16)
+
+struct history {
+    int log_fd;
+    int idx_fd;
+    const char *log;        // mapped log, log_len bytes
+    size_t log_len;
+    const uint64_t *idx;    // mapped index, count usable entries
+    size_t idx_len;
+    size_t count;
+};
+
+static struct history HIST = {-1, -1, NULL, 0, NULL, 0, 0};
+
+// (Re)map the log and index if another session has grown them.
+static void historyMap() {
+    struct stat log_st, idx_st;
+    if (HIST.log_fd == -1 || fstat(HIST.log_fd, &log_st) == -1 || fstat(HIST.idx_fd, &idx_st) == -1) {
+        return;
+    }
+    if ((size_t)log_st.st_size != HIST.log_len) {
+        if (HIST.log != NULL) {
+            munmap((void *)HIST.log, HIST.log_len);
+        }
+        HIST.log = NULL;
+        HIST.log_len = 0;
+        if (log_st.st_size > 0) {
+            void *m = mmap(NULL, log_st.st_size, PROT_READ, MAP_SHARED, HIST.log_fd, 0);
+            if (m != MAP_FAILED) {
+                HIST.log = m;
+                HIST.log_len = log_st.st_size;
+            }
+        }
+    }
+    if ((size_t)idx_st.st_size != HIST.idx_len) {
+        if (HIST.idx != NULL) {
+            munmap((void *)HIST.idx, HIST.idx_len);
+        }
+        HIST.idx = NULL;
+        HIST.idx_len = 0;
+        if (idx_st.st_size > 0) {
+            void *m = mmap(NULL, idx_st.st_size, PROT_READ, MAP_SHARED, HIST.idx_fd, 0);
+            if (m != MAP_FAILED) {
+                HIST.idx = m;
+                HIST.idx_len = idx_st.st_size;
+            }
+        }
+    }
+
+    // Ignore a torn index tail, which the next append overwrites, or
+    // entries whose text has not fully landed
+    HIST.count = HIST.idx_len / sizeof(uint64_t);
+    while (HIST.count > 0) {
+        uint64_t off = HIST.idx[HIST.count - 1];
+        if (off < HIST.log_len && memchr(HIST.log + off, '\0', HIST.log_len - off) != NULL) {
+            break;
+        }
+        HIST.count--;
+    }
+}
+
+// Open (creating if needed) the history files under $HOME.
+static int historyOpen() {
+    char path[1024];
+    char *home = getenv("HOME");
+    if (HIST.log_fd != -1) {
+        return 0;
+    }
+    if (home == NULL) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+    HIST.log_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    snprintf(path, sizeof(path), "%s/%s.idx", home, HISTORY_FILE);
+    HIST.idx_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (HIST.log_fd == -1 || HIST.idx_fd == -1) {
+        perror("history");
+        if (HIST.log_fd != -1) {
+            close(HIST.log_fd);
+        }
+        if (HIST.idx_fd != -1) {
+            close(HIST.idx_fd);
+        }
+        HIST.log_fd = HIST.idx_fd = -1;
+        return -1;
+    }
+    historyMap();
+    return 0;
+}
+
+// Entry n (0-based), or NULL if out of range.
+static const char *historyGet(long n) {
+    if (n < 0 || (size_t)n >= HIST.count) {
+        return NULL;
+    }
+    return HIST.log + HIST.idx[n];
+}
+
+// Append a line to the history, skipping blanks and immediate repeats.
+static void historyAdd(const char *line) {
+    size_t len = strlen(line);
+    struct stat st, idx_st;
+    uint64_t off;
+    if (HIST.log_fd == -1 || strspn(line, " \t\r\n") == len) {
+        return;
+    }
+    historyMap();
+    if (HIST.count > 0 && strcmp(historyGet(HIST.count - 1), line) == 0) {
+        return;
+    }
+    if (flock(HIST.log_fd, LOCK_EX) == -1) {
+        perror("history");
+        return;
+    }
+    // Writing the text before its offset means readers never see an index
+    // entry that points past the data.
+    if (fstat(HIST.log_fd, &st) == 0 && fstat(HIST.idx_fd, &idx_st) == 0) {
+        off = st.st_size;
+        if (write(HIST.log_fd, line, len + 1) == (ssize_t)(len + 1)) {
+            off_t at = idx_st.st_size - idx_st.st_size % sizeof(off);
+            if (pwrite(HIST.idx_fd, &off, sizeof(off), at) != sizeof(off)) {
+                perror("history");
+            }
+        } else {
+            perror("history");
+        }
+    }
+    flock(HIST.log_fd, LOCK_UN);
+    historyMap();
+}
+
+// Index of the entry containing log offset off.
+static long historyEntryAt(size_t off) {
+    long lo = 0, hi = (long)HIST.count - 1;
+    while (lo < hi) {
+        long mid = lo + (hi - lo + 1) / 2;
+        if (HIST.idx[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Find the newest entry older than `before` that contains needle. Entries are
+// contiguous in the mapping, so this runs memmem over large windows walking
+// backwards from the end instead of visiting entries one by one. Returns the
+// entry index or -1.
+static long historySearch(const char *needle, long before) {
+    size_t nlen = strlen(needle);
+    size_t end, hi;
+    historyMap();
+    if (before > (long)HIST.count) {
+        before = HIST.count;
+    }
+    if (before <= 0 || nlen == 0) {
+        return -1;
+    }
+    end = (size_t)before < HIST.count ? HIST.idx[before] : HIST.log_len;
+    hi = end;
+    while (hi > HIST.idx[0]) {
+        size_t lo = hi - HIST.idx[0] > HISTORY_SEARCH_WINDOW ? hi - HISTORY_SEARCH_WINDOW : HIST.idx[0];
+        // Scan past hi so a match straddling the window edge is still found
+        size_t top = hi + nlen - 1 < end ? hi + nlen - 1 : end;
+        while (top - lo >= nlen) {
+            const char *p = HIST.log + lo, *last = NULL;
+            while ((p = memmem(p, HIST.log + top - p, needle, nlen)) != NULL) {
+                last = p++;
+            }
+            if (last == NULL) {
+                break;
+            }
+            size_t off = last - HIST.log;
+            long n = historyEntryAt(off);
+            // A match can only fall outside an entry in an unindexed torn append
+            if (off + nlen <= HIST.idx[n] + strlen(HIST.log + HIST.idx[n])) {
+                return n;
+            }
+            top = off + nlen - 1;
+        }
+        hi = lo;
+    }
+    return -1;
+}
+
+// Expand a leading !!, !n or !-n history reference. Returns a newly allocated
+// line, the line itself if there is nothing to expand, or NULL on a bad event.
+static char *historyExpand(char *line) {
+    char *rest;
+    const char *entry;
+    long n;
+    if (line[0] != '!' || line[1] == '\0' || line[1] == ' ' || line[1] == '=') {
+        return line;
+    }
+    historyOpen();
+    historyMap();
+    if (line[1] == '!') {
+        n = (long)HIST.count - 1;
+        rest = line + 2;
+    } else {
+        n = strtol(line + 1, &rest, 10);
+        if (rest == line + 1) {
+            // !prefix recalls the newest entry starting with prefix
+            size_t plen = strcspn(line + 1, " \t");
+            rest = line + 1 + plen;
+            for (n = (long)HIST.count - 1; n >= 0; n--) {
+                if (strncmp(historyGet(n), line + 1, plen) == 0) {
+                    break;
+                }
+            }
+        } else {
+            n = n < 0 ? (long)HIST.count + n : n - 1;
+        }
+    }
+    entry = historyGet(n);
+    if (entry == NULL) {
+        fprintf(stderr, "%s: event not found\n", line);
+        return NULL;
+    }
+    char *out = malloc(strlen(entry) + strlen(rest) + 1);
+    if (!out) {
+        allocFailed();
+    }
+    strcpy(out, entry);
+    strcat(out, rest);
+    printf("%s\n", out);
+    return out;
+}
+
+static int myShell_history(char **args) {
+    long start = 0;
+    if (historyOpen() == -1) {
+        return 1;
+    }
+    historyMap();
+    if (args[1] != NULL) {
+        long n = atol(args[1]);
+        if (n < 0) {
+            fprintf(stderr, "history: %s: invalid count\n", args[1]);
+            return 1;
+        }
+        start = n < (long)HIST.count ? (long)HIST.count - n : 0;
+    }
+    for (long i = start; i < (long)HIST.count; i++) {
+        printf("%5ld  %s\n", i + 1, historyGet(i));
+    }
+    return 0;
+}
+
+// Convert a waitpid() status into a shell exit status
+static int exitStatus(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+// Redirections. Every redirection of a command resolves into one fd plan
+// that the child applies in order right before exec, so each command runs
+// exactly once whatever it is redirected to.
+enum redir_type { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP, REDIR_CLOSE };
+
+struct redir {
+    int fd;                 // fd being redirected
+    enum redir_type type;
+    char *target;           // file name for REDIR_IN, REDIR_OUT, REDIR_APPEND
+    int dup_fd;             // source fd for REDIR_DUP
+};
+
+struct command {
+    char **args;            // expanded argv
+    struct redir *redirs;
+    int num_redirs;
+    struct limits *limits;  // from a "limit" prefix, NULL if none
+    struct sched_policy *sched; // from a "sched" prefix, NULL if none
+    size_t fixed_args;      // words before the first wildcard expansion
+    int batch_jobs;         // from a "batch-args" prefix, 0 if none
+    double timeout;         // from a "timeout" prefix, 0 if none
+    double kill_after;
+    struct memo_spec *memo; // from a "memo" prefix, NULL if none
+    struct subst *subst;    // process substitutions in its words
+    int num_subst;
+};
+
+struct pipeline {
+    struct command *cmds;
+    int num_cmds;
+};
+
+// Length of the redirection operator at the start of p, or 0. Recognizes
+// [n]< [n]> [n]>> [n]>&m [n]<&m [n]>&- &> and &>>.
+static int redirLength(const char *p) {
+    const char *q = p;
+    if (q[0] == '&' && q[1] == '>') {
+        return q[2] == '>' ? 3 : 2;
+    }
+    while (*q >= '0' && *q <= '9') {
+        q++;
+    }
+    if (*q == '<' || *q == '>') {
+        if (q[0] == '>' && q[1] == '>') {
+            return q + 2 - p;
+        }
+        if (q[1] == '&') {
+            q += 2;
+            if (*q == '-') {
+                return q + 1 - p;
+            }
+            while (*q >= '0' && *q <= '9') {
+                q++;
+            }
+            return q - p;
+        }
+        return q + 1 - p;
+    }
+    return 0;
+}
+
+// Decode a redirection operator token into up to two plan entries (&> is
+// stdout to a file plus stderr onto stdout). Returns the number of entries,
+// 0 if the token is not a redirection, or -1 for N>& or <& with no
+// descriptor after it. *needs_target says whether the next word is the
+// file name.
+static int parseRedir(char *token, struct redir *r, int *needs_target) {
+    char *p = token;
+    int fd = -1;
+    if ((int)strlen(token) != redirLength(token)) {
+        return 0;
+    }
+    *needs_target = 1;
+    if (p[0] == '&') {
+        r[0] = (struct redir){1, p[2] == '>' ? REDIR_APPEND : REDIR_OUT, NULL, -1};
+        r[1] = (struct redir){2, REDIR_DUP, NULL, 1};
+        return 2;
+    }
+    if (*p >= '0' && *p <= '9') {
+        fd = strtol(p, &p, 10);
+    }
+    if (p[0] == '<' && p[1] == '\0') {
+        r[0] = (struct redir){fd == -1 ? 0 : fd, REDIR_IN, NULL, -1};
+    } else if (p[0] == '>' && p[1] == '>') {
+        r[0] = (struct redir){fd == -1 ? 1 : fd, REDIR_APPEND, NULL, -1};
+    } else if (p[1] == '&' && p[2] == '\0' && p[0] == '>' && fd == -1) {
+        // A bare >&file is the same as &>file
+        return parseRedir("&>", r, needs_target);
+    } else if (p[1] == '&' && p[2] == '\0') {
+        // 2>&file would move only stderr yet name a file; only a number or - may follow
+        return -1;
+    } else if (p[1] == '&') {
+        if (fd == -1) {
+            fd = p[0] == '<' ? 0 : 1;
+        }
+        *needs_target = 0;
+        if (p[2] == '-') {
+            r[0] = (struct redir){fd, REDIR_CLOSE, NULL, -1};
+        } else {
+            r[0] = (struct redir){fd, REDIR_DUP, NULL, atoi(p + 2)};
+        }
+    } else {
+        r[0] = (struct redir){fd == -1 ? 1 : fd, REDIR_OUT, NULL, -1};
+    }
+    return 1;
+}
+
+// Whether a redirection token is followed by a file name, or -1 if the
+// token is not a redirection
+static int redirTakesTarget(char *token) {
+    struct redir r[2];
+    int needs_target;
+    return parseRedir(token, r, &needs_target) <= 0 ? -1 : needs_target;
+}
+
+// Apply a redirection plan to the current process. Files are opened with
+// O_CLOEXEC; dup2() onto the target fd clears the flag where it matters.
+static int applyRedirs(struct redir *redirs, int num_redirs) {
+    for (int i = 0; i < num_redirs; i++) {
+        struct redir *r = &redirs[i];
+        int fd;
+        switch (r->type) {
+        case REDIR_IN:
+        case REDIR_OUT:
+        case REDIR_APPEND:
+            if (r->type == REDIR_IN) {
+                fd = open(r->target, O_RDONLY | O_CLOEXEC);
+            } else {
+                fd = open(r->target, O_WRONLY | O_CREAT | O_CLOEXEC |
+                          (r->type == REDIR_APPEND ? O_APPEND : O_TRUNC), 0666);
+            }
+            if (fd == -1) {
+                fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, r->target, strerror(errno));
+                return -1;
+            }
+            if (fd != r->fd) {
+                if (dup2(fd, r->fd) == -1) {
+                    perror("dup2");
+                    close(fd);
+                    return -1;
+                }
+                close(fd);
+            } else {
+                fcntl(fd, F_SETFD, 0);
+            }
+            break;
+        case REDIR_DUP:
+            if (r->dup_fd != r->fd && dup2(r->dup_fd, r->fd) == -1) {
+                fprintf(stderr, "%s: %d: %s\n", SHELL_NAME, r->dup_fd, strerror(errno));
+                return -1;
+            }
+            break;
+        case REDIR_CLOSE:
+            close(r->fd);
+            break;
+        }
+    }
+    return 0;
+}
+
+// Resource limits. A "limit key=value... cmd" prefix collects setrlimit()
+// calls that the child makes before exec. Where a writable cgroup v2
+// subtree is available the job also gets its own child cgroup with memory,
+// cpu and pids caps, and its accounting is reported when it finishes.
+struct limit_key {
+    char *name;
+    int resource;           // -1 for caps that only exist as a cgroup
+    int is_time;
+};
+
+static struct limit_key LIMIT_KEYS[] = {
+    {"mem", RLIMIT_AS, 0},
+    {"cpu", RLIMIT_CPU, 1},
+    {"nofile", RLIMIT_NOFILE, 0},
+    {"nproc", RLIMIT_NPROC, 0},
+    {"fsize", RLIMIT_FSIZE, 0},
+    {"core", RLIMIT_CORE, 0},
+    {"stack", RLIMIT_STACK, 0},
+    {"cpuquota", -1, 0},
+    {"pids", -1, 0},
+    {NULL, 0, 0}
+};
+
+struct limits {
+    struct rlimit_req {
+        int resource;
+        rlim_t value;
+    } rlimits[16];
+    int num_rlimits;
+    long long cg_memory;    // memory.max, 0 for none
+    long long cg_cpu_percent; // cpu.max as a percentage of one CPU, 0 for none
+    long long cg_pids;      // pids.max, 0 for none
+    char *cgroup;           // job cgroup created at launch, NULL if none
+};
+
+// What parseSize() returns for "unlimited"; RLIM_INFINITY would read as -1
+#define SIZE_UNLIMITED LLONG_MAX
+
+// Parse a size such as 4096, 512K, 2G or "unlimited". Returns -1 if invalid.
+static long long parseSize(const char *s) {
+    char *end;
+    double v;
+    if (strcmp(s, "unlimited") == 0) {
+        return SIZE_UNLIMITED;
+    }
+    v = strtod(s, &end);
+    if (end == s || v < 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k': case 'K': v *= 1024; end++; break;
+    case 'm': case 'M': v *= 1024.0 * 1024; end++; break;
+    case 'g': case 'G': v *= 1024.0 * 1024 * 1024; end++; break;
+    case 't': case 'T': v *= 1024.0 * 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end == 'B' || *end == 'b') {
+        end++;
+    }
+    return *end == '\0' ? (long long)v : -1;
+}
+
+// Parse a duration such as 30, 30s, 500ms, 2m or 1h into seconds
+static double parseDuration(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        return v / 1000;
+    }
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) {
+        return v;
+    }
+    if (strcmp(end, "m") == 0) {
+        return v * 60;
+    }
+    if (strcmp(end, "h") == 0) {
+        return v * 3600;
+    }
+    return -1;
+}
+
+// Consume "limit key=value..." from the front of args. Returns the number
+// of words used, or -1 after reporting a bad specification.
+static int parseLimitPrefix(char **args, struct limits **out) {
+    struct limits *lim = calloc(1, sizeof(struct limits));
+    int n = 1;
+    if (!lim) {
+        allocFailed();
+    }
+    for (; args[n] != NULL && strchr(args[n], '=') != NULL; n++) {
+        char *eq = strchr(args[n], '=');
+        struct limit_key *key = NULL;
+        long long value;
+        char *end;
+        for (int i = 0; LIMIT_KEYS[i].name != NULL; i++) {
+            if (strncmp(args[n], LIMIT_KEYS[i].name, eq - args[n]) == 0 &&
+                LIMIT_KEYS[i].name[eq - args[n]] == '\0') {
+                key = &LIMIT_KEYS[i];
+            }
+        }
+        if (strcmp(eq + 1, "unlimited") == 0) {
+            value = SIZE_UNLIMITED;
+        } else if (key != NULL && strcmp(key->name, "cpuquota") == 0) {
+            value = strtol(eq + 1, &end, 10);
+            value = end == eq + 1 || *end != '\0' ? -1 : value;
+        } else if (key != NULL && key->is_time) {
+            double secs = parseDuration(eq + 1);
+            value = secs < 0 ? -1 : (long long)(secs + 0.999);
+        } else {
+            value = parseSize(eq + 1);
+        }
+        // 0 is a real rlimit (core=0, fsize=0); a cgroup cap of 0 is not
+        if (key == NULL || value < 0 || (value == 0 && key->resource == -1) || lim->num_rlimits >= 16) {
+            fprintf(stderr, "limit: %s: invalid limit\n", args[n]);
+            free(lim);
+            return -1;
+        }
+        if (key->resource != -1) {
+            lim->rlimits[lim->num_rlimits].resource = key->resource;
+            lim->rlimits[lim->num_rlimits++].value = value == SIZE_UNLIMITED ? RLIM_INFINITY : (rlim_t)value;
+        }
+        if (strcmp(key->name, "mem") == 0) {
+            lim->cg_memory = value;
+        } else if (strcmp(key->name, "cpuquota") == 0) {
+            lim->cg_cpu_percent = value;
+        } else if (strcmp(key->name, "pids") == 0) {
+            lim->cg_pids = value;
+        }
+    }
+    if (args[n] == NULL) {
+        fprintf(stderr, "usage: limit key=value... command\n");
+        free(lim);
+        return -1;
+    }
+    *out = lim;
+    return n;
+}
+
+// The cgroup v2 directory jobs are created under. With $MYSHLL_CGROUP set
+// to a delegated subtree of its own (one holding no processes, writable by
+// the user), the memory, cpu and pids controllers are enabled there as
+// needed. Without it the shell's own cgroup is used only if those
+// controllers already reach its children; the shell never changes its own
+// cgroup, which holds processes and so cannot enable controllers anyway.
+// Empty if there is no usable subtree.
+static char CGROUP_BASE[1024];
+static int CGROUP_CHECKED = 0;
+
+static int writeFile(const char *dir, const char *name, const char *value) {
+    char path[1200];
+    int fd, ok;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Whether every controller jobs are capped with is enabled below dir
+static int cgroupHasControllers(const char *dir) {
+    char path[1200], line[512] = "";
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir);
+    if ((f = fopen(path, "re")) == NULL) {
+        return 0;
+    }
+    if (fgets(line, sizeof(line), f) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(f);
+    // Compared as whole words, so cpuset does not pass for cpu
+    char words[520];
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(words, sizeof(words), " %s ", line);
+    return strstr(words, " memory ") != NULL && strstr(words, " cpu ") != NULL && strstr(words, " pids ") != NULL;
+}
+
+static const char *cgroupBase() {
+    char line[1024], mount[512] = "", self[512] = "";
+    const char *env = getenv("MYSHLL_CGROUP");
+    FILE *f;
+    if (CGROUP_CHECKED) {
+        return CGROUP_BASE[0] ? CGROUP_BASE : NULL;
+    }
+    CGROUP_CHECKED = 1;
+    if (env != NULL) {
+        snprintf(CGROUP_BASE, sizeof(CGROUP_BASE), "%s", env);
+        if (access(CGROUP_BASE, W_OK) != 0 ||
+            (!cgroupHasControllers(CGROUP_BASE) &&
+             writeFile(CGROUP_BASE, "cgroup.subtree_control", "+memory +cpu +pids") == -1)) {
+            fprintf(stderr, "limit: MYSHLL_CGROUP=%s: cannot enable memory, cpu and pids controllers: %s\n",
+                    env, strerror(errno));
+            CGROUP_BASE[0] = '\0';
+            return NULL;
+        }
+        return CGROUP_BASE;
+    }
+    if ((f = fopen("/proc/self/mountinfo", "re")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char *sep = strstr(line, " - cgroup2 ");
+            if (sep != NULL) {
+                // Field 5 is the mount point
+                sscanf(line, "%*s %*s %*s %*s %511s", mount);
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if ((f = fopen("/proc/self/cgroup", "re")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "0::", 3) == 0) {
+                sscanf(line + 3, "%511s", self);
+            }
+        }
+        fclose(f);
+    }
+    if (mount[0] == '\0' || self[0] == '\0') {
+        return NULL;
+    }
+    snprintf(CGROUP_BASE, sizeof(CGROUP_BASE), "%s%s", mount, strcmp(self, "/") == 0 ? "" : self);
+    if (access(CGROUP_BASE, W_OK) != 0 || !cgroupHasControllers(CGROUP_BASE)) {
+        CGROUP_BASE[0] = '\0';
+        return NULL;
+    }
+    return CGROUP_BASE;
+}
+
+// Write one cap of a job cgroup; an unlimited one as the cgroup's own "max"
+static void cgroupCap(const char *dir, const char *name, long long value, const char *suffix) {
+    char buf[64];
+    if (value == SIZE_UNLIMITED) {
+        snprintf(buf, sizeof(buf), "max%s", suffix);
+    } else {
+        snprintf(buf, sizeof(buf), "%lld%s", value, suffix);
+    }
+    writeFile(dir, name, buf);
+}
+
+// Create the job cgroup and write its caps. Called in the parent before fork.
+static void cgroupCreate(struct limits *lim) {
+    static int seq = 0;
+    const char *base;
+    char path[1200];
+    if (!lim->cg_memory && !lim->cg_cpu_percent && !lim->cg_pids) {
+        return;
+    }
+    if ((base = cgroupBase()) == NULL && (lim->cg_cpu_percent || lim->cg_pids)) {
+        fprintf(stderr, "limit: no usable cgroup v2 subtree (see MYSHLL_CGROUP), cpuquota and pids ignored\n");
+    }
+    if (base == NULL) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/myshll-%d-%d", base, getpid(), seq++);
+    if (mkdir(path, 0755) == -1) {
+        return;
+    }
+    if (lim->cg_memory) {
+        cgroupCap(path, "memory.max", lim->cg_memory, "");
+    }
+    if (lim->cg_cpu_percent) {
+        cgroupCap(path, "cpu.max", lim->cg_cpu_percent == SIZE_UNLIMITED ? SIZE_UNLIMITED :
+                  lim->cg_cpu_percent * 1000, " 100000");
+    }
+    if (lim->cg_pids) {
+        cgroupCap(path, "pids.max", lim->cg_pids, "");
+    }
+    lim->cgroup = strdup(path);
+}
+
+// In the child, before exec: join the job cgroup and set the rlimits. With a
+// cgroup memory cap in place, mem= is not also applied as RLIMIT_AS, which
+// would count address space rather than memory actually used.
+static int applyLimits(struct limits *lim) {
+    if (lim->cgroup != NULL && writeFile(lim->cgroup, "cgroup.procs", "0") == -1) {
+        fprintf(stderr, "limit: cannot join %s: %s\n", lim->cgroup, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < lim->num_rlimits; i++) {
+        struct rlimit rl;
+        if (lim->rlimits[i].resource == RLIMIT_AS && lim->cgroup != NULL && lim->cg_memory) {
+            continue;
+        }
+        getrlimit(lim->rlimits[i].resource, &rl);
+        rlim_t hard = rl.rlim_max;
+        rl.rlim_cur = lim->rlimits[i].value;
+        // Leave room above the CPU soft limit so SIGXCPU arrives before SIGKILL
+        if (lim->rlimits[i].resource == RLIMIT_CPU && rl.rlim_cur != RLIM_INFINITY) {
+            rl.rlim_max = rl.rlim_cur + 1;
+        } else {
+            rl.rlim_max = rl.rlim_cur;
+        }
+        // Only root may raise the hard limit, so never ask for more
+        if (hard != RLIM_INFINITY && (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > hard)) {
+            rl.rlim_max = hard;
+        }
+        if (rl.rlim_cur > rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+        }
+        if (setrlimit(lim->rlimits[i].resource, &rl) == -1) {
+            perror("limit");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static long long readCgroupValue(const char *dir, const char *file, const char *key) {
+    char path[1200], line[256];
+    long long value = -1;
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((f = fopen(path, "re")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t n = key ? strlen(key) : 0;
+        if (key == NULL) {
+            value = atoll(line);
+            break;
+        }
+        if (strncmp(line, key, n) == 0 && line[n] == ' ') {
+            value = atoll(line + n + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Report what a limited job used, from its cgroup when it had one and from
+// wait4() rusage otherwise, then remove the cgroup.
+static void reportLimits(struct limits *lim, const char *name, struct rusage *ru) {
+    if (lim->cgroup != NULL) {
+        long long usage = readCgroupValue(lim->cgroup, "cpu.stat", "usage_usec");
+        long long peak = readCgroupValue(lim->cgroup, "memory.peak", NULL);
+        long long oom = readCgroupValue(lim->cgroup, "memory.events", "oom_kill");
+        fprintf(stderr, "limit: %s: cpu %.3fs, peak memory %lldK, oom kills %lld\n", name,
+                usage / 1e6, peak >= 0 ? peak / 1024 : -1, oom >= 0 ? oom : 0);
+        if (rmdir(lim->cgroup) == -1) {
+            fprintf(stderr, "limit: %s: %s\n", lim->cgroup, strerror(errno));
+        }
+        free(lim->cgroup);
+        lim->cgroup = NULL;
+    } else {
+        fprintf(stderr, "limit: %s: cpu %.3fs user %.3fs sys, max rss %ldK\n", name,
+                ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+                ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6, ru->ru_maxrss);
+    }
+}
+
+// ulimit [-H|-S] [-a] [-c|-d|-f|-m|-n|-s|-t|-u|-v] [value]
+struct ulimit_opt {
+    char opt;
+    int resource;
+    int unit;
+    char *desc;
+};
+
+static struct ulimit_opt ULIMIT_OPTS[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (kbytes)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (kbytes)"},
+    {'m', RLIMIT_RSS, 1024, "max memory size (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+    {0, 0, 0, NULL}
+};
+
+static void printLimit(rlim_t value, int unit) {
+    if (value == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long)value / unit);
+    }
+}
+
+static int myShell_ulimit(char **args) {
+    struct ulimit_opt *opt = &ULIMIT_OPTS[2];
+    int hard = 0, soft = 0, all = 0, i;
+    struct rlimit rl;
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        for (char *c = args[i] + 1; *c; c++) {
+            if (*c == 'H') {
+                hard = 1;
+            } else if (*c == 'S') {
+                soft = 1;
+            } else if (*c == 'a') {
+                all = 1;
+            } else {
+                int j;
+                for (j = 0; ULIMIT_OPTS[j].opt && ULIMIT_OPTS[j].opt != *c; j++) {
+                }
+                if (!ULIMIT_OPTS[j].opt) {
+                    fprintf(stderr, "ulimit: -%c: invalid option\n", *c);
+                    return 2;
+                }
+                opt = &ULIMIT_OPTS[j];
+            }
+        }
+    }
+    if (all) {
+        for (int j = 0; ULIMIT_OPTS[j].opt; j++) {
+            getrlimit(ULIMIT_OPTS[j].resource, &rl);
+            printf("%-28s(-%c) ", ULIMIT_OPTS[j].desc, ULIMIT_OPTS[j].opt);
+            printLimit(hard ? rl.rlim_max : rl.rlim_cur, ULIMIT_OPTS[j].unit);
+        }
+        return 0;
+    }
+    getrlimit(opt->resource, &rl);
+    if (args[i] == NULL) {
+        printLimit(hard ? rl.rlim_max : rl.rlim_cur, opt->unit);
+        return 0;
+    }
+    rlim_t value;
+    if (strcmp(args[i], "unlimited") == 0) {
+        value = RLIM_INFINITY;
+    } else {
+        char *end;
+        value = strtoull(args[i], &end, 10) * opt->unit;
+        // Neither an empty value nor a sign is a number of anything
+        if (end == args[i] || *end != '\0' || args[i][0] < '0' || args[i][0] > '9') {
+            fprintf(stderr, "ulimit: %s: invalid number\n", args[i]);
+            return 1;
+        }
+    }
+    // Like other shells, set both limits unless one is named
+    if (hard || !soft) {
+        rl.rlim_max = value;
+    }
+    if (soft || !hard) {
+        rl.rlim_cur = value;
+    }
+    if (setrlimit(opt->resource, &rl) == -1) {
+        fprintf(stderr, "ulimit: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Scheduling placement. "sched cpus=LIST nice=N io=CLASS[:LEVEL] cmd" pins a
+// command (or one pipeline stage) to a CPU set and sets its nice level and
+// I/O priority in the child before exec. Without a command the settings
+// apply to the shell itself, and "sched -b ..." sets the default policy for
+// background jobs.
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+struct sched_policy {
+    int has_cpus;
+    cpu_set_t cpus;
+    int has_nice;
+    int nice;
+    int has_io;
+    int ioprio;             // class << IOPRIO_CLASS_SHIFT | level
+};
+
+static struct sched_policy BG_POLICY;
+
+static char *IOPRIO_CLASSES[] = {"none", "rt", "be", "idle"};
+
+// Parse a CPU list such as 0-3,8,10-11
+static int parseCpuList(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s) {
+                return -1;
+            }
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long c = lo; c <= hi; c++) {
+            CPU_SET(c, set);
+        }
+        s = end;
+        if (*s == ',') {
+            s++;
+        } else if (*s != '\0') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void formatCpuList(cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+        int end = c;
+        if (!CPU_ISSET(c, set)) {
+            continue;
+        }
+        while (end + 1 < CPU_SETSIZE && CPU_ISSET(end + 1, set)) {
+            end++;
+        }
+        len += snprintf(buf + len, size - len, end > c ? "%s%d-%d" : "%s%d", len ? "," : "", c, end);
+        c = end;
+    }
+}
+
+// Parse one key=value setting into policy. Returns -1 if it is not valid.
+static int parseSchedSetting(char *arg, struct sched_policy *policy) {
+    char *value = strchr(arg, '=');
+    if (value == NULL) {
+        return -1;
+    }
+    value++;
+    if (strncmp(arg, "cpus=", 5) == 0) {
+        policy->has_cpus = 1;
+        return parseCpuList(value, &policy->cpus);
+    }
+    if (strncmp(arg, "nice=", 5) == 0) {
+        char *end;
+        policy->nice = strtol(value, &end, 10);
+        policy->has_nice = 1;
+        return *end == '\0' && policy->nice >= -20 && policy->nice <= 19 ? 0 : -1;
+    }
+    if (strncmp(arg, "io=", 3) == 0) {
+        char *colon = strchr(value, ':');
+        int level = colon ? atoi(colon + 1) : 4;
+        for (int class = 1; class <= 3; class++) {
+            if (strncmp(value, IOPRIO_CLASSES[class], colon ? (size_t)(colon - value) : strlen(value)) == 0 &&
+                strlen(IOPRIO_CLASSES[class]) == (colon ? (size_t)(colon - value) : strlen(value))) {
+                if (level < 0 || level > 7) {
+                    return -1;
+                }
+                policy->has_io = 1;
+                policy->ioprio = class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// Consume "sched key=value..." from the front of args when a command
+// follows. Returns the number of words used, 0 if there is no command (the
+// sched builtin then handles it), or -1 after reporting a bad setting.
+static int parseSchedPrefix(char **args, struct sched_policy **out) {
+    struct sched_policy *policy = calloc(1, sizeof(struct sched_policy));
+    int n = 1;
+    if (!policy) {
+        allocFailed();
+    }
+    for (; args[n] != NULL && strchr(args[n], '=') != NULL; n++) {
+        if (parseSchedSetting(args[n], policy) == -1) {
+            fprintf(stderr, "sched: %s: invalid setting\n", args[n]);
+            free(policy);
+            return -1;
+        }
+    }
+    if (args[n] == NULL || n == 1) {
+        free(policy);
+        return 0;
+    }
+    *out = policy;
+    return n;
+}
+
+// Apply a policy to process pid (0 for the caller)
+static int applySched(struct sched_policy *policy, pid_t pid) {
+    if (policy->has_cpus && sched_setaffinity(pid, sizeof(cpu_set_t), &policy->cpus) == -1) {
+        perror("sched: cpus");
+        return -1;
+    }
+    if (policy->has_nice && setpriority(PRIO_PROCESS, pid, policy->nice) == -1) {
+        perror("sched: nice");
+        return -1;
+    }
+    if (policy->has_io && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, policy->ioprio) == -1) {
+        perror("sched: io");
+        return -1;
+    }
+    return 0;
+}
+
+static void printSched(const char *who, cpu_set_t *cpus, int nice, int ioprio) {
+    char list[256];
+    int class = ioprio >> IOPRIO_CLASS_SHIFT;
+    formatCpuList(cpus, list, sizeof(list));
+    printf("%s: cpus %s nice %d io %s", who, list[0] ? list : "inherit", nice, IOPRIO_CLASSES[class & 3]);
+    if (class == 1 || class == 2) {
+        printf(":%d", ioprio & 7);
+    }
+    printf("\n");
+}
+
+static int myShell_sched(char **args) {
+    struct sched_policy policy;
+    int background = args[1] != NULL && strcmp(args[1], "-b") == 0;
+    int first = background ? 2 : 1;
+    if (args[first] == NULL) {
+        cpu_set_t cpus;
+        int ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+        sched_getaffinity(0, sizeof(cpus), &cpus);
+        printSched("shell", &cpus, getpriority(PRIO_PROCESS, 0), ioprio < 0 ? 0 : ioprio);
+        if (!BG_POLICY.has_cpus) {
+            CPU_ZERO(&BG_POLICY.cpus);
+        }
+        printSched("background", &BG_POLICY.cpus, BG_POLICY.has_nice ? BG_POLICY.nice : 0,
+                   BG_POLICY.has_io ? BG_POLICY.ioprio : 0);
+        return 0;
+    }
+    memset(&policy, 0, sizeof(policy));
+    for (int i = first; args[i] != NULL; i++) {
+        if (parseSchedSetting(args[i], &policy) == -1) {
+            fprintf(stderr, "usage: sched [-b] [cpus=LIST] [nice=N] [io=rt|be|idle[:LEVEL]] [command]\n");
+            return 2;
+        }
+    }
+    if (background) {
+        // Settings given again replace the matching part of the default
+        if (policy.has_cpus) {
+            BG_POLICY.has_cpus = 1;
+            BG_POLICY.cpus = policy.cpus;
+        }
+        if (policy.has_nice) {
+            BG_POLICY.has_nice = 1;
+            BG_POLICY.nice = policy.nice;
+        }
+        if (policy.has_io) {
+            BG_POLICY.has_io = 1;
+            BG_POLICY.ioprio = policy.ioprio;
+        }
+        return 0;
+    }
+    return applySched(&policy, 0) == -1 ? 1 : 0;
+}
+
+// Child reaping. Every launch path waits through waitChildren(), one event
+// loop over pidfds in an epoll set. Where pidfd_open() is unavailable it
+// falls back to a signalfd for SIGCHLD plus periodic WNOHANG sweeps, as it
+// does for every child when no epoll set can be had. The same loop enforces
+// per-child deadlines, sending SIGTERM at the deadline and SIGKILL if the
+// child is still there kill_after seconds later.
+#define TIMEOUT_STATUS 124
+#define DEFAULT_KILL_AFTER 5.0
+
+struct child {
+    pid_t pid;
+    int pidfd;              // -1 when pidfd_open() is unavailable
+    double deadline;        // CLOCK_MONOTONIC seconds, 0 for none
+    double kill_after;      // grace between SIGTERM and SIGKILL
+    int signalled;          // what the deadline has sent so far, 0 if nothing
+    int expired;            // finished, or was signalled, past its deadline
+    int group;              // the child leads its own process group
+    int done;
+    int status;
+    struct rusage ru;
+    double started;         // CLOCK_MONOTONIC seconds, for tracing
+    double ended;
+    const char *name;       // a traced stage's command,
+    int trace_fd;           //   its end of the pipe its timestamps come over, -1 if none,
+    double stamps[3];       //   and what has come so far
+    size_t stamped;
+};
+
+static double COMMAND_TIMEOUT = 0; // per-command deadline for batch mode, 0 for none
+
+// A <(cmd) or >(cmd): the forked shell running cmd and the shell's end of
+// the pipe to it, which the command sees as /dev/fd/N
+struct subst {
+    struct child child;
+    int fd;
+};
+
+static double monotonicNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Start tracking a freshly forked child. timeout 0 means no deadline.
+static void childInit(struct child *c, pid_t pid, double timeout, double kill_after) {
+    memset(c, 0, sizeof(*c));
+    c->pid = pid;
+    c->trace_fd = -1;
+    c->pidfd = pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+    if (c->pidfd != -1) {
+        fcntl(c->pidfd, F_SETFD, FD_CLOEXEC);
+    }
+    c->deadline = timeout > 0 ? monotonicNow() + timeout : 0;
+    c->kill_after = kill_after > 0 ? kill_after : DEFAULT_KILL_AFTER;
+    c->started = monotonicNow();
+    if (pid <= 0) {
+        // A failed launch counts as finished with status 1
+        c->done = 1;
+        c->status = 1 << 8;
+    }
+}
+
+// Exit status of a finished child; a child that outran its deadline gives
+// 124, even if it went on to exit by itself before it could be signalled
+static int childStatus(struct child *c) {
+    return c->expired ? TIMEOUT_STATUS : exitStatus(c->status);
+}
+
+static int childTryReap(struct child *c) {
+    pid_t r;
+    while ((r = wait4(c->pid, &c->status, WNOHANG, &c->ru)) == -1 && errno == EINTR) {
+    }
+    if (r == 0) {
+        return 0;
+    }
+    if (r == -1) {
+        // Already reaped elsewhere; nothing more to learn about it
+        c->status = 1 << 8;
+    }
+    c->done = 1;
+    c->ended = monotonicNow();
+    if (c->deadline > 0 && c->ended >= c->deadline) {
+        c->expired = 1;
+    }
+    if (c->pidfd != -1) {
+        close(c->pidfd);
+        c->pidfd = -1;
+    }
+    return 1;
+}
+
+// Wait until at least want of the n children have finished, or with block
+// unset just collect those already finished. Returns how many are done.
+static int traceExec(struct child *c, int final, int ep);
+
+// Take the last trace timestamps from children that have finished
+static void traceFinish(struct child *c, int n, int ep) {
+    for (int i = 0; i < n; i++) {
+        if (c[i].done && c[i].trace_fd != -1) {
+            traceExec(&c[i], 1, ep);
+        }
+    }
+}
+
+static int waitChildren(struct child *c, int n, int want, int block) {
+    int ep = -1, sfd = -1, num_done = 0, fallback = 0;
+    sigset_t chld, old_mask;
+
+    for (int i = 0; i < n; i++) {
+        if (!c[i].done && c[i].pidfd == -1) {
+            fallback = 1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        // pidfd children are only reaped once their fd says so
+        if (!c[i].done && (c[i].pidfd == -1 || !block)) {
+            childTryReap(&c[i]);
+        }
+        num_done += c[i].done;
+    }
+    if (!block || num_done >= want) {
+        traceFinish(c, n, -1);
+        return num_done;
+    }
+
+    // Without an epoll set, sweep every child as if it had no pidfd
+    if ((ep = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        fallback = 1;
+    }
+    for (int i = 0; i < n && ep != -1; i++) {
+        if (!c[i].done && c[i].pidfd != -1) {
+            struct epoll_event ev = {EPOLLIN, {.u32 = i}};
+            epoll_ctl(ep, EPOLL_CTL_ADD, c[i].pidfd, &ev);
+        }
+        // Trace timestamps come in as n + i
+        if (c[i].trace_fd != -1) {
+            struct epoll_event ev = {EPOLLIN, {.u32 = n + i}};
+            epoll_ctl(ep, EPOLL_CTL_ADD, c[i].trace_fd, &ev);
+        }
+    }
+    if (fallback) {
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &chld, &old_mask);
+        sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+        if (sfd != -1 && ep != -1) {
+            struct epoll_event ev = {EPOLLIN, {.u32 = UINT32_MAX}};
+            epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+        }
+    }
+
+    while (num_done < want) {
+        struct epoll_event events[64];
+        double now = monotonicNow(), next = 0;
+        int timeout_ms = -1, ready;
+
+        for (int i = 0; i < n; i++) {
+            if (c[i].done || c[i].deadline == 0) {
+                continue;
+            }
+            if (now >= c[i].deadline) {
+                // Escalate: SIGTERM first, SIGKILL after the grace period
+                // Signal the whole group where there is one, so helpers the
+                // command started cannot outlive it
+                pid_t target = c[i].group ? -c[i].pid : c[i].pid;
+                c[i].expired = 1;
+                if (!c[i].signalled) {
+                    kill(target, SIGTERM);
+                    c[i].signalled = SIGTERM;
+                    c[i].deadline = now + c[i].kill_after;
+                } else {
+                    kill(target, SIGKILL);
+                    c[i].signalled = SIGKILL;
+                    c[i].deadline = 0;
+                    continue;
+                }
+            }
+            if (next == 0 || c[i].deadline < next) {
+                next = c[i].deadline;
+            }
+        }
+        if (next > 0) {
+            timeout_ms = (int)((next - now) * 1000) + 1;
+        }
+        // The signalfd can miss SIGCHLDs taken by other threads, so the
+        // fallback also sweeps on a short timer
+        if (fallback && (timeout_ms == -1 || timeout_ms > 100)) {
+            timeout_ms = 100;
+        }
+        if (ep != -1) {
+            ready = epoll_wait(ep, events, 64, timeout_ms);
+        } else {
+            // poll() skips a signalfd of -1 and just sleeps out the timer
+            struct pollfd p = {sfd, POLLIN, 0};
+            ready = 0;
+            if (poll(&p, 1, timeout_ms) > 0) {
+                events[ready++].data.u32 = UINT32_MAX;
+            }
+        }
+        for (int e = 0; e < ready; e++) {
+            if (events[e].data.u32 == UINT32_MAX) {
+                struct signalfd_siginfo si;
+                while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+                }
+            } else if (events[e].data.u32 >= (uint32_t)n) {
+                traceExec(&c[events[e].data.u32 - n], 0, ep);
+            } else if (!c[events[e].data.u32].done && childTryReap(&c[events[e].data.u32])) {
+                // A pidfd still open in a child that has yet to exec can
+                // report again after the shell has closed its copy
+                num_done++;
+            }
+        }
+        if (fallback) {
+            for (int i = 0; i < n; i++) {
+                if (!c[i].done && (c[i].pidfd == -1 || ep == -1) && childTryReap(&c[i])) {
+                    num_done++;
+                }
+            }
+        }
+    }
+
+    traceFinish(c, n, ep);
+    if (ep != -1) {
+        close(ep);
+    }
+    if (fallback) {
+        if (sfd != -1) {
+            close(sfd);
+        }
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
+    return num_done;
+}
+
+// Consume "timeout [-k DURATION] DURATION" from the front of args. Returns
+// the number of words used, or -1 after reporting bad usage.
+static int parseTimeoutPrefix(char **args, double *timeout, double *kill_after) {
+    int n = 1;
+    *kill_after = DEFAULT_KILL_AFTER;
+    if (args[n] != NULL && strcmp(args[n], "-k") == 0) {
+        if (args[n + 1] == NULL) {
+            fprintf(stderr, "usage: timeout [-k DURATION] DURATION command\n");
+            return -1;
+        }
+        *kill_after = parseDuration(args[n + 1]);
+        n += 2;
+    }
+    *timeout = args[n] != NULL ? parseDuration(args[n]) : -1;
+    if (*kill_after <= 0 || *timeout <= 0 || args[n] == NULL || args[n + 1] == NULL) {
+        fprintf(stderr, "usage: timeout [-k DURATION] DURATION command\n");
+        return -1;
+    }
+    return n + 1;
+}
+
+// Tracing. With --trace FILE the shell records timestamped spans for
+// parsing, expansion, each stage's fork, redirections, exec and lifetime,
+// and the wait for a pipeline, and writes them as Chrome trace-event JSON
+// (loadable in chrome://tracing or Perfetto). Spans go into a per-thread
+// buffer without locking and are only formatted when a buffer fills up or
+// the shell exits, so the cost while running is a clock read per span.
+#define TRACE_EVENTS 4096
+
+struct trace_event {
+    const char *name;
+    char detail[48];
+    double start;           // CLOCK_MONOTONIC seconds
+    double end;
+    int tid;                // 0 for the recording thread
+};
+
+struct trace_buffer {
+    struct trace_event events[TRACE_EVENTS];
+    int len;
+    int tid;
+    struct trace_buffer *next;
+};
+
+static int TRACE_FD = -1;
+static double TRACE_EPOCH;
+static pid_t TRACE_PID;        // the process that opened the trace and ends it
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer *TRACE_BUFFERS;  // every thread's buffer, for the final flush
+static __thread struct trace_buffer *TRACE_BUF;
+
+// Timestamp for a span; free when tracing is off
+static double traceNow() {
+    return TRACE_FD == -1 ? 0 : monotonicNow();
+}
+
+// Copy src into dst as the body of a JSON string
+static void jsonEscape(char *dst, size_t size, const char *src) {
+    size_t n = 0;
+    for (; *src && n + 7 < size; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(dst + n, size - n, "\\u%04x", c);
+        } else {
+            dst[n++] = c;
+        }
+    }
+    dst[n] = '\0';
+}
+
+// Format and write out everything buffered. Called with TRACE_LOCK held or
+// from a process that has no other threads.
+static void traceFlush(struct trace_buffer *buf) {
+    char out[65536];
+    size_t len = 0;
+    pid_t pid = getpid();
+    for (int i = 0; i <= buf->len; i++) {
+        if (len > sizeof(out) - 512 || (i == buf->len && len > 0)) {
+            if (write(TRACE_FD, out, len) != (ssize_t)len) {
+                perror("trace");
+            }
+            len = 0;
+        }
+        if (i == buf->len) {
+            break;
+        }
+        struct trace_event *e = &buf->events[i];
+        char detail[sizeof(e->detail) * 6];
+        jsonEscape(detail, sizeof(detail), e->detail);
+        len += snprintf(out + len, sizeof(out) - len,
+                        "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"cmd\":\"%s\"}},\n",
+                        e->name, SHELL_NAME, (e->start - TRACE_EPOCH) * 1e6, (e->end - e->start) * 1e6,
+                        pid, e->tid ? e->tid : buf->tid, detail);
+    }
+    buf->len = 0;
+}
+
+// Record a span from start to end. detail may be NULL; tid 0 means this thread.
+static void traceSpan(const char *name, const char *detail, double start, double end, int tid) {
+    struct trace_buffer *buf = TRACE_BUF;
+    if (TRACE_FD == -1) {
+        return;
+    }
+    if (buf == NULL) {
+        buf = calloc(1, sizeof(struct trace_buffer));
+        if (buf == NULL) {
+            return;
+        }
+        buf->tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&TRACE_LOCK);
+        buf->next = TRACE_BUFFERS;
+        TRACE_BUFFERS = buf;
+        pthread_mutex_unlock(&TRACE_LOCK);
+        TRACE_BUF = buf;
+    }
+    if (buf->len == TRACE_EVENTS) {
+        pthread_mutex_lock(&TRACE_LOCK);
+        traceFlush(buf);
+        pthread_mutex_unlock(&TRACE_LOCK);
+    }
+    struct trace_event *e = &buf->events[buf->len++];
+    e->name = name;
+    snprintf(e->detail, sizeof(e->detail), "%s", detail ? detail : "");
+    e->start = start;
+    e->end = end;
+    e->tid = tid;
+}
+
+// A forked child starts with a copy of the parent's unflushed spans; drop
+// them so they are not written twice
+static void traceForked() {
+    if (TRACE_BUF != NULL) {
+        TRACE_BUF->len = 0;
+        TRACE_BUF->tid = getpid();
+    }
+}
+
+static void traceClose() {
+    char meta[256];
+    int len;
+    // A forked child that execs must not end the shell's trace
+    if (TRACE_FD == -1 || getpid() != TRACE_PID) {
+        return;
+    }
+    pthread_mutex_lock(&TRACE_LOCK);
+    for (struct trace_buffer *buf = TRACE_BUFFERS; buf != NULL; buf = buf->next) {
+        traceFlush(buf);
+    }
+    // Ending on a metadata event keeps the array free of a trailing comma
+    len = snprintf(meta, sizeof(meta), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                   "\"args\":{\"name\":\"%s\"}}\n]\n", getpid(), SHELL_NAME);
+    if (write(TRACE_FD, meta, len) != len) {
+        perror("trace");
+    }
+    close(TRACE_FD);
+    TRACE_FD = -1;
+    pthread_mutex_unlock(&TRACE_LOCK);
+}
+
+static int traceOpen(const char *path) {
+    // O_APPEND keeps whole writes from background jobs from interleaving
+    TRACE_FD = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (TRACE_FD == -1 || write(TRACE_FD, "[\n", 2) != 2) {
+        perror(path);
+        if (TRACE_FD != -1) {
+            close(TRACE_FD);
+            TRACE_FD = -1;
+        }
+        return -1;
+    }
+    TRACE_EPOCH = monotonicNow();
+    TRACE_PID = getpid();
+    atexit(traceClose);
+    return 0;
+}
+
+// Record the child side of a launch. The child sends the times it started,
+// finished its redirections and reached exec over a close-on-exec pipe, so
+// end of file marks the exec completing (or the child exiting). The pipe
+// is non-blocking and read from waitChildren() as data arrives, since a
+// stage may block before exec on something a later stage has to do. With
+// final set the child is gone and what has arrived is all there is.
+// Returns 1 once the pipe is done with and closed; a pipe watched by the
+// epoll instance ep is taken out of it first.
+static int traceExec(struct child *c, int final, int ep) {
+    char *buf = (char *)c->stamps, rest[64];
+    ssize_t n = 0;
+    while (c->stamped < sizeof(c->stamps) &&
+           (n = read(c->trace_fd, buf + c->stamped, sizeof(c->stamps) - c->stamped)) > 0) {
+        c->stamped += n;
+    }
+    while (c->stamped == sizeof(c->stamps) && (n = read(c->trace_fd, rest, sizeof(rest))) > 0) {
+    }
+    if (n != 0 && !final) {
+        return 0;
+    }
+    if (ep != -1) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, c->trace_fd, NULL);
+    }
+    close(c->trace_fd);
+    c->trace_fd = -1;
+    if (c->stamped == sizeof(c->stamps)) {
+        traceSpan("redirect", c->name, c->stamps[0], c->stamps[1], c->pid);
+        traceSpan("setup", c->name, c->stamps[1], c->stamps[2], c->pid);
+        traceSpan("exec", c->name, c->stamps[2], n == 0 ? monotonicNow() : c->ended, c->pid);
+    }
+    return 1;
+}
+
+static int runBatches(struct command *cmd);
+static int runMemo(struct command *cmd);
+static int memoCached(struct command *cmd, int *stored);
+static int memoReplay(struct command *cmd, int fd, int stored, int in_fd, int out_fd);
+static struct cmd_cache *cmdCacheMap();
+static void cmdCacheRefresh();
+static void execResolved(char **args);
+
+// A command with a deadline gets its own process group so the deadline can
+// reach everything it started. Not with a terminal on stdin, where leaving
+// the foreground group would cut the command off from its input.
+static int launchesOwnGroup(struct command *cmd) {
+    return (cmd->timeout > 0 || COMMAND_TIMEOUT > 0) && !isatty(STDIN_FILENO);
+}
+
+static struct func *findFunc(const char *name);
+
+// Index of the builtin a stage runs, FUNC_CALL for a shell function, or
+// -1. Launch prefixes need a real process, so a prefixed command always
+// runs the external program.
+static int builtinIndex(struct command *cmd) {
+    if (cmd->args[0] == NULL || cmd->limits != NULL || cmd->sched != NULL || cmd->batch_jobs != 0 ||
+        cmd->timeout != 0 || cmd->memo != NULL) {
+        return -1;
+    }
+    if (findFunc(cmd->args[0]) != NULL) {
+        return FUNC_CALL;
+    }
+    for (int i = 0; i < numBuiltin(); i++) {
+        if (strcmp(cmd->args[0], builtin_cmd[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Descriptors of the shell's own that a builtin stage or a { ... } group
+// has redirected, with copies of what they were so they can be put back
+struct saved_fds {
+    int num;
+    int *fds;
+    int *saved;             // -1 records that the descriptor was closed to begin with
+};
+
+// Dup the pipe ends and the command's redirections over the shell's own
+// descriptors. Returns -1 if a redirection failed; restoreShell() must be
+// called either way.
+static int redirectShell(struct command *cmd, int in_fd, int out_fd, struct saved_fds *s) {
+    s->num = 0;
+    s->fds = malloc((cmd->num_redirs + 2) * sizeof(int));
+    s->saved = malloc((cmd->num_redirs + 2) * sizeof(int));
+    if (!s->fds || !s->saved) {
+        allocFailed();
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if (in_fd != STDIN_FILENO) {
+        s->fds[s->num++] = STDIN_FILENO;
+    }
+    if (out_fd != STDOUT_FILENO) {
+        s->fds[s->num++] = STDOUT_FILENO;
+    }
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        int seen = 0;
+        for (int j = 0; j < s->num; j++) {
+            seen |= s->fds[j] == cmd->redirs[i].fd;
+        }
+        if (!seen) {
+            s->fds[s->num++] = cmd->redirs[i].fd;
+        }
+    }
+    for (int i = 0; i < s->num; i++) {
+        s->saved[i] = fcntl(s->fds[i], F_DUPFD_CLOEXEC, 10);
+    }
+    if (in_fd != STDIN_FILENO) {
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    return applyRedirs(cmd->redirs, cmd->num_redirs);
+}
+
+static void restoreShell(struct saved_fds *s) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = s->num - 1; i >= 0; i--) {
+        if (s->saved[i] != -1) {
+            dup2(s->saved[i], s->fds[i]);
+            close(s->saved[i]);
+        } else {
+            close(s->fds[i]);
+        }
+    }
+    clearerr(stdout);
+    free(s->fds);
+    free(s->saved);
+}
+
+// Run a builtin stage inside the shell with its descriptors redirected for
+// the duration. SIGPIPE is ignored meanwhile, so a reader going away fails
+// the builtin's writes instead of killing the shell.
+static int runBuiltin(struct command *cmd, int b, int in_fd, int out_fd) {
+    struct saved_fds saved;
+    struct sigaction ignore, old;
+    int result;
+
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old);
+    double started = traceNow();
+    // Passed on in case the builtin is exec
+    for (int i = 0; i < cmd->num_subst; i++) {
+        fcntl(cmd->subst[i].fd, F_SETFD, 0);
+    }
+    if (redirectShell(cmd, in_fd, out_fd, &saved) == -1) {
+        result = 1;
+    } else {
+        result = (*builtin_func[b])(cmd->args);
+    }
+    for (int i = 0; i < cmd->num_subst; i++) {
+        fcntl(cmd->subst[i].fd, F_SETFD, FD_CLOEXEC);
+    }
+    restoreShell(&saved);
+    traceSpan("builtin", cmd->args[0], started, traceNow(), 0);
+    sigaction(SIGPIPE, &old, NULL);
+    return result;
+}
+
+// Fork one pipeline stage. The child takes in_fd/out_fd as stdin/stdout,
+// applies the command's own redirections on top, then execs. Returns the
+// pid, or -1 if fork failed. When tracing, *trace_fd is set to the pipe
+// the child's timestamps come over, for traceExec().
+static pid_t myShellLaunch(struct command *cmd, int in_fd, int out_fd, int *trace_fd) {
+    pid_t pid;
+    int trace[2] = {-1, -1};
+    double forked, stamps[3];
+    if (cmd->limits != NULL) {
+        cgroupCreate(cmd->limits);
+    }
+    if (TRACE_FD != -1 && pipe2(trace, O_CLOEXEC) == -1) {
+        trace[0] = trace[1] = -1;
+    }
+    // Map the shared command cache once here rather than in every child
+    cmdCacheRefresh();
+    fflush(stdout);
+    fflush(stderr);
+    forked = traceNow();
+    pid = fork();
+    if (pid > 0 && launchesOwnGroup(cmd)) {
+        setpgid(pid, pid);
+    }
+    if (pid == 0) {
+        // The Child Process
+        stamps[0] = traceNow();
+        for (int i = 0; i < cmd->num_subst; i++) {
+            fcntl(cmd->subst[i].fd, F_SETFD, 0);
+        }
+        if (launchesOwnGroup(cmd)) {
+            setpgid(0, 0);
+        }
+        if (in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        // _exit() rather than exit(): the child must not flush or rewind
+        // stdio streams it shares with the shell, such as a batch script
+        if (applyRedirs(cmd->redirs, cmd->num_redirs) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+        stamps[1] = traceNow();
+        if (cmd->limits != NULL && applyLimits(cmd->limits) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+        if (cmd->sched != NULL && applySched(cmd->sched, 0) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+        if (cmd->args[0] == NULL) {
+            // Redirections only, e.g. "> file" to truncate
+            _exit(EXIT_SUCCESS);
+        }
+        if (builtinIndex(cmd) >= 0) {
+            // A builtin stage the shell could not run itself
+            int status = (*builtin_func[builtinIndex(cmd)])(cmd->args);
+            fflush(stdout);
+            fflush(stderr);
+            _exit(status);
+        }
+        if (trace[1] != -1) {
+            stamps[2] = traceNow();
+            if (write(trace[1], stamps, sizeof(stamps)) != sizeof(stamps)) {
+                _exit(EXIT_FAILURE);
+            }
+            if (cmd->batch_jobs > 0 || cmd->memo != NULL) {
+                // Exec happens further down; do not hold the shell's read open
+                close(trace[1]);
+            }
+        }
+        if (cmd->batch_jobs > 0) {
+            _exit(runBatches(cmd));
+        }
+        if (cmd->memo != NULL) {
+            _exit(runMemo(cmd));
+        }
+        execResolved(cmd->args);
+        if (errno == E2BIG) {
+            fprintf(stderr, "%s: %s: argument list too long (%d arguments), try batch-args\n",
+                    SHELL_NAME, cmd->args[0], countArgs(cmd->args));
+            _exit(126);
+        }
+        fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, cmd->args[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    } else if (pid < 0) {
+        // Forking Error
+        perror("myShell: ");
+    }
+    *trace_fd = -1;
+    if (trace[1] != -1) {
+        close(trace[1]);
+        if (pid > 0) {
+            traceSpan("fork", cmd->args[0], forked, monotonicNow(), 0);
+            fcntl(trace[0], F_SETFL, O_NONBLOCK);
+            *trace_fd = trace[0];
+        } else {
+            close(trace[0]);
+        }
+    }
+    return pid;
+}
+
+// Run a pipeline: every stage is forked once, connected by close-on-exec
+// pipes, then all stages are waited for. Returns the exit status of the last
+// stage, or with pipefail that of the rightmost failing stage. The last
+// builtin stage runs in the shell itself once the other stages are running,
+// so it can neither block a stage that is not started yet nor lose changes
+// such as read's variables to a child. Any other builtin stage is forked,
+// as are exec and exit in a pipeline of several stages, which must not
+// replace or end the shell. A second in-shell stage is not run on a thread:
+// builtins write through stdout and fds 0/1, which the whole process shares
+// and the first in-shell stage already has redirected.
+static int execute_command(struct pipeline *pl) {
+    struct child kids[pl->num_cmds];
+    int in_fd = STDIN_FILENO, result = 1, launched, local = -1, b = -1;
+    int local_in = STDIN_FILENO, local_out = STDOUT_FILENO, memo_fd = -1, memo_status = 0;
+
+    // One stage may run in the shell: a builtin, or a memoized command
+    // whose result is cached
+    for (int i = pl->num_cmds - 1; i >= 0 && local == -1; i--) {
+        if ((b = builtinIndex(&pl->cmds[i])) >= 0 &&
+            (pl->num_cmds == 1 || (builtin_func[b] != &myShell_exec && builtin_func[b] != &myShell_exit))) {
+            local = i;
+        } else if ((memo_fd = memoCached(&pl->cmds[i], &memo_status)) != -1) {
+            local = i;
+        }
+    }
+
+    for (launched = 0; launched < pl->num_cmds; launched++) {
+        int pipefd[2] = {-1, STDOUT_FILENO};
+        if (launched < pl->num_cmds - 1 && pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            break;
+        }
+        struct command *cmd = &pl->cmds[launched];
+        double timeout = cmd->timeout;
+        // The batch-mode deadline applies unless the command sets a shorter one
+        if (COMMAND_TIMEOUT > 0 && (timeout == 0 || COMMAND_TIMEOUT < timeout)) {
+            timeout = COMMAND_TIMEOUT;
+        }
+        if (launched == local) {
+            // Keep its ends open until the other stages are started
+            childInit(&kids[launched], 0, 0, 0);
+            local_in = in_fd;
+            local_out = pipefd[1];
+            in_fd = pipefd[0];
+            continue;
+        }
+        double started = monotonicNow();
+        int trace_fd;
+        childInit(&kids[launched], myShellLaunch(cmd, in_fd, pipefd[1], &trace_fd), timeout, cmd->kill_after);
+        kids[launched].name = cmd->args[0];
+        kids[launched].trace_fd = trace_fd;
+        kids[launched].group = launchesOwnGroup(cmd);
+        kids[launched].started = started;
+        // The parent keeps only the read end, for the next stage
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (pipefd[1] != STDOUT_FILENO) {
+            close(pipefd[1]);
+        }
+        in_fd = pipefd[0];
+    }
+    if (in_fd != STDIN_FILENO && in_fd != -1) {
+        close(in_fd);
+    }
+    if (local != -1 && local < launched) {
+        if (memo_fd != -1) {
+            kids[local].status = memoReplay(&pl->cmds[local], memo_fd, memo_status, local_in, local_out) << 8;
+        } else {
+            kids[local].status = runBuiltin(&pl->cmds[local], b, local_in, local_out) << 8;
+        }
+        kids[local].ended = monotonicNow();
+    } else if (memo_fd != -1) {
+        close(memo_fd);
+    }
+    if (local_in != STDIN_FILENO) {
+        close(local_in);
+    }
+    if (local_out != STDOUT_FILENO) {
+        close(local_out);
+    }
+
+    double waited = traceNow();
+    waitChildren(kids, launched, launched, 1);
+    traceSpan("wait", pl->cmds[0].args[0], waited, traceNow(), 0);
+    for (int i = 0; i < launched; i++) {
+        int stage = childStatus(&kids[i]);
+        traceSpan("child", pl->cmds[i].args[0], kids[i].started, kids[i].ended, kids[i].pid);
+        if (kids[i].expired) {
+            fprintf(stderr, "%s: %s: timed out\n", SHELL_NAME, pl->cmds[i].args[0] ? pl->cmds[i].args[0] : "");
+        }
+        if (pl->cmds[i].limits != NULL) {
+            reportLimits(pl->cmds[i].limits, pl->cmds[i].args[0], &kids[i].ru);
+        }
+        if (PIPEFAIL ? (i == 0 || stage != 0) : i == pl->num_cmds - 1) {
+            result = stage;
+        }
+    }
+    return result;
+}
+
+// Shell variables. Set by NAME=value commands and let, looked up before the
+// environment by $NAME and ${NAME}. Assigning a name that is in the
+// environment updates it there too, so children see the new value.
+#define VAR_BUCKETS 256
+
+struct var {
+    char *name;
+    char *value;
+    size_t cap;             // bytes allocated for value
+    int exported;           // was in the environment when first set
+    struct var *next;
+};
+
+static struct var *VARS[VAR_BUCKETS];
+
+static unsigned varBucket(const char *name, size_t len) {
+    unsigned h = 5381;
+    for (size_t i = 0; i < len; i++) {
+        h = h * 33 + (unsigned char)name[i];
+    }
+    return h % VAR_BUCKETS;
+}
+
+// Value of the len-byte name at name, or NULL if unset
+static const char *getVar(const char *name, size_t len) {
+    char key[256];
+    for (struct var *v = VARS[varBucket(name, len)]; v != NULL; v = v->next) {
+        if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0') {
+            return v->value;
+        }
+    }
+    if (len >= sizeof(key)) {
+        return NULL;
+    }
+    memcpy(key, name, len);
+    key[len] = '\0';
+    return getenv(key);
+}
+
+static void setVar(const char *name, size_t len, const char *value) {
+    unsigned b = varBucket(name, len);
+    size_t size = strlen(value) + 1;
+    struct var *v;
+    for (v = VARS[b]; v != NULL; v = v->next) {
+        if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0') {
+            break;
+        }
+    }
+    if (v == NULL) {
+        v = calloc(1, sizeof(struct var));
+        if (!v || !(v->name = strndup(name, len))) {
+            allocFailed();
+        }
+        v->exported = getenv(v->name) != NULL;
+        v->next = VARS[b];
+        VARS[b] = v;
+    }
+    // A value that fits, as a counter's usually does, is overwritten in place
+    if (size > v->cap) {
+        char *copy = malloc(size);
+        if (!copy) {
+            allocFailed();
+        }
+        free(v->value);
+        v->value = copy;
+        v->cap = size;
+    }
+    memmove(v->value, value, size);
+    if (v->exported) {
+        setenv(v->name, value, 1);
+    }
+}
+
+static void unsetVar(const char *name, size_t len) {
+    for (struct var **v = &VARS[varBucket(name, len)]; *v != NULL; v = &(*v)->next) {
+        if (strncmp((*v)->name, name, len) == 0 && (*v)->name[len] == '\0') {
+            struct var *gone = *v;
+            *v = gone->next;
+            if (gone->exported) {
+                unsetenv(gone->name);
+            }
+            free(gone->name);
+            free(gone->value);
+            free(gone);
+            return;
+        }
+    }
+}
+
+// Positional parameters $1... of the function running, none outside one
+static char **POS_ARGS = NULL;
+static int POS_COUNT = 0;
+
+static int isNameStart(char c) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static int isNameChar(char c) {
+    return isNameStart(c) || (c >= '0' && c <= '9');
+}
+
+static int isName(const char *word) {
+    if (!isNameStart(*word)) {
+        return 0;
+    }
+    while (isNameChar(*word)) {
+        word++;
+    }
+    return *word == '\0';
+}
+
+// Length of the NAME in a NAME=value word, or 0 if it is not an assignment
+static size_t assignmentLength(const char *word) {
+    size_t n = 0;
+    if (!isNameStart(word[0])) {
+        return 0;
+    }
+    while (isNameChar(word[n])) {
+        n++;
+    }
+    return word[n] == '=' ? n : 0;
+}
+
+// Arithmetic. $(( expr )) and let evaluate C-style expressions over 64-bit
+// signed integers. An expression is parsed once, by precedence climbing,
+// into a tree that is kept in a small cache keyed by its text, so a loop
+// evaluating the same expressions never parses them again. Names stand for
+// shell variables (unset or empty is 0, other values are evaluated as
+// expressions themselves); the assignment operators, ++ and -- store back
+// into them. Operands on the untaken side of && || and ?: are evaluated
+// for nothing: they store nothing and cannot divide by zero.
+struct arith_node {
+    char kind;              // n number, v variable, u unary, i ++x/--x, p x++/x--,
+                            // b binary, = assignment, ? conditional, , comma
+    const char *op;         // operator spelling
+    int prec;               // a binary operator's precedence
+    long long value;        // a number's value
+    const char *name;       // variable, not terminated
+    size_t len;
+    struct arith_node *l, *r, *c;
+};
+
+struct arith_expr {
+    char *text;             // names point into this copy
+    struct arith_node *root;
+    struct arith_node nodes[];
+};
+
+struct arith {
+    const char *p;
+    const char *expr;       // the whole expression, for messages
+    int skip;               // evaluating a branch whose value is not used
+    int error;
+    int depth;              // nesting of variables evaluated as expressions
+    struct arith_expr *e;   // being parsed, with room for a node per character
+    int num_nodes;
+};
+
+struct arith_op {
+    const char *op;
+    int prec;
+    int len;
+};
+
+// Binary operators, longest spelling first, with C precedence
+static struct arith_op ARITH_OPS[] = {
+    {"||", 1, 2}, {"&&", 2, 2}, {"==", 6, 2}, {"!=", 6, 2}, {"<=", 7, 2}, {">=", 7, 2}, {"<<", 8, 2},
+    {">>", 8, 2}, {"**", 11, 2}, {"|", 3, 1}, {"^", 4, 1}, {"&", 5, 1}, {"<", 7, 1}, {">", 7, 1},
+    {"+", 9, 1}, {"-", 9, 1}, {"*", 10, 1}, {"/", 10, 1}, {"%", 10, 1},
+    {NULL, 0, 0}
+};
+
+// Assignment operators, longest spelling first
+static const char *ARITH_ASSIGN[] = {"<<=", ">>=", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=", "=", NULL};
+
+#define ARITH_CACHE 256
+
+static struct arith_expr *ARITH_EXPRS[ARITH_CACHE];
+
+static struct arith_node *arithComma(struct arith *a);
+static struct arith_node *arithAssign(struct arith *a);
+static long long arithEval(const char *expr, int depth, int *error);
+
+static void arithError(struct arith *a, const char *msg) {
+    if (!a->error) {
+        fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, a->expr, msg);
+    }
+    a->error = 1;
+}
+
+static void arithSpace(struct arith *a) {
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') {
+        a->p++;
+    }
+}
+
+// Every node uses up at least one character, so the room never runs out
+static struct arith_node *arithNode(struct arith *a, char kind, struct arith_node *l, struct arith_node *r) {
+    struct arith_node *n = &a->e->nodes[a->num_nodes++];
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->l = l;
+    n->r = r;
+    return n;
+}
+
+static struct arith_node *arithPrimary(struct arith *a) {
+    struct arith_node *n;
+    arithSpace(a);
+    if (*a->p == '(') {
+        a->p++;
+        n = arithComma(a);
+        arithSpace(a);
+        if (a->error) {
+            return NULL;
+        }
+        if (*a->p != ')') {
+            arithError(a, "missing `)'");
+            return NULL;
+        }
+        a->p++;
+        return n;
+    }
+    if (*a->p >= '0' && *a->p <= '9') {
+        char *end;
+        n = arithNode(a, 'n', NULL, NULL);
+        n->value = strtoull(a->p, &end, 0);
+        if (isNameChar(*end)) {
+            arithError(a, "value too great for base");
+            return NULL;
+        }
+        a->p = end;
+        return n;
+    }
+    if (isNameStart(*a->p)) {
+        n = arithNode(a, 'v', NULL, NULL);
+        n->name = a->p;
+        while (isNameChar(n->name[n->len])) {
+            n->len++;
+        }
+        a->p += n->len;
+        arithSpace(a);
+        if ((a->p[0] == '+' || a->p[0] == '-') && a->p[1] == a->p[0]) {
+            n->kind = 'p';
+            n->op = a->p[0] == '+' ? "+" : "-";
+            a->p += 2;
+        }
+        return n;
+    }
+    arithError(a, *a->p ? "syntax error: operand expected" : "syntax error: missing operand");
+    return NULL;
+}
+
+static struct arith_node *arithUnary(struct arith *a) {
+    struct arith_node *n;
+    arithSpace(a);
+    char c = *a->p;
+    if ((c == '+' || c == '-') && a->p[1] == c) {
+        // Pre-increment and pre-decrement need a name to store into
+        a->p += 2;
+        arithSpace(a);
+        n = arithNode(a, 'i', NULL, NULL);
+        n->op = c == '+' ? "+" : "-";
+        n->name = a->p;
+        while (isNameChar(n->name[n->len])) {
+            n->len++;
+        }
+        if (n->len == 0 || !isNameStart(n->name[0])) {
+            arithError(a, "syntax error: variable expected");
+            return NULL;
+        }
+        a->p += n->len;
+        return n;
+    }
+    if (c == '+' || c == '-' || c == '!' || c == '~') {
+        a->p++;
+        n = arithNode(a, 'u', NULL, NULL);
+        n->op = c == '+' ? "+" : c == '-' ? "-" : c == '!' ? "!" : "~";
+        n->l = arithUnary(a);
+        return a->error ? NULL : n;
+    }
+    return arithPrimary(a);
+}
+
+// The binary operator at the current position, if any, not counting the
+// first half of an assignment operator such as += or <<=
+static struct arith_op *arithNextOp(struct arith *a) {
+    arithSpace(a);
+    // Most calls end an operand at the end of the expression or a )
+    if (*a->p == '\0' || *a->p == ')') {
+        return NULL;
+    }
+    for (struct arith_op *op = ARITH_OPS; op->op != NULL; op++) {
+        if (a->p[0] == op->op[0] && (op->len == 1 || a->p[1] == op->op[1])) {
+            // Comparisons aside, an operator followed by = is an assignment
+            return a->p[op->len] == '=' && op->prec != 6 && op->prec != 7 ? NULL : op;
+        }
+    }
+    return NULL;
+}
+
+static struct arith_node *arithBinary(struct arith *a, int min_prec) {
+    struct arith_node *l = arithUnary(a);
+    struct arith_op *op;
+    while (!a->error && (op = arithNextOp(a)) != NULL && op->prec >= min_prec) {
+        a->p += op->len;
+        // ** is right associative, everything else left
+        l = arithNode(a, 'b', l, arithBinary(a, op->prec == 11 ? op->prec : op->prec + 1));
+        l->op = op->op;
+        l->prec = op->prec;
+    }
+    return a->error ? NULL : l;
+}
+
+// Assignment, or a conditional expression
+static struct arith_node *arithAssign(struct arith *a) {
+    struct arith_node *n;
+    arithSpace(a);
+    if (isNameStart(*a->p)) {
+        const char *name = a->p, *q = a->p;
+        while (isNameChar(*q)) {
+            q++;
+        }
+        size_t len = q - name;
+        while (*q == ' ' || *q == '\t') {
+            q++;
+        }
+        for (int i = 0; *q != '\0' && strchr("<>+-*/%&^|=", *q) != NULL && ARITH_ASSIGN[i] != NULL; i++) {
+            size_t k = strlen(ARITH_ASSIGN[i]);
+            if (strncmp(q, ARITH_ASSIGN[i], k) == 0 && !(k == 1 && q[1] == '=')) {
+                a->p = q + k;
+                n = arithNode(a, '=', NULL, NULL);
+                n->op = ARITH_ASSIGN[i];
+                n->name = name;
+                n->len = len;
+                n->r = arithAssign(a);
+                return a->error ? NULL : n;
+            }
+        }
+    }
+    struct arith_node *cond = arithBinary(a, 1);
+    arithSpace(a);
+    if (a->error || *a->p != '?') {
+        return cond;
+    }
+    a->p++;
+    n = arithNode(a, '?', NULL, NULL);
+    n->c = cond;
+    n->l = arithAssign(a);
+    arithSpace(a);
+    if (a->error) {
+        return NULL;
+    }
+    if (*a->p != ':') {
+        arithError(a, "syntax error: `:' expected for conditional expression");
+        return NULL;
+    }
+    a->p++;
+    n->r = arithAssign(a);
+    return a->error ? NULL : n;
+}
+
+static struct arith_node *arithComma(struct arith *a) {
+    struct arith_node *n = arithAssign(a);
+    arithSpace(a);
+    while (!a->error && *a->p == ',') {
+        a->p++;
+        n = arithNode(a, ',', n, arithAssign(a));
+        arithSpace(a);
+    }
+    return a->error ? NULL : n;
+}
+
+// Parse expr into a tree, or report the error and return NULL
+static struct arith_expr *arithParse(const char *expr) {
+    size_t len = strlen(expr);
+    struct arith_expr *e = malloc(sizeof(struct arith_expr) + (len + 1) * sizeof(struct arith_node));
+    if (!e || !(e->text = strdup(expr))) {
+        allocFailed();
+    }
+    struct arith a = {e->text, expr, 0, 0, 0, e, 0};
+    e->root = arithComma(&a);
+    arithSpace(&a);
+    if (!a.error && *a.p != '\0') {
+        arithError(&a, "syntax error: invalid arithmetic operator");
+    }
+    if (a.error) {
+        free(e->text);
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+static long long arithVar(struct arith *a, const char *name, size_t len) {
+    const char *value = getVar(name, len);
+    char *end;
+    long long v;
+    if (value == NULL || value[0] == '\0') {
+        return 0;
+    }
+    // Counters are short decimals; anything else goes through strtoll()
+    if (value[0] >= '1' && value[0] <= '9' && strlen(value) < 19) {
+        for (v = 0, end = (char *)value; *end >= '0' && *end <= '9'; end++) {
+            v = v * 10 + (*end - '0');
+        }
+        if (*end == '\0') {
+            return v;
+        }
+    }
+    v = strtoll(value, &end, 0);
+    if (*end == '\0') {
+        return v;
+    }
+    if (a->depth >= 32) {
+        arithError(a, "expression recursion level exceeded");
+        return 0;
+    }
+    int error = 0;
+    v = arithEval(value, a->depth + 1, &error);
+    if (error) {
+        a->error = 1;
+    }
+    return v;
+}
+
+static void arithStore(struct arith *a, const char *name, size_t len, long long v) {
+    char buf[32], *p = buf + sizeof(buf) - 1;
+    unsigned long long u = v < 0 ? 0 - (unsigned long long)v : (unsigned long long)v;
+    if (!a->skip && !a->error) {
+        // Formatted by hand, as stores are most of what a counting loop does
+        *p = '\0';
+        do {
+            *--p = '0' + u % 10;
+            u /= 10;
+        } while (u > 0);
+        if (v < 0) {
+            *--p = '-';
+        }
+        setVar(name, len, p);
+    }
+}
+
+// Apply a binary operator; also used for compound assignment
+static long long arithApply(struct arith *a, const char *op, long long l, long long r) {
+    switch (op[0]) {
+    case '+': return (long long)((unsigned long long)l + r);
+    case '-': return (long long)((unsigned long long)l - r);
+    case '*':
+        if (op[1] == '*') {
+            long long v = 1;
+            if (r < 0) {
+                arithError(a, "exponent less than 0");
+                return 0;
+            }
+            for (; r > 0; r >>= 1, l = (long long)((unsigned long long)l * l)) {
+                if (r & 1) {
+                    v = (long long)((unsigned long long)v * l);
+                }
+            }
+            return v;
+        }
+        return (long long)((unsigned long long)l * r);
+    case '/':
+    case '%':
+        if (r == 0) {
+            arithError(a, "division by 0");
+            return 0;
+        }
+        if (r == -1) {
+            // LLONG_MIN / -1 overflows; wrap like the other operators
+            return op[0] == '/' ? (long long)(0 - (unsigned long long)l) : 0;
+        }
+        return op[0] == '/' ? l / r : l % r;
+    case '<':
+        if (op[1] == '<') {
+            return (long long)((unsigned long long)l << (r & 63));
+        }
+        return op[1] == '=' ? l <= r : l < r;
+    case '>':
+        if (op[1] == '>') {
+            return l >> (r & 63);
+        }
+        return op[1] == '=' ? l >= r : l > r;
+    case '=': return l == r;
+    case '!': return l != r;
+    case '&': return op[1] == '&' ? l && r : l & r;
+    case '|': return op[1] == '|' ? l || r : l | r;
+    case '^': return l ^ r;
+    }
+    return 0;
+}
+
+static long long arithRun(struct arith *a, struct arith_node *n) {
+    long long v, r;
+    int skip;
+    switch (n->kind) {
+    case 'n':
+        return n->value;
+    case 'v':
+        return arithVar(a, n->name, n->len);
+    case 'p':
+    case 'i':
+        v = arithVar(a, n->name, n->len);
+        arithStore(a, n->name, n->len, n->op[0] == '+' ? v + 1 : v - 1);
+        return n->kind == 'p' ? v : n->op[0] == '+' ? v + 1 : v - 1;
+    case 'u':
+        v = arithRun(a, n->l);
+        return n->op[0] == '-' ? (long long)(0 - (unsigned long long)v) : n->op[0] == '!' ? !v : n->op[0] == '~' ? ~v : v;
+    case 'b':
+        v = arithRun(a, n->l);
+        skip = (n->prec == 2 && !v) || (n->prec == 1 && v);
+        a->skip += skip;
+        r = arithRun(a, n->r);
+        a->skip -= skip;
+        return skip ? n->prec == 1 : a->skip ? 0 : arithApply(a, n->op, v, r);
+    case '=':
+        v = arithRun(a, n->r);
+        if (n->op[1] != '\0' && !a->skip) {
+            char op[3] = {n->op[0], n->op[0] == '<' || n->op[0] == '>' ? n->op[1] : '\0', '\0'};
+            v = arithApply(a, op, arithVar(a, n->name, n->len), v);
+        }
+        arithStore(a, n->name, n->len, v);
+        return v;
+    case '?':
+        v = arithRun(a, n->c);
+        a->skip += !v;
+        r = arithRun(a, n->l);
+        a->skip -= !v;
+        a->skip += !!v;
+        long long no = arithRun(a, n->r);
+        a->skip -= !!v;
+        return v ? r : no;
+    case ',':
+        arithRun(a, n->l);
+        return arithRun(a, n->r);
+    }
+    return 0;
+}
+
+static long long arithEval(const char *expr, int depth, int *error) {
+    // A variable's value is parsed afresh, as evicting a cached tree
+    // could free one that an outer evaluation is still running
+    struct arith_expr **slot = depth == 0 ? &ARITH_EXPRS[varBucket(expr, strlen(expr)) % ARITH_CACHE] : NULL;
+    struct arith_expr *e = slot != NULL && *slot != NULL && strcmp((*slot)->text, expr) == 0 ? *slot : NULL;
+    if (e == NULL && (e = arithParse(expr)) == NULL) {
+        *error = 1;
+        return 0;
+    }
+    if (slot != NULL && *slot != e) {
+        if (*slot != NULL) {
+            free((*slot)->text);
+            free(*slot);
+        }
+        *slot = e;
+    }
+    struct arith a = {expr, expr, 0, 0, depth, e, 0};
+    long long v = arithRun(&a, e->root);
+    if (slot == NULL) {
+        free(e->text);
+        free(e);
+    }
+    *error = a.error;
+    return a.error ? 0 : v;
+}
+
+// Growable string for building expanded words
+struct strbuf {
+    char *s;
+    size_t len;
+    size_t cap;
+};
+
+static void sbAppend(struct strbuf *sb, const char *data, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        sb->cap = (sb->len + n + 1) * 2;
+        sb->s = realloc(sb->s, sb->cap);
+        if (!sb->s) {
+            allocFailed();
+        }
+    }
+    memcpy(sb->s + sb->len, data, n);
+    sb->len += n;
+    sb->s[sb->len] = '\0';
+}
+
+// Length of a $(( ... )), <( ... ) or >( ... ) starting at p, through the
+// parenthesis closing the one at p[1], or of the rest of p if it is missing
+static size_t groupLength(const char *p) {
+    int depth = 0;
+    size_t i = 1;
+    for (; p[i]; i++) {
+        if (p[i] == '(') {
+            depth++;
+        } else if (p[i] == ')' && --depth == 0) {
+            return i + 1;
+        }
+    }
+    return i;
+}
+
+// Expand $?, $$, $NAME, ${NAME}, the positional parameters $1... ${10}...,
+// $# and $@ or $*, and $(( expr )) in token. Returns a new string, or NULL
+// after reporting a bad expression.
+static char *expandParams(const char *token) {
+    struct strbuf sb = {NULL, 0, 0};
+    char num[32];
+    sbAppend(&sb, "", 0);
+    for (const char *p = token; *p; ) {
+        const char *dollar = strchr(p, '$');
+        if (dollar == NULL) {
+            sbAppend(&sb, p, strlen(p));
+            break;
+        }
+        sbAppend(&sb, p, dollar - p);
+        p = dollar + 1;
+        if (*p == '?' || *p == '$' || *p == '#') {
+            int v = *p == '?' ? LastStatus : *p == '#' ? POS_COUNT : (int)getpid();
+            sbAppend(&sb, num, snprintf(num, sizeof(num), "%d", v));
+            p++;
+        } else if (*p == '@' || *p == '*') {
+            for (int i = 0; i < POS_COUNT; i++) {
+                sbAppend(&sb, " ", i > 0);
+                sbAppend(&sb, POS_ARGS[i], strlen(POS_ARGS[i]));
+            }
+            p++;
+        } else if (*p >= '0' && *p <= '9') {
+            // $0 is the shell; past $9 the number needs braces, as in ${10}
+            const char *value = *p == '0' ? SHELL_NAME : *p - '0' <= POS_COUNT ? POS_ARGS[*p - '1'] : "";
+            sbAppend(&sb, value, strlen(value));
+            p++;
+        } else if (strncmp(p, "((", 2) == 0) {
+            size_t n = groupLength(dollar);
+            int error = 1;
+            long long v = 0;
+            if (n < 5 || dollar[n - 1] != ')' || dollar[n - 2] != ')') {
+                fprintf(stderr, "%s: %s: missing `))'\n", SHELL_NAME, dollar);
+                free(sb.s);
+                return NULL;
+            }
+            // Parameters inside are expanded first, then the text is evaluated
+            char *inner = strndup(dollar + 3, n - 5);
+            char *expanded = inner ? expandParams(inner) : NULL;
+            if (expanded != NULL) {
+                v = arithEval(expanded, 0, &error);
+            }
+            free(inner);
+            free(expanded);
+            if (error) {
+                free(sb.s);
+                return NULL;
+            }
+            sbAppend(&sb, num, snprintf(num, sizeof(num), "%lld", v));
+            p = dollar + n;
+        } else if (*p == '{' || isNameStart(*p)) {
+            const char *name = *p == '{' ? p + 1 : p;
+            size_t len = 0;
+            while (isNameChar(name[len])) {
+                len++;
+            }
+            if (*p == '{' && (len == 0 || name[len] != '}')) {
+                fprintf(stderr, "%s: %s: bad substitution\n", SHELL_NAME, token);
+                free(sb.s);
+                return NULL;
+            }
+            const char *value;
+            if (*name >= '0' && *name <= '9') {
+                int i = atoi(name);
+                value = i == 0 ? SHELL_NAME : i <= POS_COUNT ? POS_ARGS[i - 1] : NULL;
+            } else {
+                value = getVar(name, len);
+            }
+            if (value != NULL) {
+                sbAppend(&sb, value, strlen(value));
+            }
+            p = name + len + (*p == '{');
+        } else {
+            sbAppend(&sb, "$", 1);
+        }
+    }
+    return sb.s;
+}
+
+// let EXPR...: evaluate each expression; fails if the last one is 0
+static int myShell_let(char **args) {
+    long long v = 0;
+    int error;
+    if (args[1] == NULL) {
+        fprintf(stderr, "let: expression expected\n");
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        v = arithEval(args[i], 0, &error);
+        if (error) {
+            return 1;
+        }
+    }
+    return v == 0;
+}
+
+// read [-r] [-d DELIM] [NAME...]: read one record from standard input,
+// split it on $IFS and assign the fields to the names (REPLY without any),
+// the last name taking the rest of the record. Without -r a backslash
+// quotes the next character and backslash-newline continues the record.
+// From a pipe or terminal input is read a byte at a time, so nothing past
+// the record is taken from anyone else reading the same input. A regular
+// file can be read ahead instead: blocks are read with pread() into a
+// cache and the file offset is set back to just after the record, so a
+// loop over a large file costs a few syscalls per record, not per byte.
+struct read_cache {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    off_t start;            // file offset of buf[0]
+    off_t end;              // file offset just past the cached data
+    char *buf;
+    size_t cap;
+};
+
+static struct read_cache READ_CACHE;
+
+// Read up to delim (not kept) into sb. Returns 0 if delim was found, 1 at
+// end of input, -1 on error.
+static int readRecord(int fd, char delim, struct strbuf *sb) {
+    struct read_cache *c = &READ_CACHE;
+    struct stat st;
+    off_t cur;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (cur = lseek(fd, 0, SEEK_CUR)) == -1) {
+        char ch;
+        ssize_t n;
+        while ((n = read(fd, &ch, 1)) == 1 || (n == -1 && errno == EINTR)) {
+            if (n == 1 && ch == delim) {
+                return 0;
+            }
+            if (n == 1) {
+                sbAppend(sb, &ch, 1);
+            }
+        }
+        return n == 0 ? 1 : -1;
+    }
+    // The cache holds only while the file and our place in it are unchanged
+    if (c->dev != st.st_dev || c->ino != st.st_ino || c->size != st.st_size ||
+        c->mtime.tv_sec != st.st_mtim.tv_sec || c->mtime.tv_nsec != st.st_mtim.tv_nsec ||
+        cur < c->start || cur > c->end) {
+        c->dev = st.st_dev;
+        c->ino = st.st_ino;
+        c->size = st.st_size;
+        c->mtime = st.st_mtim;
+        c->start = c->end = cur;
+    }
+    while (1) {
+        char *from = c->buf + (cur - c->start);
+        char *hit = memchr(from, delim, c->end - cur);
+        if (hit != NULL) {
+            sbAppend(sb, from, hit - from);
+            lseek(fd, cur + (hit - from) + 1, SEEK_SET);
+            return 0;
+        }
+        // Take what is cached, then fetch the next block after it
+        sbAppend(sb, from, c->end - cur);
+        cur = c->start = c->end;
+        if (c->cap == 0) {
+            c->cap = 1 << 16;
+            c->buf = malloc(c->cap);
+            if (!c->buf) {
+                allocFailed();
+            }
+        }
+        ssize_t n = pread(fd, c->buf, c->cap, c->end);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            lseek(fd, cur, SEEK_SET);
+            return n == 0 ? 1 : -1;
+        }
+        c->end += n;
+    }
+}
+
+static int isIfs(const char *ifs, char c) {
+    return c != '\0' && strchr(ifs, c) != NULL;
+}
+
+static int isIfsSpace(const char *ifs, char c) {
+    return (c == ' ' || c == '\t' || c == '\n') && isIfs(ifs, c);
+}
+
+static int myShell_read(char **args) {
+    int raw = 0, n = 1, result;
+    char delim = '\n';
+    struct strbuf line = {NULL, 0, 0};
+    for (; args[n] != NULL && args[n][0] == '-'; n++) {
+        if (strcmp(args[n], "-r") == 0) {
+            raw = 1;
+        } else if (strncmp(args[n], "-d", 2) == 0 && (args[n][2] != '\0' || args[n + 1] != NULL)) {
+            delim = args[n][2] != '\0' ? args[n][2] : args[++n][0];
+        } else {
+            fprintf(stderr, "usage: read [-r] [-d DELIM] [NAME...]\n");
+            return 2;
+        }
+    }
+    for (int i = n; args[i] != NULL; i++) {
+        if (!isName(args[i])) {
+            fprintf(stderr, "read: `%s': not a valid identifier\n", args[i]);
+            return 2;
+        }
+    }
+    sbAppend(&line, "", 0);
+    result = readRecord(STDIN_FILENO, delim, &line);
+    // A record ending in an unquoted backslash continues on the next one
+    while (!raw && result == 0 && delim == '\n') {
+        size_t slashes = 0;
+        while (slashes < line.len && line.s[line.len - 1 - slashes] == '\\') {
+            slashes++;
+        }
+        if (slashes % 2 == 0) {
+            break;
+        }
+        line.s[--line.len] = '\0';
+        result = readRecord(STDIN_FILENO, delim, &line);
+    }
+    if (result == -1) {
+        perror("read");
+        free(line.s);
+        return 2;
+    }
+
+    // Remove quoting, remembering which characters were quoted so they
+    // never split fields
+    char *quoted = calloc(line.len + 1, 1);
+    size_t len = 0;
+    if (!quoted) {
+        allocFailed();
+    }
+    for (size_t i = 0; i < line.len; i++) {
+        if (!raw && line.s[i] == '\\' && i + 1 < line.len) {
+            i++;
+            quoted[len] = 1;
+        }
+        line.s[len++] = line.s[i];
+    }
+    line.s[len] = '\0';
+
+    const char *ifs = getVar("IFS", 3);
+    if (ifs == NULL) {
+        ifs = " \t\n";
+    }
+    char *names[] = {"REPLY", NULL};
+    char **targets = args[n] != NULL ? args + n : names;
+    size_t p = 0;
+    // Without names the record is kept whole
+    if (targets == names) {
+        setVar("REPLY", 5, line.s);
+    }
+    while (targets != names && p < len && isIfsSpace(ifs, line.s[p]) && !quoted[p]) {
+        p++;
+    }
+    for (int t = 0; targets != names && targets[t] != NULL; t++) {
+        size_t start = p, end;
+        if (targets[t + 1] == NULL) {
+            // The last name takes the rest, less trailing IFS whitespace
+            end = len;
+            while (end > start && isIfsSpace(ifs, line.s[end - 1]) && !quoted[end - 1]) {
+                end--;
+            }
+            p = len;
+        } else {
+            while (p < len && (quoted[p] || !isIfs(ifs, line.s[p]))) {
+                p++;
+            }
+            end = p;
+            while (p < len && isIfsSpace(ifs, line.s[p]) && !quoted[p]) {
+                p++;
+            }
+            if (p < len && isIfs(ifs, line.s[p]) && !quoted[p] && (p == end || !isIfsSpace(ifs, line.s[p]))) {
+                p++;
+                while (p < len && isIfsSpace(ifs, line.s[p]) && !quoted[p]) {
+                    p++;
+                }
+            }
+        }
+        char saved = line.s[end];
+        line.s[end] = '\0';
+        setVar(targets[t], strlen(targets[t]), line.s + start);
+        line.s[end] = saved;
+    }
+    free(quoted);
+    free(line.s);
+    return result;
+}
+
+// Argument vectors are built by appending, growing geometrically.
+// batch-args measures the result against ARG_MAX as it splits it.
+struct argv_builder {
+    char **args;
+    size_t count;
+    size_t cap;
+    size_t fixed;           // words pushed before the first wildcard expansion
+    int expanded;
+};
+
+// Append arg, taking ownership of it. Returns -1 if memory runs out.
+static int argvPush(struct argv_builder *b, char *arg) {
+    if (arg == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    if (b->count + 1 >= b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 16;
+        char **args = realloc(b->args, cap * sizeof(char *));
+        if (args == NULL) {
+            perror("Memory allocation failed");
+            free(arg);
+            return -1;
+        }
+        b->args = args;
+        b->cap = cap;
+    }
+    b->args[b->count++] = arg;
+    b->args[b->count] = NULL;
+    if (!b->expanded) {
+        b->fixed = b->count;
+    }
+    return 0;
+}
+
+static long argMax() {
+    static long arg_max = 0;
+    if (arg_max == 0) {
+        arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max <= 0) {
+            arg_max = 128 * 1024;
+        }
+    }
+    return arg_max;
+}
+
+// Bytes the environment takes on the exec stack
+static size_t envBytes() {
+    extern char **environ;
+    size_t bytes = sizeof(char *);
+    for (char **e = environ; *e != NULL; e++) {
+        bytes += strlen(*e) + 1 + sizeof(char *);
+    }
+    return bytes;
+}
+
+// Recursive globbing. A pattern with a ** component is matched by walking
+// directories on a small thread pool with openat()/fstatat() relative to
+// directory fds. Leading literal components are opened directly, literal
+// components further down are probed with fstatat() rather than listed,
+// and results are sorted so the expansion does not depend on scheduling.
+#define RGLOB_MAX_COMPONENTS 64
+#define RGLOB_MAX_THREADS 16
+
+struct rglob_task {
+    char *path;             // directory as it appears in results, "" for .
+    uint64_t mask;          // pattern components active in this directory
+    struct rglob_task *next;
+};
+
+struct rglob {
+    char *comps[RGLOB_MAX_COMPONENTS];
+    int is_literal[RGLOB_MAX_COMPONENTS];
+    int num_comps;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct rglob_task *queue;
+    int pending;            // tasks queued or being processed
+    int failed;             // out of memory, matches were lost
+};
+
+struct rglob_worker {
+    struct rglob *g;
+    pthread_t thread;
+    char **results;
+    size_t count;
+    size_t cap;
+};
+
+static int isGlobstar(struct rglob *g, int i) {
+    return strcmp(g->comps[i], "**") == 0;
+}
+
+// A ** can match zero directories, so it also activates what follows it
+static uint64_t rglobClosure(struct rglob *g, uint64_t mask) {
+    for (int i = 0; i < g->num_comps - 1; i++) {
+        if ((mask & (1ULL << i)) && isGlobstar(g, i)) {
+            mask |= 1ULL << (i + 1);
+        }
+    }
+    return mask;
+}
+
+static char *rglobJoin(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (!path) {
+        return NULL;
+    }
+    if (dir[0] == '\0') {
+        strcpy(path, name);
+    } else {
+        sprintf(path, dir[strlen(dir) - 1] == '/' ? "%s%s" : "%s/%s", dir, name);
+    }
+    return path;
+}
+
+// Workers cannot unwind out of the walk, so running out of memory only
+// marks it failed and rglobExpand() reports it
+static void rglobFail(struct rglob *g) {
+    pthread_mutex_lock(&g->lock);
+    g->failed = 1;
+    pthread_mutex_unlock(&g->lock);
+}
+
+static void rglobEmit(struct rglob_worker *w, char *path) {
+    if (path != NULL && w->count >= w->cap) {
+        char **results = realloc(w->results, (w->cap ? w->cap * 2 : 256) * sizeof(char *));
+        if (results == NULL) {
+            free(path);
+            path = NULL;
+        } else {
+            w->results = results;
+            w->cap = w->cap ? w->cap * 2 : 256;
+        }
+    }
+    if (path == NULL) {
+        rglobFail(w->g);
+        return;
+    }
+    w->results[w->count++] = path;
+}
+
+// Queue a directory by path. It is only opened when a worker takes it, so
+// a wide tree holds one descriptor per worker, not one per queued directory.
+static void rglobPush(struct rglob *g, char *path, uint64_t mask) {
+    struct rglob_task *t = path != NULL ? malloc(sizeof(struct rglob_task)) : NULL;
+    if (!t) {
+        free(path);
+        rglobFail(g);
+        return;
+    }
+    t->path = path;
+    t->mask = mask;
+    pthread_mutex_lock(&g->lock);
+    t->next = g->queue;
+    g->queue = t;
+    g->pending++;
+    pthread_cond_signal(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
+
+// Descend into dir/name with the given components active
+static void rglobDescend(struct rglob *g, const char *dir, const char *name, uint64_t mask) {
+    rglobPush(g, rglobJoin(dir, name), rglobClosure(g, mask));
+}
+
+static void rglobProcess(struct rglob_worker *w, struct rglob_task *t) {
+    struct rglob *g = w->g;
+    int last = g->num_comps - 1, all_literal = 1, fd;
+    struct dirent *ent;
+    DIR *d;
+    fd = open(t->path[0] ? t->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        // Gone since it was listed, or a symlink to a file, is no error;
+        // anything else loses matches
+        if (errno != ENOENT && errno != ENOTDIR) {
+            fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, t->path[0] ? t->path : ".", strerror(errno));
+        }
+        return;
+    }
+    for (int i = 0; i < g->num_comps; i++) {
+        if ((t->mask & (1ULL << i)) && !g->is_literal[i]) {
+            all_literal = 0;
+        }
+    }
+    if (all_literal) {
+        // Only fixed names are wanted here, so probe them instead of listing
+        for (int i = 0; i < g->num_comps; i++) {
+            struct stat st;
+            if (!(t->mask & (1ULL << i)) || fstatat(fd, g->comps[i], &st, 0) != 0) {
+                continue;
+            }
+            if (i == last) {
+                rglobEmit(w, rglobJoin(t->path, g->comps[i]));
+            } else if (S_ISDIR(st.st_mode)) {
+                rglobDescend(g, t->path, g->comps[i], 1ULL << (i + 1));
+            }
+        }
+        close(fd);
+        return;
+    }
+    d = fdopendir(fd);
+    if (d == NULL) {
+        close(fd);
+        return;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        uint64_t next = 0;
+        int matched = 0, is_dir = ent->d_type == DT_DIR, is_link = ent->d_type == DT_LNK;
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        if (ent->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_link = S_ISLNK(st.st_mode);
+            }
+        }
+        for (int i = 0; i < g->num_comps; i++) {
+            if (!(t->mask & (1ULL << i))) {
+                continue;
+            }
+            if (isGlobstar(g, i)) {
+                // ** skips hidden entries and never follows symlinks, so
+                // walks cannot loop
+                if (ent->d_name[0] == '.') {
+                    continue;
+                }
+                if (is_dir) {
+                    next |= 1ULL << i;
+                }
+                if (i == last) {
+                    matched = 1;
+                }
+            } else if (fnmatch(g->comps[i], ent->d_name, FNM_PERIOD) == 0) {
+                if (i == last) {
+                    matched = 1;
+                } else {
+                    next |= 1ULL << (i + 1);
+                }
+            }
+        }
+        if (matched) {
+            rglobEmit(w, rglobJoin(t->path, ent->d_name));
+        }
+        if (next && (is_dir || is_link)) {
+            // Below a symlink only the components after the ** apply
+            if (is_link) {
+                for (int i = 0; i < g->num_comps; i++) {
+                    if (isGlobstar(g, i)) {
+                        next &= ~(1ULL << i);
+                    }
+                }
+            }
+            if (next) {
+                rglobDescend(g, t->path, ent->d_name, next);
+            }
+        }
+    }
+    closedir(d);
+}
+
+static void *rglobWorker(void *arg) {
+    struct rglob_worker *w = arg;
+    struct rglob *g = w->g;
+    while (1) {
+        struct rglob_task *t;
+        pthread_mutex_lock(&g->lock);
+        while (g->queue == NULL && g->pending > 0) {
+            pthread_cond_wait(&g->cond, &g->lock);
+        }
+        t = g->queue;
+        if (t == NULL) {
+            pthread_mutex_unlock(&g->lock);
+            return NULL;
+        }
+        g->queue = t->next;
+        pthread_mutex_unlock(&g->lock);
+
+        rglobProcess(w, t);
+        free(t->path);
+        free(t);
+
+        pthread_mutex_lock(&g->lock);
+        if (--g->pending == 0) {
+            pthread_cond_broadcast(&g->cond);
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+}
+
+static int compareStrings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// True if pattern has a component that is exactly **
+static int hasGlobstar(const char *pattern) {
+    for (const char *p = strstr(pattern, "**"); p != NULL; p = strstr(p + 1, "**")) {
+        if ((p == pattern || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Expand a ** pattern into b, sorted. A pattern matching nothing is kept
+// as it is, as glob() patterns are. Returns -1 on allocation failure.
+static int rglobExpand(const char *pattern, struct argv_builder *b) {
+    struct rglob g;
+    struct rglob_worker workers[RGLOB_MAX_THREADS];
+    char *copy = strdup(pattern), *base, *save;
+    int first = 0, num_threads, failed = 0;
+    size_t total = 0;
+    char **all;
+
+    memset(&g, 0, sizeof(g));
+    pthread_mutex_init(&g.lock, NULL);
+    pthread_cond_init(&g.cond, NULL);
+    // strtok_r(): the completion thread may be splitting $PATH meanwhile
+    for (char *c = strtok_r(copy, "/", &save); c != NULL; c = strtok_r(NULL, "/", &save)) {
+        if (g.num_comps == RGLOB_MAX_COMPONENTS) {
+            fprintf(stderr, "%s: %s: pattern too deep\n", SHELL_NAME, pattern);
+            free(copy);
+            return argvPush(b, strdup(pattern));
+        }
+        g.is_literal[g.num_comps] = strpbrk(c, "*?[") == NULL;
+        g.comps[g.num_comps++] = c;
+    }
+    // Leading literal components are opened directly, never listed
+    while (first < g.num_comps - 1 && g.is_literal[first]) {
+        first++;
+    }
+    base = malloc(strlen(pattern) + 2);
+    if (base == NULL) {
+        free(copy);
+        return -1;
+    }
+    base[0] = '\0';
+    if (pattern[0] == '/') {
+        strcpy(base, "/");
+    }
+    for (int i = 0; i < first; i++) {
+        strcat(base, g.comps[i]);
+        if (i < first - 1) {
+            strcat(base, "/");
+        }
+    }
+    // Shift the remaining components down so the walk starts at index 0
+    memmove(g.comps, g.comps + first, (g.num_comps - first) * sizeof(char *));
+    memmove(g.is_literal, g.is_literal + first, (g.num_comps - first) * sizeof(int));
+    g.num_comps -= first;
+    rglobPush(&g, base, rglobClosure(&g, 1));
+
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    // Directory reads block on I/O, so use a few threads even on small hosts
+    num_threads = num_threads < 4 ? 4 : num_threads > RGLOB_MAX_THREADS ? RGLOB_MAX_THREADS : num_threads;
+    for (int i = 0; i < num_threads; i++) {
+        workers[i] = (struct rglob_worker){&g, 0, NULL, 0, 0};
+        if (pthread_create(&workers[i].thread, NULL, rglobWorker, &workers[i]) != 0) {
+            num_threads = i;
+            break;
+        }
+    }
+    if (num_threads == 0) {
+        workers[0] = (struct rglob_worker){&g, 0, NULL, 0, 0};
+        rglobWorker(&workers[0]);
+        num_threads = 1;
+    } else {
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        total += workers[i].count;
+    }
+    all = g.failed ? NULL : malloc((total + 1) * sizeof(char *));
+    failed = all == NULL;
+    total = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (workers[i].count > 0 && !failed) {
+            memcpy(all + total, workers[i].results, workers[i].count * sizeof(char *));
+            total += workers[i].count;
+        }
+        for (size_t j = 0; failed && j < workers[i].count; j++) {
+            free(workers[i].results[j]);
+        }
+        free(workers[i].results);
+    }
+    if (!failed) {
+        qsort(all, total, sizeof(char *), compareStrings);
+    }
+    if (total == 0 && !failed) {
+        failed = argvPush(b, strdup(pattern)) == -1;
+    }
+    for (size_t i = 0; i < total; i++) {
+        if (failed) {
+            free(all[i]);
+        } else {
+            failed = argvPush(b, all[i]) == -1;
+        }
+    }
+    free(all);
+    free(copy);
+    pthread_mutex_destroy(&g.lock);
+    pthread_cond_destroy(&g.cond);
+    return failed ? -1 : 0;
+}
+
+// Expand tokens into b. Returns -1 on allocation failure.
+static int expandArgs(char *tokens[], struct argv_builder *b) {
+    glob_t glob_result;
+    // A pattern that matches nothing is kept as it is
+    int i, flags = GLOB_NOCHECK;
+
+    // Iterate over tokens until NULL is encountered
+    for (i = 0; tokens[i] != NULL; i++) {
+        char *token = tokens[i], *substituted = NULL;
+        int failed = 0;
+        if (strcmp(token, "$@") == 0 || strcmp(token, "$*") == 0) {
+            // Standing alone, each positional parameter is a word of its own
+            for (int j = 0; j < POS_COUNT && !failed; j++) {
+                failed = argvPush(b, strdup(POS_ARGS[j])) == -1;
+            }
+            if (failed) {
+                return -1;
+            }
+            continue;
+        }
+        if (strchr(token, '$') != NULL) {
+            token = substituted = expandParams(token);
+            if (token == NULL) {
+                return -1;
+            }
+        }
+        if (hasGlobstar(token)) {
+            b->expanded = 1;
+            failed = rglobExpand(token, b) == -1;
+        } else if (strchr(token, '*') != NULL || strchr(token, '?') != NULL) {
+            // If the token contains wildcard characters
+            b->expanded = 1;
+            // Use glob to expand the wildcard pattern
+            if (glob(token, flags, NULL, &glob_result) == 0) {
+                // Copy expanded filenames
+                for (size_t j = 0; j < glob_result.gl_pathc && !failed; j++) {
+                    failed = argvPush(b, strdup(glob_result.gl_pathv[j])) == -1;
+                }
+                // Free memory allocated by glob
+                globfree(&glob_result);
+            }
+        } else {
+            // No wildcards, just copy the token
+            failed = argvPush(b, strdup(token)) == -1;
+        }
+        free(substituted);
+        if (failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static char **expand_wildcards(char *tokens[]) {
+    struct argv_builder b = {NULL, 0, 0, 0, 0};
+    if (expandArgs(tokens, &b) == -1) {
+        freeArgs(b.args);
+        return NULL;
+    }
+    if (b.args == NULL) {
+        b.args = calloc(1, sizeof(char *));
+    }
+    return b.args;
+}
+
+// batch-args [-j N] cmd args...: run cmd over args in as many exec batches
+// as ARG_MAX requires, up to N at a time. Every batch repeats the words
+// given before the first wildcard expansion (at least cmd itself). Runs in
+// the stage's child, so redirections and limits already apply to all
+// batches. Returns the last failing batch's status, or 0.
+static int runBatches(struct command *cmd) {
+    size_t nargs = countArgs(cmd->args);
+    size_t fixed = cmd->fixed_args < 1 ? 1 : cmd->fixed_args > nargs ? nargs : cmd->fixed_args;
+    size_t fixed_bytes = 0, next = fixed;
+    // Leave headroom for the auxiliary vector and the program name
+    long budget = argMax() - (long)envBytes() - 4096;
+    char **batch = malloc((nargs + 1) * sizeof(char *));
+    struct child *running = malloc(cmd->batch_jobs * sizeof(struct child));
+    int num_running = 0, result = 0, launched = 0;
+
+    if (batch == NULL || running == NULL) {
+        perror("batch-args");
+        return 1;
+    }
+    for (size_t i = 0; i < fixed; i++) {
+        batch[i] = cmd->args[i];
+        fixed_bytes += strlen(cmd->args[i]) + 1 + sizeof(char *);
+    }
+    while (next < nargs || !launched || num_running > 0) {
+        if ((next < nargs || !launched) && num_running < cmd->batch_jobs) {
+            size_t n = fixed;
+            long bytes = fixed_bytes;
+            // Always take at least one argument, so an oversized one fails
+            // in execve() instead of looping here
+            while (next < nargs && (n == fixed || bytes + (long)(strlen(cmd->args[next]) + 1 + sizeof(char *)) <= budget)) {
+                bytes += strlen(cmd->args[next]) + 1 + sizeof(char *);
+                batch[n++] = cmd->args[next++];
+            }
+            batch[n] = NULL;
+            launched = 1;
+            pid_t pid = fork();
+            if (pid == 0) {
+                execResolved(batch);
+                fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, batch[0], strerror(errno));
+                _exit(errno == ENOENT ? 127 : 126);
+            } else if (pid < 0) {
+                perror("batch-args");
+                result = 1;
+                next = nargs;
+                continue;
+            }
+            childInit(&running[num_running++], pid, 0, 0);
+            continue;
+        }
+        // Refill as soon as any batch finishes
+        waitChildren(running, num_running, 1, 1);
+        for (int i = 0; i < num_running; i++) {
+            if (running[i].done) {
+                if (childStatus(&running[i]) != 0) {
+                    result = childStatus(&running[i]);
+                }
+                running[i--] = running[--num_running];
+            }
+        }
+    }
+    free(batch);
+    free(running);
+    return result;
+}
+
+// Consume "batch-args [-j N]" from the front of args. Returns the number of
+// words used, or -1 after reporting bad usage.
+static int parseBatchPrefix(char **args, int *jobs) {
+    int n = 1;
+    *jobs = 1;
+    if (args[n] != NULL && strncmp(args[n], "-j", 2) == 0) {
+        char *value = args[n][2] ? args[n] + 2 : args[++n];
+        char *end;
+        *jobs = value ? strtol(value, &end, 10) : -1;
+        if (value == NULL || *end != '\0' || *jobs < 0) {
+            fprintf(stderr, "usage: batch-args [-j N] command args...\n");
+            return -1;
+        }
+        if (*jobs == 0) {
+            *jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        n++;
+    }
+    if (args[n] == NULL) {
+        fprintf(stderr, "usage: batch-args [-j N] command args...\n");
+        return -1;
+    }
+    return n;
+}
+
+// Result memoization. "memo [-C] [-f] [-i FILE]... [-e VAR]... cmd args"
+// keys a run on its argv, working directory, the named input files (size,
+// mtime and inode, or full contents with -C) and the named environment
+// variables. Only runs that exit 0 are stored, unless -f asks for failures
+// too. On a hit the shell replays the stored stdout and exit status itself,
+// as it runs a builtin, without forking. The cache is a directory of
+// content-addressed entries bounded in total size, evicting the least
+// recently used; a hit refreshes the entry's mtime.
+#define MEMO_MAGIC "MEMO"
+#define MEMO_HEADER 8       // magic plus 32-bit exit status
+#define MEMO_DEFAULT_MAX (256LL * 1024 * 1024)
+
+struct memo_spec {
+    char **inputs;
+    int num_inputs;
+    char **env;
+    int num_env;
+    int contents;           // hash file contents rather than metadata
+    int failures;           // store runs that fail as well
+};
+
+// 128-bit FNV-1a, the key an entry is named by
+struct memo_hash {
+    unsigned __int128 h;
+};
+
+#define MEMO_FNV_PRIME (((unsigned __int128)1 << 88) | 0x13b)
+#define MEMO_FNV_BASIS (((unsigned __int128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+
+static void memoHash(struct memo_hash *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h->h = (h->h ^ p[i]) * MEMO_FNV_PRIME;
+    }
+}
+
+static void memoHashString(struct memo_hash *h, const char *s) {
+    // Include the terminator so adjacent strings cannot run together
+    memoHash(h, s, strlen(s) + 1);
+}
+
+// Cache directory: $MYSHLL_MEMO_DIR, else $XDG_CACHE_HOME/myshll/memo,
+// else ~/.cache/myshll/memo. Created on demand.
+static int memoDir(char *dir, size_t size) {
+    char *env = getenv("MYSHLL_MEMO_DIR");
+    if (env != NULL) {
+        snprintf(dir, size, "%s", env);
+    } else if (getenv("XDG_CACHE_HOME") != NULL) {
+        snprintf(dir, size, "%s/myshll/memo", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME") != NULL) {
+        snprintf(dir, size, "%s/.cache/myshll/memo", getenv("HOME"));
+    } else {
+        return -1;
+    }
+    // mkdir -p
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+static long long memoMax() {
+    char *env = getenv("MYSHLL_MEMO_MAX");
+    long long max = env ? parseSize(env) : -1;
+    return max > 0 ? max : MEMO_DEFAULT_MAX;
+}
+
+// Add one to the hit or miss counter in the cache's stats file
+static void memoCount(const char *dir, int hit) {
+    char path[1100];
+    unsigned long long counts[2] = {0, 0};
+    int fd;
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    if (pread(fd, counts, sizeof(counts), 0) != sizeof(counts)) {
+        counts[0] = counts[1] = 0;
+    }
+    counts[hit ? 0 : 1]++;
+    if (pwrite(fd, counts, sizeof(counts), 0) != sizeof(counts)) {
+        perror("memo");
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static int memoKey(struct command *cmd, char *key, size_t size) {
+    struct memo_hash h = {MEMO_FNV_BASIS};
+    struct memo_spec *spec = cmd->memo;
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    memoHashString(&h, cwd);
+    for (int i = 0; cmd->args[i] != NULL; i++) {
+        memoHashString(&h, cmd->args[i]);
+    }
+    memoHashString(&h, "");
+    for (int i = 0; i < spec->num_env; i++) {
+        char *value = getenv(spec->env[i]);
+        memoHashString(&h, spec->env[i]);
+        memoHashString(&h, value ? value : "");
+        memoHash(&h, &(char){value != NULL}, 1);
+    }
+    for (int i = 0; i < spec->num_inputs; i++) {
+        struct stat st;
+        memoHashString(&h, spec->inputs[i]);
+        if (stat(spec->inputs[i], &st) == -1) {
+            memoHashString(&h, "missing");
+            continue;
+        }
+        if (spec->contents) {
+            char buf[65536];
+            ssize_t n;
+            int fd = open(spec->inputs[i], O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return -1;
+            }
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                memoHash(&h, buf, n);
+            }
+            close(fd);
+        } else {
+            memoHash(&h, &st.st_size, sizeof(st.st_size));
+            memoHash(&h, &st.st_mtim, sizeof(st.st_mtim));
+            memoHash(&h, &st.st_ino, sizeof(st.st_ino));
+            memoHash(&h, &st.st_dev, sizeof(st.st_dev));
+        }
+    }
+    snprintf(key, size, "%016llx%016llx", (unsigned long long)(h.h >> 64), (unsigned long long)h.h);
+    return 0;
+}
+
+// Copy the rest of in_fd to out_fd, with sendfile() where the kernel allows
+static int copyFd(int in_fd, int out_fd) {
+    char buf[65536];
+    ssize_t n;
+    while ((n = sendfile(out_fd, in_fd, NULL, 1 << 30)) > 0) {
+    }
+    if (n == 0) {
+        return 0;
+    }
+    while ((n = read(in_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w <= 0) {
+                return -1;
+            }
+            off += w;
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+struct memo_entry {
+    char name[64];
+    off_t size;
+    struct timespec mtime;
+};
+
+static int compareMemoAge(const void *a, const void *b) {
+    const struct memo_entry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+// Scan the cache. With max >= 0, evict least recently used entries until
+// the total fits in max bytes. Returns the number of entries left.
+static int memoScan(const char *dir, long long max, long long *total) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    struct memo_entry *entries = NULL;
+    int num = 0, cap = 0;
+    *total = 0;
+    if (d == NULL) {
+        return 0;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        struct stat st;
+        // Entries are named by their 32-digit key; skip stats and temp files
+        if (strlen(ent->d_name) != 32 || fstatat(dirfd(d), ent->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (num >= cap) {
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, cap * sizeof(struct memo_entry));
+            if (!entries) {
+                allocFailed();
+            }
+        }
+        strcpy(entries[num].name, ent->d_name);
+        entries[num].size = st.st_size;
+        entries[num++].mtime = st.st_mtim;
+        *total += st.st_size;
+    }
+    if (max >= 0 && *total > max) {
+        qsort(entries, num, sizeof(struct memo_entry), compareMemoAge);
+        for (int i = 0; i < num && *total > max; i++) {
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0) {
+                *total -= entries[i].size;
+                entries[i--] = entries[--num];
+            }
+        }
+    }
+    closedir(d);
+    free(entries);
+    return num;
+}
+
+// Open the entry for key, positioned at its output, and set *stored to its
+// exit status. A failure is not replayed unless the spec asks for them.
+// Returns -1 on a miss.
+static int memoOpen(struct memo_spec *spec, const char *dir, const char *key, int *stored) {
+    char path[1100], header[MEMO_HEADER];
+    int32_t status;
+    int fd;
+    snprintf(path, sizeof(path), "%s/%s", dir, key);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (read(fd, header, MEMO_HEADER) != MEMO_HEADER || memcmp(header, MEMO_MAGIC, 4) != 0) {
+        close(fd);
+        return -1;
+    }
+    memcpy(&status, header + 4, sizeof(status));
+    if (status != 0 && !spec->failures) {
+        close(fd);
+        return -1;
+    }
+    // Refresh the entry's place in the LRU order
+    futimens(fd, NULL);
+    *stored = status;
+    return fd;
+}
+
+// The entry a memoized stage would replay, or -1 if it has to run. Only a
+// stage with no other prefix, which needs no process of its own.
+static int memoCached(struct command *cmd, int *stored) {
+    char dir[1024], key[40];
+    if (cmd->memo == NULL || cmd->limits != NULL || cmd->sched != NULL || cmd->batch_jobs != 0 ||
+        cmd->timeout != 0 || memoDir(dir, sizeof(dir)) == -1 || memoKey(cmd, key, sizeof(key)) == -1) {
+        return -1;
+    }
+    return memoOpen(cmd->memo, dir, key, stored);
+}
+
+// Replay a cached stage from the shell, through its redirections, and
+// close the entry. Returns the stored status.
+static int memoReplay(struct command *cmd, int fd, int stored, int in_fd, int out_fd) {
+    struct saved_fds saved;
+    struct sigaction ignore, old;
+    char dir[1024];
+
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old);
+    double started = traceNow();
+    if (redirectShell(cmd, in_fd, out_fd, &saved) == -1) {
+        stored = 1;
+    } else {
+        copyFd(fd, STDOUT_FILENO);
+    }
+    restoreShell(&saved);
+    traceSpan("memo", cmd->args[0], started, traceNow(), 0);
+    sigaction(SIGPIPE, &old, NULL);
+    close(fd);
+    if (memoDir(dir, sizeof(dir)) == 0) {
+        memoCount(dir, 1);
+    }
+    return stored;
+}
+
+// Run a memoized command in the stage's child. Returns its exit status.
+static int runMemo(struct command *cmd) {
+    char dir[1024], key[40], path[1100], tmp[1100];
+    int fd, pipefd[2], status, stored;
+    struct child kid;
+    pid_t pid;
+
+    if (memoDir(dir, sizeof(dir)) == -1 || memoKey(cmd, key, sizeof(key)) == -1) {
+        fprintf(stderr, "memo: cache unavailable, running uncached\n");
+        execResolved(cmd->args);
+        fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, cmd->args[0], strerror(errno));
+        return errno == ENOENT ? 127 : 126;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, key);
+
+    fd = memoOpen(cmd->memo, dir, key, &stored);
+    if (fd != -1) {
+        copyFd(fd, STDOUT_FILENO);
+        close(fd);
+        memoCount(dir, 1);
+        return stored;
+    }
+    memoCount(dir, 0);
+
+    // Miss: run the command with its stdout teed into a temporary entry
+    snprintf(tmp, sizeof(tmp), "%s/.tmp-%d", dir, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("memo");
+        return 1;
+    }
+    pid = fork();
+    if (pid == -1) {
+        perror("memo");
+        return 1;
+    }
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        execResolved(cmd->args);
+        fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, cmd->args[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    close(pipefd[1]);
+    if (write(fd, "MEMO\0\0\0\0", MEMO_HEADER) != MEMO_HEADER) {
+        perror("memo");
+    }
+    while (1) {
+        char buf[65536];
+        ssize_t n = read(pipefd[0], buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(STDOUT_FILENO, buf + off, n - off);
+            if (w <= 0) {
+                break;
+            }
+            off += w;
+        }
+        if (write(fd, buf, n) != n) {
+            perror("memo");
+        }
+    }
+    close(pipefd[0]);
+    childInit(&kid, pid, 0, 0);
+    waitChildren(&kid, 1, 1, 1);
+    status = childStatus(&kid);
+
+    // Only runs that exited on their own are worth replaying, and of those
+    // only successes unless -f was given
+    if (WIFEXITED(kid.status) && (status == 0 || cmd->memo->failures)) {
+        int32_t stored = status;
+        if (pwrite(fd, &stored, sizeof(stored), 4) == sizeof(stored) && close(fd) == 0 && rename(tmp, path) == 0) {
+            long long total;
+            memoScan(dir, memoMax(), &total);
+            return status;
+        }
+    } else {
+        close(fd);
+    }
+    unlink(tmp);
+    return status;
+}
+
+// Consume "memo [-C] [-f] [-i FILE]... [-e VAR]..." from the front of args when a
+// command follows. Returns the number of words used, 0 if the memo builtin
+// should handle the line instead, or -1 after reporting bad usage.
+static int parseMemoPrefix(char **args, struct memo_spec **out) {
+    struct memo_spec *spec;
+    int n = 1;
+    if (args[1] == NULL || strncmp(args[1], "--", 2) == 0) {
+        return 0;
+    }
+    spec = calloc(1, sizeof(struct memo_spec));
+    if (!spec) {
+        allocFailed();
+    }
+    spec->inputs = calloc(countArgs(args), sizeof(char *));
+    spec->env = calloc(countArgs(args), sizeof(char *));
+    if (!spec->inputs || !spec->env) {
+        allocFailed();
+    }
+    *out = spec;
+    for (; args[n] != NULL && args[n][0] == '-'; n++) {
+        if (strcmp(args[n], "-C") == 0) {
+            spec->contents = 1;
+        } else if (strcmp(args[n], "-f") == 0) {
+            spec->failures = 1;
+        } else if (strcmp(args[n], "-i") == 0 && args[n + 1] != NULL) {
+            spec->inputs[spec->num_inputs++] = strdup(args[++n]);
+        } else if (strcmp(args[n], "-e") == 0 && args[n + 1] != NULL) {
+            spec->env[spec->num_env++] = strdup(args[++n]);
+        } else {
+            break;
+        }
+    }
+    if (args[n] == NULL || args[n][0] == '-') {
+        fprintf(stderr, "usage: memo [-C] [-f] [-i FILE]... [-e VAR]... command args...\n");
+        return -1;
+    }
+    return n;
+}
+
+static void freeMemoSpec(struct memo_spec *spec) {
+    if (spec == NULL) {
+        return;
+    }
+    for (int i = 0; i < spec->num_inputs; i++) {
+        free(spec->inputs[i]);
+    }
+    for (int i = 0; i < spec->num_env; i++) {
+        free(spec->env[i]);
+    }
+    free(spec->inputs);
+    free(spec->env);
+    free(spec);
+}
+
+// memo --stats | --clear
+static int myShell_memo(char **args) {
+    char dir[1024], path[1100];
+    unsigned long long counts[2] = {0, 0};
+    long long total;
+    int entries, fd;
+    if (memoDir(dir, sizeof(dir)) == -1) {
+        fprintf(stderr, "memo: no cache directory\n");
+        return 1;
+    }
+    if (args[1] != NULL && strcmp(args[1], "--clear") == 0) {
+        memoScan(dir, 0, &total);
+        snprintf(path, sizeof(path), "%s/stats", dir);
+        unlink(path);
+        return 0;
+    }
+    if (args[1] == NULL || strcmp(args[1], "--stats") != 0) {
+        fprintf(stderr, "usage: memo [-C] [-f] [-i FILE]... [-e VAR]... command args...\n"
+                        "       memo --stats | --clear\n");
+        return 2;
+    }
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
+        if (read(fd, counts, sizeof(counts)) != sizeof(counts)) {
+            counts[0] = counts[1] = 0;
+        }
+        close(fd);
+    }
+    entries = memoScan(dir, -1, &total);
+    printf("cache: %s\n", dir);
+    printf("entries: %d, %lld bytes of %lld\n", entries, total, memoMax());
+    printf("hits: %llu, misses: %llu", counts[0], counts[1]);
+    if (counts[0] + counts[1] > 0) {
+        printf(" (%.1f%% hit rate)", 100.0 * counts[0] / (counts[0] + counts[1]));
+    }
+    printf("\n");
+    return 0;
+}
+
+// Shared command lookup cache. With MYSHLL_CMD_CACHE set, resolved command
+// paths are kept in a table in a memory-mapped file (the variable's value,
+// or /dev/shm/myshll-UID.cmdcache when it is empty) that every instance
+// maps. An entry's key hashes the command name with $PATH and the inode and
+// mtime of each directory on it, so adding or removing a program anywhere
+// on $PATH changes the key and stale entries are not found. Those
+// directories are stat'd at most once every CMD_CACHE_RECHECK seconds, or
+// when $PATH changes, and the shell does it before forking so children
+// inherit the result; a program added within that window may be missed
+// until it passes, as with any shell's command hash. Each slot is
+// a seqlock: a writer makes the sequence odd with a compare-and-swap, fills
+// the slot and makes it even again; readers copy the slot and retry or give
+// up if the sequence moved, so a lookup never waits for anyone. A slot
+// holds the command name as well as the key, so two names whose keys
+// collide never get each other's path. The file is only used if it is
+// the user's own and nobody else may write it, as /dev/shm is shared.
+#define CMD_CACHE_SLOTS 8192
+#define CMD_CACHE_PROBE 8
+#define CMD_CACHE_MAGIC 0x6d7973686c6c6332ULL
+#define CMD_CACHE_RECHECK 1.0
+
+struct cmd_slot {
+    uint32_t seq;           // odd while a writer fills the slot
+    uint16_t len;
+    uint16_t name_len;
+    uint64_t key;           // 0 for an empty slot
+    char name[64];
+    char path[240];
+};
+
+struct cmd_cache {
+    uint64_t magic;
+    char pad[sizeof(struct cmd_slot) - sizeof(uint64_t)];
+    struct cmd_slot slots[CMD_CACHE_SLOTS];
+};
+
+static struct cmd_cache *CMD_CACHE = NULL;
+static int CMD_CACHE_STATE = 0;    // 0 not tried yet, 1 mapped, -1 disabled
+
+// The directories on $PATH as of the last check: the $PATH they were read
+// from, a hash of their inodes and mtimes, and when it was taken
+static char *CMD_CACHE_PATH = NULL;
+static struct memo_hash CMD_CACHE_DIRS;
+static double CMD_CACHE_CHECKED = 0;
+
+static struct cmd_cache *cmdCacheMap() {
+    char path[256];
+    char *env = getenv("MYSHLL_CMD_CACHE");
+    struct stat st;
+    int fd;
+    if (CMD_CACHE_STATE != 0) {
+        return CMD_CACHE;
+    }
+    CMD_CACHE_STATE = -1;
+    if (env == NULL) {
+        return NULL;
+    }
+    if (env[0] != '\0') {
+        snprintf(path, sizeof(path), "%s", env);
+    } else {
+        snprintf(path, sizeof(path), "/dev/shm/myshll-%d.cmdcache", (int)getuid());
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    // A new file is zero-filled, which is already an empty table
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022) != 0 ||
+        (st.st_size == 0 && ftruncate(fd, sizeof(struct cmd_cache)) == -1) ||
+        (st.st_size != 0 && st.st_size != sizeof(struct cmd_cache))) {
+        close(fd);
+        return NULL;
+    }
+    struct cmd_cache *cache = mmap(NULL, sizeof(struct cmd_cache), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) {
+        return NULL;
+    }
+    uint64_t magic = 0;
+    if (!__atomic_compare_exchange_n(&cache->magic, &magic, CMD_CACHE_MAGIC, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) &&
+        magic != CMD_CACHE_MAGIC) {
+        munmap(cache, sizeof(struct cmd_cache));
+        return NULL;
+    }
+    CMD_CACHE = cache;
+    CMD_CACHE_STATE = 1;
+    return cache;
+}
+
+// Hash of $PATH and the state of its directories, taken again only once
+// CMD_CACHE_RECHECK seconds have passed or $PATH has changed
+static struct memo_hash cmdCacheDirs(const char *path) {
+    struct memo_hash h = {MEMO_FNV_BASIS};
+    double now = monotonicNow();
+    char dir[1024];
+    int relative = 0;
+    if (CMD_CACHE_PATH != NULL && strcmp(CMD_CACHE_PATH, path) == 0 && now - CMD_CACHE_CHECKED < CMD_CACHE_RECHECK) {
+        return CMD_CACHE_DIRS;
+    }
+    memoHashString(&h, path);
+    for (const char *p = path; ; p++) {
+        const char *end = strchrnul(p, ':');
+        struct stat st;
+        snprintf(dir, sizeof(dir), "%.*s", (int)(end - p), p);
+        relative |= dir[0] != '/';
+        if (stat(dir[0] ? dir : ".", &st) == 0) {
+            memoHash(&h, &st.st_ino, sizeof(st.st_ino));
+            memoHash(&h, &st.st_mtim, sizeof(st.st_mtim));
+        }
+        if (*end == '\0') {
+            break;
+        }
+        p = end;
+    }
+    free(CMD_CACHE_PATH);
+    CMD_CACHE_PATH = NULL;
+    // A relative entry changes with cd, so such a $PATH is checked every
+    // time; so is one there is no copy of to compare
+    if (!relative && (CMD_CACHE_PATH = strdup(path)) != NULL) {
+        CMD_CACHE_DIRS = h;
+        CMD_CACHE_CHECKED = now;
+    }
+    return h;
+}
+
+// Take the directory hash in the shell, when it is due, so forked children
+// start with it rather than each stat'ing every directory on $PATH
+static void cmdCacheRefresh() {
+    char *path = getenv("PATH");
+    if (cmdCacheMap() != NULL && path != NULL) {
+        cmdCacheDirs(path);
+    }
+}
+
+// Key for name under the current $PATH and the state of its directories
+static uint64_t cmdCacheKey(const char *name, const char *path) {
+    struct memo_hash h = cmdCacheDirs(path);
+    uint64_t key;
+    memoHashString(&h, name);
+    key = (uint64_t)(h.h >> 64) ^ (uint64_t)h.h;
+    return key ? key : 1;
+}
+
+static int cmdCacheGet(struct cmd_cache *cache, uint64_t key, const char *name, char *out, size_t size) {
+    size_t name_len = strlen(name);
+    char seen[sizeof(cache->slots[0].name)];
+    if (name_len >= sizeof(seen)) {
+        return -1;
+    }
+    for (int i = 0; i < CMD_CACHE_PROBE; i++) {
+        struct cmd_slot *slot = &cache->slots[(key + i) % CMD_CACHE_SLOTS];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1 || __atomic_load_n(&slot->key, __ATOMIC_RELAXED) != key ||
+            __atomic_load_n(&slot->name_len, __ATOMIC_RELAXED) != name_len) {
+            continue;
+        }
+        uint32_t len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+        if (len >= size || len >= sizeof(slot->path)) {
+            continue;
+        }
+        memcpy(seen, slot->name, name_len);
+        memcpy(out, slot->path, len);
+        out[len] = '\0';
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq && memcmp(seen, name, name_len) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void cmdCachePut(struct cmd_cache *cache, uint64_t key, const char *name, const char *path) {
+    size_t len = strlen(path), name_len = strlen(name);
+    struct cmd_slot *slot = NULL;
+    if (len >= sizeof(slot->path) || name_len >= sizeof(slot->name)) {
+        return;
+    }
+    // Take an empty slot in the probe window, else evict one chosen by the key
+    for (int i = 0; i < CMD_CACHE_PROBE && slot == NULL; i++) {
+        struct cmd_slot *s = &cache->slots[(key + i) % CMD_CACHE_SLOTS];
+        if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) == 0) {
+            slot = s;
+        }
+    }
+    if (slot == NULL) {
+        slot = &cache->slots[(key + (key >> 32) % CMD_CACHE_PROBE) % CMD_CACHE_SLOTS];
+    }
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    // Another writer has the slot; the cache is only a hint, so skip it
+    if (seq & 1 || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->name_len, name_len, __ATOMIC_RELAXED);
+    memcpy(slot->name, name, name_len);
+    memcpy(slot->path, path, len);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Resolve name against $PATH into out, through the shared cache when it is
+// enabled. Returns -1 if nothing on $PATH is an executable file.
+static int lookupCommand(const char *name, char *out, size_t size) {
+    char *path = getenv("PATH");
+    struct cmd_cache *cache = cmdCacheMap();
+    uint64_t key = 0;
+    if (path == NULL || name[0] == '\0' || strchr(name, '/') != NULL) {
+        return -1;
+    }
+    if (cache != NULL) {
+        key = cmdCacheKey(name, path);
+        if (cmdCacheGet(cache, key, name, out, size) == 0) {
+            return 0;
+        }
+    }
+    for (const char *p = path; ; p++) {
+        const char *end = strchrnul(p, ':');
+        struct stat st;
+        // An empty $PATH entry means the current directory
+        if (end == p) {
+            snprintf(out, size, "%s", name);
+        } else {
+            snprintf(out, size, "%.*s/%s", (int)(end - p), p, name);
+        }
+        if (stat(out, &st) == 0 && S_ISREG(st.st_mode) && access(out, X_OK) == 0) {
+            if (cache != NULL && end != p) {
+                cmdCachePut(cache, key, name, out);
+            }
+            return 0;
+        }
+        if (*end == '\0') {
+            return -1;
+        }
+        p = end;
+    }
+}
+
+// execvp() with the path looked up through the shared cache. Falls back to
+// execvp() itself, which also handles scripts without a #! line.
+static void execResolved(char **args) {
+    char path[1024];
+    if (cmdCacheMap() != NULL && lookupCommand(args[0], path, sizeof(path)) == 0) {
+        execv(path, args);
+    }
+    execvp(args[0], args);
+}
+
+// Completion trie over every executable on $PATH plus the builtin table.
+// Each node counts how many sources (PATH directories or the builtin table)
+// provide the name ending there, so a single directory can be rescanned when
+// its mtime changes without disturbing names other directories also supply.
+// A node left with no references and no children is freed.
+struct trie_node {
+    char c;
+    int refs;
+    struct trie_node *child;
+    struct trie_node *sibling;
+};
+
+struct path_dir {
+    char *path;
+    struct timespec mtime;
+    char **names;
+    int num_names;
+};
+
+// The trie is refreshed by one background thread at a time. Only that thread
+// touches dirs and builtins_added; the lock covers the trie and refreshing.
+struct completion {
+    pthread_mutex_t lock;   // held while changing or reading the trie
+    struct trie_node root;
+    int refreshing;         // a refresh thread is running
+    struct path_dir *dirs;
+    int num_dirs;
+    int builtins_added;
+};
+
+static struct completion COMP = {PTHREAD_MUTEX_INITIALIZER};
+
+static void trieAdd(const char *name) {
+    struct trie_node *node = &COMP.root;
+    for (const char *p = name; *p; p++) {
+        struct trie_node **link = &node->child;
+        // Siblings stay sorted so completions come out in order
+        while (*link != NULL && (*link)->c < *p) {
+            link = &(*link)->sibling;
+        }
+        if (*link == NULL || (*link)->c != *p) {
+            struct trie_node *n = calloc(1, sizeof(struct trie_node));
+            // Completion is best effort: a name that does not fit is left out
+            if (!n) {
+                return;
+            }
+            n->c = *p;
+            n->sibling = *link;
+            *link = n;
+        }
+        node = *link;
+    }
+    node->refs++;
+}
+
+// Drop one reference to name below node, freeing the nodes on its path that
+// are left unused.
+static void trieRelease(struct trie_node *node, const char *name) {
+    struct trie_node **link = &node->child;
+    while (*link != NULL && (*link)->c < *name) {
+        link = &(*link)->sibling;
+    }
+    if (*link == NULL || (*link)->c != *name) {
+        return;
+    }
+    struct trie_node *n = *link;
+    if (name[1] == '\0') {
+        n->refs--;
+    } else {
+        trieRelease(n, name + 1);
+    }
+    if (n->refs <= 0 && n->child == NULL) {
+        *link = n->sibling;
+        free(n);
+    }
+}
+
+static void trieCollect(struct trie_node *node, char *buf, int len, char ***out, int *num, int *cap) {
+    if (node->refs > 0) {
+        if (*num >= *cap) {
+            char **grown = realloc(*out, (*cap ? *cap * 2 : 16) * sizeof(char *));
+            if (!grown) {
+                return;
+            }
+            *out = grown;
+            *cap = *cap ? *cap * 2 : 16;
+        }
+        buf[len] = '\0';
+        if (((*out)[*num] = strdup(buf)) != NULL) {
+            (*num)++;
+        }
+    }
+    if (len >= 255) {
+        return;
+    }
+    for (struct trie_node *c = node->child; c != NULL; c = c->sibling) {
+        buf[len] = c->c;
+        trieCollect(c, buf, len + 1, out, num, cap);
+    }
+}
+
+// List the executables in one PATH directory.
+static void pathDirScan(struct path_dir *dir) {
+    DIR *d = opendir(dir->path);
+    struct dirent *ent;
+    int cap = 0;
+    dir->names = NULL;
+    dir->num_names = 0;
+    if (d == NULL) {
+        return;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        struct stat st;
+        if (ent->d_name[0] == '.' || ent->d_type == DT_DIR) {
+            continue;
+        }
+        if (faccessat(dirfd(d), ent->d_name, X_OK, 0) != 0) {
+            continue;
+        }
+        if ((ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) &&
+            (fstatat(dirfd(d), ent->d_name, &st, 0) != 0 || S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        if (dir->num_names >= cap) {
+            char **names = realloc(dir->names, (cap ? cap * 2 : 64) * sizeof(char *));
+            if (!names) {
+                break;
+            }
+            dir->names = names;
+            cap = cap ? cap * 2 : 64;
+        }
+        if ((dir->names[dir->num_names] = strdup(ent->d_name)) == NULL) {
+            break;
+        }
+        dir->num_names++;
+    }
+    closedir(d);
+}
+
+// Take a directory's names out of the trie. Called with COMP.lock held.
+static void pathDirRelease(struct path_dir *dir) {
+    for (int i = 0; i < dir->num_names; i++) {
+        trieRelease(&COMP.root, dir->names[i]);
+        free(dir->names[i]);
+    }
+    free(dir->names);
+    free(dir->path);
+}
+
+// Bring the trie up to date with path. Only directories that are new or
+// whose mtime changed since the last refresh are rescanned, and the lock is
+// taken only to change the trie, never across a directory scan.
+static void completionRefresh(char *path) {
+    char *save;
+    struct path_dir *dirs = NULL;
+    int num_dirs = 0;
+    if (!COMP.builtins_added) {
+        pthread_mutex_lock(&COMP.lock);
+        for (int i = 0; i < numBuiltin(); i++) {
+            trieAdd(builtin_cmd[i]);
+        }
+        pthread_mutex_unlock(&COMP.lock);
+        COMP.builtins_added = 1;
+    }
+    // strtok_r(): this runs beside the main thread, which tokenizes too
+    for (char *tok = strtok_r(path, ":", &save); tok != NULL; tok = strtok_r(NULL, ":", &save)) {
+        struct stat st;
+        struct path_dir dir = {0};
+        int old = -1;
+        for (int i = 0; i < num_dirs; i++) {
+            if (strcmp(dirs[i].path, tok) == 0) {
+                old = i;
+            }
+        }
+        if (old != -1 || stat(tok, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        for (int i = 0; i < COMP.num_dirs; i++) {
+            if (COMP.dirs[i].path != NULL && strcmp(COMP.dirs[i].path, tok) == 0) {
+                old = i;
+            }
+        }
+        if (old != -1 && COMP.dirs[old].mtime.tv_sec == st.st_mtim.tv_sec &&
+            COMP.dirs[old].mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            // Unchanged: carry the scanned names over as they are
+            dir = COMP.dirs[old];
+            COMP.dirs[old].path = NULL;
+        } else {
+            if ((dir.path = strdup(tok)) == NULL) {
+                continue;
+            }
+            dir.mtime = st.st_mtim;
+            pathDirScan(&dir);
+            pthread_mutex_lock(&COMP.lock);
+            if (old != -1) {
+                pathDirRelease(&COMP.dirs[old]);
+                COMP.dirs[old].path = NULL;
+            }
+            for (int i = 0; i < dir.num_names; i++) {
+                trieAdd(dir.names[i]);
+            }
+            pthread_mutex_unlock(&COMP.lock);
+        }
+        struct path_dir *grown = realloc(dirs, (num_dirs + 1) * sizeof(struct path_dir));
+        if (!grown) {
+            pthread_mutex_lock(&COMP.lock);
+            pathDirRelease(&dir);
+            pthread_mutex_unlock(&COMP.lock);
+            continue;
+        }
+        dirs = grown;
+        dirs[num_dirs++] = dir;
+    }
+    // Directories dropped from $PATH take their names with them
+    pthread_mutex_lock(&COMP.lock);
+    for (int i = 0; i < COMP.num_dirs; i++) {
+        if (COMP.dirs[i].path != NULL) {
+            pathDirRelease(&COMP.dirs[i]);
+        }
+    }
+    pthread_mutex_unlock(&COMP.lock);
+    free(COMP.dirs);
+    COMP.dirs = dirs;
+    COMP.num_dirs = num_dirs;
+}
+
+static void *completionBuilder(void *arg) {
+    completionRefresh(arg);
+    free(arg);
+    pthread_mutex_lock(&COMP.lock);
+    COMP.refreshing = 0;
+    pthread_mutex_unlock(&COMP.lock);
+    return NULL;
+}
+
+// Refresh the trie off the main thread, unless a refresh is already running,
+// so neither the first prompt nor a Tab waits for $PATH to be scanned.
+static void completionStart() {
+    pthread_t builder;
+    const char *env = getenv("PATH");
+    char *path;
+    int running;
+    pthread_mutex_lock(&COMP.lock);
+    running = COMP.refreshing;
+    COMP.refreshing = 1;
+    pthread_mutex_unlock(&COMP.lock);
+    if (running) {
+        return;
+    }
+    if ((path = strdup(env ? env : "")) != NULL &&
+        pthread_create(&builder, NULL, completionBuilder, path) == 0) {
+        pthread_detach(builder);
+        return;
+    }
+    free(path);
+    pthread_mutex_lock(&COMP.lock);
+    COMP.refreshing = 0;
+    pthread_mutex_unlock(&COMP.lock);
+}
+
+// Commands starting with prefix, sorted, from the trie as it stands. A
+// refresh is started for the next Tab to see. Returns the number of matches.
+static int completeCommand(const char *prefix, char ***out) {
+    char buf[256];
+    int num = 0, cap = 0;
+    struct trie_node *node;
+    *out = NULL;
+    completionStart();
+    pthread_mutex_lock(&COMP.lock);
+    node = &COMP.root;
+    for (const char *p = prefix; *p && node != NULL; p++) {
+        node = node->child;
+        while (node != NULL && node->c != *p) {
+            node = node->sibling;
+        }
+    }
+    if (node != NULL && strlen(prefix) < sizeof(buf)) {
+        strcpy(buf, prefix);
+        trieCollect(node, buf, strlen(prefix), out, &num, &cap);
+    }
+    pthread_mutex_unlock(&COMP.lock);
+    return num;
+}
+
+// File names starting with prefix, through the same glob expansion used for
+// command arguments. Directories get a trailing '/'.
+static int completeFile(const char *prefix, char ***out) {
+    char *pattern = malloc(strlen(prefix) + 2);
+    char *tokens[] = {pattern, NULL};
+    int num = 0;
+    struct stat st;
+    *out = NULL;
+    // Completion is best effort: out of memory completes nothing
+    if (!pattern) {
+        return 0;
+    }
+    sprintf(pattern, "%s*", prefix);
+    *out = expand_wildcards(tokens);
+    if (*out == NULL) {
+        free(pattern);
+        return 0;
+    }
+    // A pattern matching nothing comes back as itself, which is no file
+    if ((*out)[0] != NULL && (*out)[1] == NULL && strcmp((*out)[0], pattern) == 0 && lstat(pattern, &st) != 0) {
+        free((*out)[0]);
+        (*out)[0] = NULL;
+    }
+    free(pattern);
+    for (num = 0; (*out)[num] != NULL; num++) {
+        if (stat((*out)[num], &st) == 0 && S_ISDIR(st.st_mode)) {
+            char *dir = malloc(strlen((*out)[num]) + 2);
+            // Without room for the '/' the name is offered as it is
+            if (!dir) {
+                continue;
+            }
+            sprintf(dir, "%s/", (*out)[num]);
+            free((*out)[num]);
+            (*out)[num] = dir;
+        }
+    }
+    return num;
+}
+
+// Raw-mode line editor used for interactive input.
+struct line_buf {
+    char *buf;
+    int len;
+    int cap;
+    int pos;
+    const char *prompt;
+};
+
+static struct termios ORIG_TERMIOS;
+
+static int editorRaw(int on) {
+    struct termios raw;
+    if (!on) {
+        return tcsetattr(STDIN_FILENO, TCSAFLUSH, &ORIG_TERMIOS);
+    }
+    if (tcgetattr(STDIN_FILENO, &ORIG_TERMIOS) == -1) {
+        return -1;
+    }
+    raw = ORIG_TERMIOS;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+static void editorWrite(const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(STDOUT_FILENO, s, n);
+        if (w <= 0) {
+            return;
+        }
+        s += w;
+        n -= w;
+    }
+}
+
+static void editorRefresh(struct line_buf *lb) {
+    char seq[64];
+    editorWrite("\r", 1);
+    editorWrite(lb->prompt, strlen(lb->prompt));
+    editorWrite(lb->buf, lb->len);
+    editorWrite("\x1b[K\r", 4);
+    snprintf(seq, sizeof(seq), "\x1b[%dC", (int)strlen(lb->prompt) + lb->pos);
+    if ((int)strlen(lb->prompt) + lb->pos > 0) {
+        editorWrite(seq, strlen(seq));
+    }
+}
+
+static void editorInsert(struct line_buf *lb, const char *s, int n) {
+    if (lb->len + n + 1 > lb->cap) {
+        lb->cap = (lb->len + n + 1) * 2;
+        lb->buf = realloc(lb->buf, lb->cap);
+        if (!lb->buf) {
+            editorRaw(0);
+            allocFailed();
+        }
+    }
+    memmove(lb->buf + lb->pos + n, lb->buf + lb->pos, lb->len - lb->pos);
+    memcpy(lb->buf + lb->pos, s, n);
+    lb->len += n;
+    lb->pos += n;
+    lb->buf[lb->len] = '\0';
+}
+
+static void editorDelete(struct line_buf *lb, int from, int to) {
+    memmove(lb->buf + from, lb->buf + to, lb->len - to);
+    lb->len -= to - from;
+    if (lb->pos > to) {
+        lb->pos -= to - from;
+    } else if (lb->pos > from) {
+        lb->pos = from;
+    }
+    lb->buf[lb->len] = '\0';
+}
+
+static void editorSet(struct line_buf *lb, const char *s) {
+    lb->len = lb->pos = 0;
+    editorInsert(lb, s, strlen(s));
+}
+
+// Tab completion. The first word of a command completes from the trie; any
+// other word, or one containing '/', completes as a file name. A second Tab
+// with nothing left to add lists the candidates.
+static void editorComplete(struct line_buf *lb, int listing) {
+    const char *breaks = " \t|;&<>()";
+    int start = lb->pos, is_command = 1, num, common;
+    char **matches;
+    while (start > 0 && strchr(breaks, lb->buf[start - 1]) == NULL) {
+        start--;
+    }
+    for (int i = start - 1; i >= 0; i--) {
+        if (lb->buf[i] != ' ' && lb->buf[i] != '\t') {
+            is_command = strchr("|;&(", lb->buf[i]) != NULL;
+            break;
+        }
+    }
+    char *word = strndup(lb->buf + start, lb->pos - start);
+    if (is_command && strchr(word, '/') == NULL) {
+        num = completeCommand(word, &matches);
+    } else {
+        num = completeFile(word, &matches);
+    }
+    if (num == 0) {
+        editorWrite("\a", 1);
+    } else {
+        common = strlen(matches[0]);
+        for (int i = 1; i < num; i++) {
+            int j = 0;
+            while (j < common && matches[i][j] == matches[0][j]) {
+                j++;
+            }
+            common = j;
+        }
+        int wlen = strlen(word);
+        if (common > wlen) {
+            editorInsert(lb, matches[0] + wlen, common - wlen);
+        }
+        if (num == 1 && matches[0][common - 1] != '/') {
+            editorInsert(lb, " ", 1);
+        } else if (num > 1 && common <= wlen && listing) {
+            int col = 0;
+            editorWrite("\r\n", 2);
+            for (int i = 0; i < num; i++) {
+                int n = strlen(matches[i]);
+                if (col > 0 && col + n + 2 > 80) {
+                    editorWrite("\r\n", 2);
+                    col = 0;
+                }
+                editorWrite(matches[i], n);
+                editorWrite("  ", 2);
+                col += n + 2;
+            }
+            editorWrite("\r\n", 2);
+        } else if (num > 1 && common <= wlen) {
+            editorWrite("\a", 1);
+        }
+    }
+    for (int i = 0; i < num; i++) {
+        free(matches[i]);
+    }
+    free(matches);
+    free(word);
+    editorRefresh(lb);
+}
+
+// Ctrl-R incremental search. Returns 1 if the match should be run right
+// away (Enter), 0 to keep editing it.
+static int editorSearch(struct line_buf *lb) {
+    char query[256] = "", prompt[320], c;
+    int qlen = 0;
+    long match = -1;
+    char *saved = strdup(lb->buf);
+    const char *orig_prompt = lb->prompt;
+    while (1) {
+        snprintf(prompt, sizeof(prompt), "(reverse-i-search)`%s': ", query);
+        lb->prompt = prompt;
+        editorSet(lb, match >= 0 ? historyGet(match) : "");
+        editorRefresh(lb);
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            c = 7;
+        }
+        if (c == 18) {
+            // Ctrl-R again: next older match
+            long older = historySearch(query, match >= 0 ? match : (long)HIST.count);
+            if (older >= 0) {
+                match = older;
+            }
+        } else if (c == 127 || c == 8) {
+            if (qlen > 0) {
+                query[--qlen] = '\0';
+            }
+            match = qlen ? historySearch(query, HIST.count) : -1;
+        } else if (c == 7 || c == 3) {
+            // Ctrl-G / Ctrl-C: put the original line back
+            lb->prompt = orig_prompt;
+            editorSet(lb, saved);
+            free(saved);
+            return 0;
+        } else if (c == '\r' || c == '\n') {
+            lb->prompt = orig_prompt;
+            free(saved);
+            return 1;
+        } else if (c >= 32 && qlen < (int)sizeof(query) - 1) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            match = historySearch(query, HIST.count);
+        } else {
+            lb->prompt = orig_prompt;
+            free(saved);
+            return 0;
+        }
+    }
+}
+
+// Read one line with editing. Returns NULL on end of input.
+static char *editLine(const char *prompt) {
+    struct line_buf lb = {NULL, 0, 0, 0, prompt};
+    long hist_pos;
+    char *pending = NULL;
+    int last_tab = 0;
+    char c;
+    fflush(stdout);
+    if (editorRaw(1) == -1) {
+        editorWrite(prompt, strlen(prompt));
+        return readLine();
+    }
+    historyMap();
+    hist_pos = HIST.count;
+    editorSet(&lb, "");
+    editorRefresh(&lb);
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+        int tab = 0;
+        if (c == '\r' || c == '\n') {
+            break;
+        } else if (c == '\t') {
+            editorComplete(&lb, last_tab);
+            tab = 1;
+        } else if (c == 127 || c == 8) {
+            if (lb.pos > 0) {
+                editorDelete(&lb, lb.pos - 1, lb.pos);
+            }
+        } else if (c == 4) {
+            // Ctrl-D: end of input on an empty line, delete otherwise
+            if (lb.len == 0) {
+                free(lb.buf);
+                free(pending);
+                editorRaw(0);
+                editorWrite("\r\n", 2);
+                return NULL;
+            }
+            if (lb.pos < lb.len) {
+                editorDelete(&lb, lb.pos, lb.pos + 1);
+            }
+        } else if (c == 3) {
+            // Ctrl-C abandons the line
+            editorWrite("^C\r\n", 4);
+            editorSet(&lb, "");
+            hist_pos = HIST.count;
+        } else if (c == 1) {
+            lb.pos = 0;
+        } else if (c == 5) {
+            lb.pos = lb.len;
+        } else if (c == 2) {
+            if (lb.pos > 0) {
+                lb.pos--;
+            }
+        } else if (c == 6) {
+            if (lb.pos < lb.len) {
+                lb.pos++;
+            }
+        } else if (c == 11) {
+            editorDelete(&lb, lb.pos, lb.len);
+        } else if (c == 21) {
+            editorDelete(&lb, 0, lb.pos);
+        } else if (c == 23) {
+            int from = lb.pos;
+            while (from > 0 && lb.buf[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && lb.buf[from - 1] != ' ') {
+                from--;
+            }
+            editorDelete(&lb, from, lb.pos);
+        } else if (c == 12) {
+            editorWrite("\x1b[H\x1b[2J", 7);
+        } else if (c == 18) {
+            if (editorSearch(&lb)) {
+                break;
+            }
+        } else if (c == 16 || c == 14 || c == 27) {
+            char seq[3] = {0};
+            int key = c == 16 ? 'A' : c == 14 ? 'B' : 0;
+            if (c == 27) {
+                if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) {
+                    continue;
+                }
+                if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+                    if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                        continue;
+                    }
+                    key = seq[1] == '3' ? 'X' : seq[1] == '1' || seq[1] == '7' ? 'H' : seq[1] == '4' || seq[1] == '8' ? 'F' : 0;
+                } else {
+                    key = seq[1];
+                }
+            }
+            if (key == 'A' || key == 'B') {
+                // History navigation keeps the line being typed aside
+                long next = key == 'A' ? hist_pos - 1 : hist_pos + 1;
+                if (next >= 0 && next <= (long)HIST.count) {
+                    if (hist_pos == (long)HIST.count) {
+                        free(pending);
+                        pending = strdup(lb.buf);
+                    }
+                    hist_pos = next;
+                    editorSet(&lb, hist_pos < (long)HIST.count ? historyGet(hist_pos) : pending);
+                }
+            } else if (key == 'C' && lb.pos < lb.len) {
+                lb.pos++;
+            } else if (key == 'D' && lb.pos > 0) {
+                lb.pos--;
+            } else if (key == 'H') {
+                lb.pos = 0;
+            } else if (key == 'F') {
+                lb.pos = lb.len;
+            } else if (key == 'X' && lb.pos < lb.len) {
+                editorDelete(&lb, lb.pos, lb.pos + 1);
+            }
+        } else if ((unsigned char)c >= 32) {
+            editorInsert(&lb, &c, 1);
+        }
+        last_tab = tab;
+        if (!tab) {
+            editorRefresh(&lb);
+        }
+    }
+    editorRaw(0);
+    editorWrite("\r\n", 2);
+    free(pending);
+    return lb.buf;
+}
+
+static int countArgs(char **args) {
+    int n = 0;
+    while (args[n] != NULL) {
+        n++;
+    }
+    return n;
+}
+
+static void freeArgs(char **args) {
+    if (args == NULL) {
+        return;
+    }
+    for (int i = 0; args[i] != NULL; i++) {
+        free(args[i]);
+    }
+    free(args);
+}
+
+// Free a command, closing the shell's ends of its process substitutions
+// and reaping them: with those closed a <(cmd) gets SIGPIPE if it is still
+// writing and a >(cmd) sees end of input, so the wait ends.
+static void freeCommand(struct command *cmd) {
+    struct child kids[cmd->num_subst + 1];
+    freeArgs(cmd->args);
+    for (int j = 0; j < cmd->num_redirs; j++) {
+        free(cmd->redirs[j].target);
+    }
+    free(cmd->redirs);
+    free(cmd->limits);
+    free(cmd->sched);
+    freeMemoSpec(cmd->memo);
+    for (int j = 0; j < cmd->num_subst; j++) {
+        close(cmd->subst[j].fd);
+        kids[j] = cmd->subst[j].child;
+    }
+    waitChildren(kids, cmd->num_subst, cmd->num_subst, 1);
+    free(cmd->subst);
+}
+
+static void freePipeline(struct pipeline *pl) {
+    for (int i = 0; i < pl->num_cmds; i++) {
+        freeCommand(&pl->cmds[i]);
+    }
+    free(pl->cmds);
+    pl->cmds = NULL;
+    pl->num_cmds = 0;
+}
+
+// Strip launch prefixes such as "limit key=value..." or "sched ..." off the
+// front of a command's words into its launch settings
+static int parsePrefixes(struct command *cmd) {
+    while (cmd->args[0] != NULL) {
+        int used;
+        if (strcmp(cmd->args[0], "limit") == 0 && cmd->limits == NULL) {
+            used = parseLimitPrefix(cmd->args, &cmd->limits);
+        } else if (strcmp(cmd->args[0], "sched") == 0 && cmd->sched == NULL) {
+            used = parseSchedPrefix(cmd->args, &cmd->sched);
+        } else if (strcmp(cmd->args[0], "batch-args") == 0 && cmd->batch_jobs == 0) {
+            used = parseBatchPrefix(cmd->args, &cmd->batch_jobs);
+        } else if (strcmp(cmd->args[0], "timeout") == 0 && cmd->timeout == 0) {
+            used = parseTimeoutPrefix(cmd->args, &cmd->timeout, &cmd->kill_after);
+        } else if (strcmp(cmd->args[0], "memo") == 0 && cmd->memo == NULL) {
+            used = parseMemoPrefix(cmd->args, &cmd->memo);
+        } else {
+            return 0;
+        }
+        if (used <= 0) {
+            return used;
+        }
+        for (int i = 0; i < used; i++) {
+            free(cmd->args[i]);
+        }
+        memmove(cmd->args, cmd->args + used, (countArgs(cmd->args + used) + 1) * sizeof(char *));
+        cmd->fixed_args = cmd->fixed_args > (size_t)used ? cmd->fixed_args - used : 0;
+    }
+    return 0;
+}
+
+// Expand a redirection target, which must name exactly one file
+static char *expandTarget(char *word) {
+    char *tokens[] = {word, NULL};
+    char **expanded = expand_wildcards(tokens);
+    char *target = NULL;
+    if (expanded != NULL && expanded[0] != NULL && expanded[1] == NULL) {
+        target = expanded[0];
+        expanded[0] = NULL;
+    } else {
+        fprintf(stderr, "%s: %s: ambiguous redirect\n", SHELL_NAME, word);
+    }
+    freeArgs(expanded);
+    return target;
+}
+
+static int runLine(char *line);
+
+static int isProcSubst(const char *word) {
+    size_t len = strlen(word);
+    return (word[0] == '<' || word[0] == '>') && word[1] == '(' && groupLength(word) == len && word[len - 1] == ')';
+}
+
+// Start the command inside a <(...) or >(...) word on a pipe and return the
+// /dev/fd path standing for the shell's end of it, or NULL on failure
+static char *spawnSubst(struct pipeline *pl, struct command *cmd, const char *word) {
+    int pipefd[2], out = word[0] == '<';
+    char path[32];
+    pid_t pid;
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return NULL;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        traceForked();
+        // Only its own pipe end, not those of other substitutions
+        for (int i = 0; i <= pl->num_cmds; i++) {
+            struct command *c = i < pl->num_cmds ? &pl->cmds[i] : cmd;
+            for (int j = 0; j < c->num_subst; j++) {
+                close(c->subst[j].fd);
+            }
+        }
+        dup2(pipefd[out], out ? STDOUT_FILENO : STDIN_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        char *line = strndup(word + 2, strlen(word) - 3);
+        runLine(line);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(LastStatus);
+    } else if (pid < 0) {
+        perror("myShell: ");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return NULL;
+    }
+    close(pipefd[out]);
+    cmd->subst = realloc(cmd->subst, (cmd->num_subst + 1) * sizeof(struct subst));
+    if (!cmd->subst) {
+        allocFailed();
+    }
+    childInit(&cmd->subst[cmd->num_subst].child, pid, 0, 0);
+    cmd->subst[cmd->num_subst++].fd = pipefd[!out];
+    snprintf(path, sizeof(path), "/dev/fd/%d", pipefd[!out]);
+    return strdup(path);
+}
+
+// Split a command's tokens at | into stages, pull each stage's redirections
+// into its fd plan and expand the remaining words. Returns -1 on error.
+static int parsePipeline(char **tokens, struct pipeline *pl) {
+    int ntok = 0;
+    while (tokens[ntok] != NULL) {
+        ntok++;
+    }
+    char *words[ntok + 1];
+    char *paths[ntok + 1];
+    pl->cmds = NULL;
+    pl->num_cmds = 0;
+    for (int i = 0; ; i++) {
+        struct command cmd = {NULL, NULL, 0, NULL, NULL, 0, 0, 0, 0, NULL, NULL, 0};
+        struct argv_builder b = {NULL, 0, 0, 0, 0};
+        int num_words = 0, num_paths = 0, failed = 0;
+        for (; tokens[i] != NULL && !isOperator(tokens[i], "|"); i++) {
+            struct redir r[2];
+            int needs_target, n = parseRedir(tokens[i], r, &needs_target);
+            if (n == -1) {
+                fprintf(stderr, "%s: %s%s: ambiguous redirect\n", SHELL_NAME, tokens[i],
+                        tokens[i + 1] ? tokens[i + 1] : "");
+                failed = 1;
+                break;
+            }
+            if (n == 0) {
+                if (isProcSubst(tokens[i])) {
+                    // The /dev/fd path is expanded like any other word
+                    if ((paths[num_paths] = spawnSubst(pl, &cmd, tokens[i])) == NULL) {
+                        failed = 1;
+                        break;
+                    }
+                    words[num_words++] = paths[num_paths++];
+                } else {
+                    words[num_words++] = tokens[i];
+                }
+                continue;
+            }
+            if (needs_target) {
+                if (tokens[i + 1] == NULL || isOperator(tokens[i + 1], "|") || (redirLength(tokens[i + 1]) && !isProcSubst(tokens[i + 1]))) {
+                    syntaxError(tokens[i + 1]);
+                    failed = 1;
+                    break;
+                }
+                i++;
+                r[0].target = isProcSubst(tokens[i]) ? spawnSubst(pl, &cmd, tokens[i]) : expandTarget(tokens[i]);
+                if (r[0].target == NULL) {
+                    failed = 1;
+                    break;
+                }
+            }
+            cmd.redirs = realloc(cmd.redirs, (cmd.num_redirs + n) * sizeof(struct redir));
+            if (!cmd.redirs) {
+                allocFailed();
+            }
+            memcpy(cmd.redirs + cmd.num_redirs, r, n * sizeof(struct redir));
+            cmd.num_redirs += n;
+        }
+        words[num_words] = NULL;
+        if (!failed && num_words == 0 && (cmd.num_redirs == 0 || tokens[i] != NULL || pl->num_cmds > 0)) {
+            syntaxError(tokens[i]);
+            failed = 1;
+        }
+        if (!failed) {
+            double expanded = traceNow();
+            failed = expandArgs(words, &b) == -1;
+            traceSpan("expand", words[0], expanded, traceNow(), 0);
+            cmd.args = b.args ? b.args : calloc(1, sizeof(char *));
+            cmd.fixed_args = b.fixed;
+        }
+        for (int j = 0; j < num_paths; j++) {
+            free(paths[j]);
+        }
+        if (failed || parsePrefixes(&cmd) == -1) {
+            if (cmd.args == NULL) {
+                freeArgs(b.args);
+            }
+            freeCommand(&cmd);
+            freePipeline(pl);
+            return -1;
+        }
+        pl->cmds = realloc(pl->cmds, (pl->num_cmds + 1) * sizeof(struct command));
+        if (!pl->cmds) {
+            allocFailed();
+        }
+        pl->cmds[pl->num_cmds++] = cmd;
+        if (tokens[i] == NULL) {
+            return 0;
+        }
+    }
+}
+
+// Function to execute command from terminal, returns its exit status
+// The command a tailexec script ends on, and whether it is the one running
+static struct node *TAIL_NODE = NULL;
+static int TAIL_CALL = 0;
+
+// exec: replace the shell with a command. Its redirections were applied
+// by runBuiltin and are put back if it cannot be run.
+static int myShell_exec(char **args) {
+    if (args[1] == NULL) {
+        return 0;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    traceClose();
+    execResolved(args + 1);
+    fprintf(stderr, "%s: %s: %s\n", SHELL_NAME, args[1], strerror(errno));
+    return errno == ENOENT ? 127 : 126;
+}
+
+// NAME=value words alone, with nothing to redirect or match, set their
+// variables here rather than going through parsePipeline(), as a loop
+// counting with x=$i does on every iteration. Returns -1 if the words
+// need the general path, which also handles a value expanding to a pattern.
+static int assignWords(char **args) {
+    int n = 0;
+    for (; args[n] != NULL; n++) {
+        if (assignmentLength(args[n]) == 0 || strpbrk(args[n], "*?[<>|&;()") != NULL) {
+            return -1;
+        }
+    }
+    char *values[n];
+    for (int i = 0; i < n; i++) {
+        char *value = args[i] + assignmentLength(args[i]) + 1;
+        values[i] = strchr(value, '$') != NULL ? expandParams(value) : value;
+        if (values[i] == NULL || (values[i] != value && strpbrk(values[i], "*?") != NULL)) {
+            int result = values[i] == NULL ? 2 : -1;
+            for (int j = 0; j <= i; j++) {
+                if (values[j] != args[j] + assignmentLength(args[j]) + 1) {
+                    free(values[j]);
+                }
+            }
+            return result;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        setVar(args[i], assignmentLength(args[i]), values[i]);
+        if (values[i] != args[i] + assignmentLength(args[i]) + 1) {
+            free(values[i]);
+        }
+    }
+    return 0;
+}
+
+static int execShell(char **args) {
+    struct pipeline pl;
+    int result;
+    if (args[0] == NULL) {
+        return 0;
+    }
+    // on-change takes the words after -- unparsed, so they can be a pipeline
+    if (strcmp(args[0], "on-change") == 0) {
+        return myShell_onchange(args);
+    }
+    if ((result = assignWords(args)) != -1) {
+        return result;
+    }
+    if (parsePipeline(args, &pl) == -1) {
+        return 2;
+    }
+    if (pl.cmds[0].args[0] == NULL && pl.num_cmds == 1 && pl.cmds[0].num_redirs == 0) {
+        freePipeline(&pl);
+        return 0;
+    }
+
+    // NAME=value... with no command sets shell variables
+    if (pl.num_cmds == 1 && pl.cmds[0].args[0] != NULL && pl.cmds[0].num_redirs == 0 &&
+        assignmentLength(pl.cmds[0].args[0]) > 0) {
+        int all = 1;
+        for (int i = 0; pl.cmds[0].args[i] != NULL; i++) {
+            all = all && assignmentLength(pl.cmds[0].args[i]) > 0;
+        }
+        for (int i = 0; all && pl.cmds[0].args[i] != NULL; i++) {
+            size_t len = assignmentLength(pl.cmds[0].args[i]);
+            setVar(pl.cmds[0].args[i], len, pl.cmds[0].args[i] + len + 1);
+        }
+        if (all) {
+            freePipeline(&pl);
+            return 0;
+        }
+    }
+
+    // exec with only redirections applies them to the shell itself for good
+    if (pl.num_cmds == 1 && builtinIndex(&pl.cmds[0]) >= 0 && strcmp(pl.cmds[0].args[0], "exec") == 0 &&
+        pl.cmds[0].args[1] == NULL) {
+        fflush(stdout);
+        fflush(stderr);
+        result = applyRedirs(pl.cmds[0].redirs, pl.cmds[0].num_redirs) == -1 ? 1 : 0;
+        freePipeline(&pl);
+        return result;
+    }
+
+    // The last command of a script with tailexec set is run as exec would
+    // run it, unless the shell still has work to do once it finishes
+    if (TAIL_CALL && pl.num_cmds == 1 && builtinIndex(&pl.cmds[0]) == -1 && pl.cmds[0].args[0] != NULL &&
+        pl.cmds[0].limits == NULL && pl.cmds[0].sched == NULL && pl.cmds[0].batch_jobs == 0 &&
+        pl.cmds[0].memo == NULL && pl.cmds[0].timeout == 0 && COMMAND_TIMEOUT == 0) {
+        int n = countArgs(pl.cmds[0].args);
+        char **args = realloc(pl.cmds[0].args, (n + 2) * sizeof(char *));
+        if (!args) {
+            allocFailed();
+        }
+        memmove(args + 1, args, (n + 1) * sizeof(char *));
+        args[0] = strdup("exec");
+        pl.cmds[0].args = args;
+    }
+
+    // A lone builtin without redirections runs directly; otherwise builtins
+    // are set up as pipeline stages
+    if (pl.num_cmds == 1 && pl.cmds[0].num_redirs == 0 && pl.cmds[0].num_subst == 0 &&
+        builtinIndex(&pl.cmds[0]) >= 0) {
+        result = (*builtin_func[builtinIndex(&pl.cmds[0])])(pl.cmds[0].args);
+        freePipeline(&pl);
+        return result;
+    }
+
+    result = execute_command(&pl);
+    freePipeline(&pl);
+    return result;
+}
+
+// Background jobs started with '&'. Each job is a forked copy of the shell
+// running the list, placed according to the background sched policy.
+#define MAX_JOBS 256
+
+struct job {
+    int id;
+    struct child child;
+};
+
+static struct job JOBS[MAX_JOBS];
+static int NUM_JOBS = 0;
+static int NEXT_JOB_ID = 1;
+
+static int execNode(struct node *n);
+
+static int startJob(struct node *n) {
+    pid_t pid;
+    if (NUM_JOBS >= MAX_JOBS) {
+        fprintf(stderr, "%s: too many background jobs\n", SHELL_NAME);
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid > 0 && isatty(STDIN_FILENO)) {
+        setpgid(pid, pid);
+    }
+    if (pid == 0) {
+        traceForked();
+        applySched(&BG_POLICY, 0);
+        // A background job must not compete with the shell for terminal
+        // input: its stdin is /dev/null, and on a terminal it leaves the
+        // foreground process group, so reading the terminal anyway stops
+        // it with SIGTTIN and the keys typed at the prompt do not signal it
+        if (isatty(STDIN_FILENO)) {
+            setpgid(0, 0);
+        }
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull != -1) {
+            dup2(devnull, STDIN_FILENO);
+            close(devnull);
+        }
+        execNode(n);
+        fflush(stdout);
+        fflush(stderr);
+        if (TRACE_BUF != NULL) {
+            traceFlush(TRACE_BUF);
+        }
+        _exit(LastStatus);
+    } else if (pid < 0) {
+        perror("myShell: ");
+        return 1;
+    }
+    if (NUM_JOBS == 0) {
+        NEXT_JOB_ID = 1;
+    }
+    JOBS[NUM_JOBS].id = NEXT_JOB_ID++;
+    childInit(&JOBS[NUM_JOBS++].child, pid, 0, 0);
+    if (isatty(STDIN_FILENO)) {
+        printf("[%d] %d\n", JOBS[NUM_JOBS - 1].id, pid);
+    }
+    return 0;
+}
+
+// Collect finished background jobs; with block set, wait for all of them
+static void reapJobs(int block) {
+    struct child kids[MAX_JOBS];
+    if (NUM_JOBS == 0) {
+        return;
+    }
+    for (int i = 0; i < NUM_JOBS; i++) {
+        kids[i] = JOBS[i].child;
+    }
+    waitChildren(kids, NUM_JOBS, NUM_JOBS, block);
+    for (int i = 0; i < NUM_JOBS; i++) {
+        JOBS[i].child = kids[i];
+    }
+    for (int i = 0; i < NUM_JOBS; i++) {
+        if (!JOBS[i].child.done) {
+            continue;
+        }
+        if (isatty(STDIN_FILENO)) {
+            printf("[%d] Done (%d)\n", JOBS[i].id, childStatus(&JOBS[i].child));
+        }
+        if (block) {
+            LastStatus = childStatus(&JOBS[i].child);
+        }
+        JOBS[i--] = JOBS[--NUM_JOBS];
+    }
+}
+
+static int myShell_wait(char **args) {
+    LastStatus = 0;
+    reapJobs(1);
+    return LastStatus;
+}
+
+static int myShell_jobs(char **args) {
+    for (int i = 0; i < NUM_JOBS; i++) {
+        printf("[%d] %d Running\n", JOBS[i].id, JOBS[i].child.pid);
+    }
+    return 0;
+}
+
+// on-change [-d MS] [-k] [-n COUNT] PATHS... -- command: run command, then
+// again each time something matching PATHS changes. PATHS may contain
+// wildcards; each is watched through an inotify watch on its directory, so
+// files created later or replaced by rename are seen too. Events are
+// coalesced until MS milliseconds (default 100) pass without another, then
+// the command runs once. A change while it is still running queues one
+// more run after it, or with -k cancels it (SIGTERM, then SIGKILL if it
+// lingers) and starts over. -n stops after
+// COUNT runs. The command may be a pipeline, as it is handed the raw words.
+struct watch {
+    int wd;
+    char *pattern;          // basename pattern events must match, NULL for any
+};
+
+#define ONCHANGE_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Start a run of the command in a forked copy of the shell
+static pid_t onChangeRun(char **command, int cancel) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        traceForked();
+        // Its own process group, so cancelling reaches the whole pipeline
+        if (cancel) {
+            setpgid(0, 0);
+        }
+        int status = execShell(command);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    } else if (pid < 0) {
+        perror("on-change");
+    } else if (cancel) {
+        setpgid(pid, pid);
+    }
+    return pid;
+}
+
+static int myShell_onchange(char **args) {
+    struct watch *watches = NULL;
+    int num_watches = 0, n = 1, cancel = 0, runs = 0, max_runs = 0, pending = 0, rerun = 0;
+    double debounce = 0.1, last_event = 0;
+    struct child run;
+    char **command;
+
+    for (; args[n] != NULL && args[n][0] == '-' && strcmp(args[n], "--") != 0; n++) {
+        if (strcmp(args[n], "-k") == 0) {
+            cancel = 1;
+        } else if (strcmp(args[n], "-d") == 0 && args[n + 1] != NULL && atoi(args[n + 1]) >= 0) {
+            debounce = atoi(args[++n]) / 1000.0;
+        } else if (strcmp(args[n], "-n") == 0 && args[n + 1] != NULL && atoi(args[n + 1]) > 0) {
+            max_runs = atoi(args[++n]);
+        } else {
+            break;
+        }
+    }
+    command = args + n;
+    while (*command != NULL && strcmp(*command, "--") != 0) {
+        command++;
+    }
+    if (command == args + n || *command == NULL || command[1] == NULL) {
+        fprintf(stderr, "usage: on-change [-d MS] [-k] [-n COUNT] PATHS... -- command\n");
+        return 2;
+    }
+    *command++ = NULL;
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd == -1) {
+        perror("on-change");
+        return 1;
+    }
+    for (char **p = args + n; *p != NULL; p++) {
+        // Watch the directory holding the path, or the path if it is one
+        char *slash = strrchr(*p, '/');
+        struct stat st;
+        char *dir = slash == NULL ? strdup(".") : slash == *p ? strdup("/") : strndup(*p, slash - *p);
+        char *pattern = slash == NULL ? *p : slash + 1;
+        char *dir_words[] = {dir, NULL};
+        char **dirs = expand_wildcards(dir_words);
+        int literal_dir = strpbrk(*p, "*?[") == NULL && stat(*p, &st) == 0 && S_ISDIR(st.st_mode);
+        for (int i = 0; dirs != NULL && dirs[i] != NULL; i++) {
+            const char *target = literal_dir ? *p : dirs[i];
+            int wd = inotify_add_watch(fd, target, ONCHANGE_MASK | IN_ONLYDIR);
+            if (wd == -1) {
+                fprintf(stderr, "on-change: %s: %s\n", target, strerror(errno));
+                continue;
+            }
+            watches = realloc(watches, (num_watches + 1) * sizeof(struct watch));
+            if (!watches) {
+                allocFailed();
+            }
+            watches[num_watches].wd = wd;
+            watches[num_watches++].pattern = literal_dir ? NULL : strdup(pattern);
+        }
+        freeArgs(dirs);
+        free(dir);
+    }
+    if (num_watches == 0) {
+        close(fd);
+        free(watches);
+        return 1;
+    }
+
+    childInit(&run, onChangeRun(command, cancel), 0, 0);
+    runs = 1;
+    while (1) {
+        int running = !run.done;
+        struct pollfd pfd[2] = {{fd, POLLIN, 0}, {run.pidfd, POLLIN, 0}};
+        int timeout = -1;
+        if (running && run.pidfd == -1) {
+            // No pidfd to wait on: check on the run now and then
+            timeout = 100;
+        }
+        if (pending) {
+            int settle = (last_event + debounce - monotonicNow()) * 1000 + 1;
+            timeout = timeout == -1 || settle < timeout ? (settle > 0 ? settle : 0) : timeout;
+        }
+        if (!running && !pending && max_runs > 0 && runs >= max_runs) {
+            break;
+        }
+        if (poll(pfd, running && run.pidfd != -1 ? 2 : 1, timeout) == -1 && errno != EINTR) {
+            perror("on-change");
+            break;
+        }
+        if (pfd[0].revents & POLLIN) {
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + len; ) {
+                    struct inotify_event *ev = (struct inotify_event *)p;
+                    for (int i = 0; i < num_watches; i++) {
+                        if (watches[i].wd == ev->wd &&
+                            (watches[i].pattern == NULL ||
+                             (ev->len > 0 && fnmatch(watches[i].pattern, ev->name, FNM_PERIOD) == 0))) {
+                            pending = 1;
+                            last_event = monotonicNow();
+                        }
+                    }
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+            }
+        }
+        if (running) {
+            waitChildren(&run, 1, 0, 0);
+            if (run.done) {
+                LastStatus = childStatus(&run);
+                if (rerun && (max_runs == 0 || runs < max_runs)) {
+                    rerun = 0;
+                    childInit(&run, onChangeRun(command, cancel), 0, 0);
+                    runs++;
+                }
+            }
+        }
+        if (pending && monotonicNow() - last_event >= debounce) {
+            pending = 0;
+            if (max_runs > 0 && runs >= max_runs) {
+                continue;
+            }
+            if (!run.done && cancel) {
+                // Expire its deadline: SIGTERM to the group now, and SIGKILL
+                // if it is still there kill_after seconds later
+                run.group = 1;
+                run.deadline = monotonicNow();
+                waitChildren(&run, 1, 1, 1);
+            }
+            if (run.done) {
+                childInit(&run, onChangeRun(command, cancel), 0, 0);
+                runs++;
+            } else {
+                rerun = 1;
+            }
+        }
+    }
+    for (int i = 0; i < num_watches; i++) {
+        free(watches[i].pattern);
+    }
+    free(watches);
+    close(fd);
+    return LastStatus;
+}
+
+// meter [-n NAME] [-i INTERVAL] [-f FD]: copy standard input to standard
+// output, reporting every INTERVAL (default 1s) and at the end how much
+// went through and how long each side stalled, on FD or standard error.
+// Put between two stages ("a | meter -n a | b"), a read stall means a is
+// not producing fast enough and a write stall that b is not consuming. The
+// data moves with splice() through a pipe of the meter's own, so it never
+// passes through user space when either end is a pipe; ends splice()
+// cannot handle are copied with read() and write() instead.
+struct meter {
+    const char *name;
+    int fd;
+    double start;
+    long long bytes[2];     // read, written
+    double stall[2];        // seconds waiting on the reading and the writing side
+    long long last_bytes[2];
+    double last_stall[2];
+    double last;
+};
+
+static void formatBytes(char *buf, size_t size, double n) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int u = 0;
+    while (n >= 1024 && u < 4) {
+        n /= 1024;
+        u++;
+    }
+    snprintf(buf, size, u == 0 ? "%.0f%s" : "%.1f%s", n, units[u]);
+}
+
+// One report line: totals so far with the rate and stalls since the last
+// report, or over the whole run once done
+static void meterReport(struct meter *m, double now, int done) {
+    char total[2][32], rate[2][32];
+    double span = now - (done ? m->start : m->last);
+    for (int i = 0; i < 2; i++) {
+        long long moved = m->bytes[i] - (done ? 0 : m->last_bytes[i]);
+        formatBytes(total[i], sizeof(total[i]), m->bytes[i]);
+        formatBytes(rate[i], sizeof(rate[i]), span > 0 ? moved / span : 0);
+    }
+    dprintf(m->fd, "meter %s:%s in %s (%s/s, stalled %.2fs), out %s (%s/s, stalled %.2fs)\n", m->name,
+            done ? " done," : "", total[0], rate[0], m->stall[0] - (done ? 0 : m->last_stall[0]), total[1],
+            rate[1], m->stall[1] - (done ? 0 : m->last_stall[1]));
+    memcpy(m->last_bytes, m->bytes, sizeof(m->bytes));
+    memcpy(m->last_stall, m->stall, sizeof(m->stall));
+    m->last = now;
+}
+
+// Move up to len bytes from in to out without blocking on a pipe. Falls
+// back to copying through buf for good once splice() turns the pair down.
+static ssize_t meterMove(int in, int out, size_t len, int *spliced, char *buf, size_t size) {
+    ssize_t n;
+    if (*spliced) {
+        n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n != -1 || errno != EINVAL) {
+            return n;
+        }
+        *spliced = 0;
+    }
+    n = read(in, buf, len < size ? len : size);
+    for (ssize_t off = 0; n > 0 && off < n; ) {
+        ssize_t w = write(out, buf + off, n - off);
+        if (w <= 0) {
+            return -1;
+        }
+        off += w;
+    }
+    return n;
+}
+
+static int myShell_meter(char **args) {
+    struct meter m = {"", STDERR_FILENO};
+    double interval = 1;
+    int n = 1, pipefd[2], spliced[2] = {1, 1}, eof = 0, status = 0;
+    long long pending = 0, cap;
+    char buf[65536];
+    struct sigaction ignore, old;
+
+    for (; args[n] != NULL && args[n][0] == '-'; n++) {
+        if (strcmp(args[n], "-n") == 0 && args[n + 1] != NULL) {
+            m.name = args[++n];
+        } else if (strcmp(args[n], "-i") == 0 && args[n + 1] != NULL && parseDuration(args[n + 1]) > 0) {
+            interval = parseDuration(args[++n]);
+        } else if (strcmp(args[n], "-f") == 0 && args[n + 1] != NULL) {
+            m.fd = atoi(args[++n]);
+            if (fcntl(m.fd, F_GETFD) == -1) {
+                fprintf(stderr, "meter: %s: %s\n", args[n], strerror(errno));
+                return 2;
+            }
+        } else {
+            break;
+        }
+    }
+    if (args[n] != NULL) {
+        fprintf(stderr, "usage: meter [-n NAME] [-i INTERVAL] [-f FD]\n");
+        return 2;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("meter: pipe");
+        return 1;
+    }
+    // A bigger buffer means fewer wakeups; the default will do otherwise
+    fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20);
+    cap = fcntl(pipefd[1], F_GETPIPE_SZ);
+    if (cap <= 0) {
+        cap = 65536;
+    }
+    // Downstream going away is reported like any other end
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old);
+
+    m.start = m.last = monotonicNow();
+    while (!eof || pending > 0) {
+        struct pollfd fds[2] = {{!eof && pending < cap ? STDIN_FILENO : -1, POLLIN, 0},
+                                {pending > 0 ? STDOUT_FILENO : -1, POLLOUT, 0}};
+        double before = monotonicNow(), next = m.last + interval;
+        int ready = poll(fds, 2, next > before ? (int)((next - before) * 1000) + 1 : 0);
+        double after = monotonicNow();
+        if (ready == -1 && errno != EINTR) {
+            perror("meter: poll");
+            status = 1;
+            break;
+        }
+        // Waiting with data in hand is the writing side's fault
+        m.stall[pending > 0] += after - before;
+        if (after >= next) {
+            meterReport(&m, after, 0);
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (fds[0].revents) {
+            ssize_t got = meterMove(STDIN_FILENO, pipefd[1], cap - pending, &spliced[0], buf, sizeof(buf));
+            if (got == 0) {
+                eof = 1;
+            } else if (got > 0) {
+                pending += got;
+                m.bytes[0] += got;
+            } else if (errno != EAGAIN) {
+                perror("meter: read");
+                status = 1;
+                break;
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t put = meterMove(pipefd[0], STDOUT_FILENO, pending, &spliced[1], buf, sizeof(buf));
+            if (put > 0) {
+                pending -= put;
+                m.bytes[1] += put;
+            } else if (put == -1 && errno == EPIPE) {
+                status = 128 + SIGPIPE;
+                break;
+            } else if (put == -1 && errno != EAGAIN) {
+                perror("meter: write");
+                status = 1;
+                break;
+            }
+        }
+    }
+    meterReport(&m, monotonicNow(), 1);
+    sigaction(SIGPIPE, &old, NULL);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return status;
+}
+
+// Shell functions. A definition stores a copy of the body's parsed tree in
+// a table hashed like the variables, so a call is a lookup and a walk of
+// that tree in the shell itself: the body is never tokenized again and
+// nothing is forked that the same commands would not fork anyway. The copy
+// owns its words, since the line that defined it is freed once it has run.
+#define MAX_FUNC_DEPTH 1000
+
+struct func {
+    char *name;
+    struct node *body;
+    int calls;              // calls of it still running
+    int removed;            // redefined while running; freed by the last call
+    struct func *next;
+};
+
+static struct func *FUNCS[VAR_BUCKETS];
+static int NUM_FUNCS = 0;
+static int FUNC_DEPTH = 0;
+static int RETURNING = 0;         // set by return until the function has unwound
+
+static struct func *findFunc(const char *name) {
+    if (NUM_FUNCS == 0) {
+        return NULL;
+    }
+    for (struct func *f = FUNCS[varBucket(name, strlen(name))]; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// A NULL-terminated word list copied into one allocation, as splitLine() lays it out
+static char **copyWords(char **words) {
+    size_t n = 0, text = 0;
+    if (words == NULL) {
+        return NULL;
+    }
+    for (; words[n] != NULL; n++) {
+        text += strlen(words[n]) + 1;
+    }
+    char **copy = malloc((n + 1) * sizeof(char *) + text);
+    if (!copy) {
+        allocFailed();
+    }
+    char *p = (char *)(copy + n + 1);
+    for (size_t i = 0; i < n; i++) {
+        copy[i] = strcpy(p, words[i]);
+        p += strlen(p) + 1;
+    }
+    copy[n] = NULL;
+    return copy;
+}
+
+static struct node *copyNode(struct node *n) {
+    if (n == NULL) {
+        return NULL;
+    }
+    struct node *c = newNode(n->type, copyWords(n->args), copyNode(n->left), copyNode(n->right));
+    c->redirs = copyWords(n->redirs);
+    c->alt = copyNode(n->alt);
+    if (n->name != NULL && !(c->name = strdup(n->name))) {
+        allocFailed();
+    }
+    return c;
+}
+
+// Free a tree made by copyNode(), words and all
+static void freeCopy(struct node *n) {
+    if (n == NULL) {
+        return;
+    }
+    freeCopy(n->left);
+    freeCopy(n->right);
+    freeCopy(n->alt);
+    free(n->args);
+    free(n->redirs);
+    free(n->name);
+    free(n);
+}
+
+static void freeFunc(struct func *f) {
+    freeCopy(f->body);
+    free(f->name);
+    free(f);
+}
+
+// Define or replace a function. A definition still running is only taken
+// out of the table; its last call frees it.
+static void defineFunc(const char *name, struct node *body) {
+    struct func **slot = &FUNCS[varBucket(name, strlen(name))];
+    struct func *f = calloc(1, sizeof(struct func));
+    if (!f || !(f->name = strdup(name))) {
+        allocFailed();
+    }
+    f->body = body;
+    for (struct func **old = slot; *old != NULL; old = &(*old)->next) {
+        if (strcmp((*old)->name, name) == 0) {
+            struct func *gone = *old;
+            *old = gone->next;
+            NUM_FUNCS--;
+            if (gone->calls > 0) {
+                gone->removed = 1;
+            } else {
+                freeFunc(gone);
+            }
+            break;
+        }
+    }
+    f->next = *slot;
+    *slot = f;
+    NUM_FUNCS++;
+}
+
+// Variables made local by the functions running, innermost last set
+// first, each with the value to put back when its function returns
+struct local_var {
+    char *name;
+    char *value;            // NULL if it was unset
+    struct local_var *next;
+};
+
+static struct local_var *LOCALS = NULL;
+
+// NAME args...: run a function with args as its positional parameters.
+// Variables it makes local get their old values back when it returns.
+static int myShell_call(char **args) {
+    struct func *f = findFunc(args[0]);
+    struct local_var *frame = LOCALS;
+    char **pos_args = POS_ARGS;
+    int pos_count = POS_COUNT, status;
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s: function not found\n", SHELL_NAME, args[0]);
+        return 127;
+    }
+    if (FUNC_DEPTH >= MAX_FUNC_DEPTH) {
+        fprintf(stderr, "%s: %s: maximum function nesting level exceeded (%d)\n", SHELL_NAME, args[0],
+                MAX_FUNC_DEPTH);
+        return 1;
+    }
+    POS_ARGS = args + 1;
+    POS_COUNT = countArgs(args + 1);
+    FUNC_DEPTH++;
+    f->calls++;
+    status = execNode(f->body);
+    RETURNING = 0;
+    f->calls--;
+    FUNC_DEPTH--;
+    while (LOCALS != frame) {
+        struct local_var *l = LOCALS;
+        LOCALS = l->next;
+        if (l->value != NULL) {
+            setVar(l->name, strlen(l->name), l->value);
+        } else {
+            unsetVar(l->name, strlen(l->name));
+        }
+        free(l->name);
+        free(l->value);
+        free(l);
+    }
+    POS_ARGS = pos_args;
+    POS_COUNT = pos_count;
+    if (f->removed && f->calls == 0) {
+        freeFunc(f);
+    }
+    return status;
+}
+
+// local NAME[=value]...: give the function running its own NAME, empty
+// unless a value is given, until it returns
+static int myShell_local(char **args) {
+    int status = 0;
+    if (FUNC_DEPTH == 0) {
+        fprintf(stderr, "local: can only be used in a function\n");
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t len = assignmentLength(args[i]);
+        if (len == 0 && !isName(args[i])) {
+            fprintf(stderr, "local: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        if (len == 0) {
+            len = strlen(args[i]);
+        }
+        const char *old = getVar(args[i], len);
+        struct local_var *l = malloc(sizeof(struct local_var));
+        if (!l || !(l->name = strndup(args[i], len))) {
+            allocFailed();
+        }
+        l->value = old != NULL ? strdup(old) : NULL;
+        if (old != NULL && l->value == NULL) {
+            allocFailed();
+        }
+        l->next = LOCALS;
+        LOCALS = l;
+        setVar(args[i], len, args[i][len] == '=' ? args[i] + len + 1 : "");
+    }
+    return status;
+}
+
+// return [N]: leave the function running with status N, or that of the
+// last command
+static int myShell_return(char **args) {
+    if (FUNC_DEPTH == 0) {
+        fprintf(stderr, "return: can only `return' from a function\n");
+        return 1;
+    }
+    RETURNING = 1;
+    return args[1] != NULL ? atoi(args[1]) & 0xff : LastStatus;
+}
+
+// Whether the commands left in a list are to be skipped, after exit or return
+static int unwinding() {
+    return QUIT || RETURNING;
+}
+
+// For a command whose words need no expansion and which has no
+// redirections, pipes or launch prefixes: the index of the builtin it
+// names, or FUNC_CALL if it names none and so could be a function call.
+// Otherwise -1. Such a command, as in the body of a loop or a function, is
+// run straight from its parsed words.
+static int plainBuiltin(char **args) {
+    int b = FUNC_CALL;
+    if (strcmp(args[0], "sched") == 0 || strcmp(args[0], "memo") == 0) {
+        return -1;
+    }
+    for (int i = 0; args[i] != NULL; i++) {
+        if (strpbrk(args[i], "$*?<>|&;()") != NULL) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < numBuiltin(); i++) {
+        if (strcmp(args[0], builtin_cmd[i]) == 0) {
+            b = i;
+        }
+    }
+    return b;
+}
+
+// Run one command, honoring a then/else prefix against the previous result
+static int execCommand(char **args) {
+    int want = -1;
+    if (strcmp(args[0], "then") == 0) {
+        want = 1;
+    } else if (strcmp(args[0], "else") == 0) {
+        want = 0;
+    }
+    if (want != -1) {
+        if (LastComStat != want) {
+            printf("nope\n");
+            LastComStat = 0;
+            return LastStatus = 1;
+        }
+        args++;
+    }
+    LastStatus = execShell(args);
+    LastComStat = LastStatus == 0;
+    return LastStatus;
+}
+
+// The command a list ends on, if the list is the last of a script and the
+// command may replace the shell, otherwise NULL
+static struct node *tailCommand(struct node *list) {
+    if (!TAIL_EXEC || list == NULL) {
+        return NULL;
+    }
+    while (list->type == NODE_SEQ || list->type == NODE_AND || list->type == NODE_OR || list->type == NODE_GROUP) {
+        list = list->type == NODE_GROUP ? list->left : list->right;
+    }
+    return list->type == NODE_COMMAND ? list : NULL;
+}
+
+// for NAME [in WORDS]: the words are expanded once, when the loop starts
+static int execFor(struct node *n) {
+    struct argv_builder b = {NULL, 0, 0, 0, 0};
+    int status = 0;
+    if (n->args != NULL && expandArgs(n->args, &b) == -1) {
+        freeArgs(b.args);
+        return 1;
+    }
+    // Without "in", over the positional parameters
+    for (int i = 0; n->args == NULL && i < POS_COUNT; i++) {
+        if (argvPush(&b, strdup(POS_ARGS[i])) == -1) {
+            freeArgs(b.args);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < b.count && !unwinding(); i++) {
+        setVar(n->name, strlen(n->name), b.args[i]);
+        status = execNode(n->right);
+    }
+    freeArgs(b.args);
+    return status;
+}
+
+// A compound command other than a subshell, run in the shell. The loops
+// re-run their parsed condition and body; only the words of each command
+// are expanded again.
+static int execBody(struct node *n) {
+    int status = 0;
+    switch (n->type) {
+    case NODE_IF:
+        if (execNode(n->left) == 0) {
+            return unwinding() ? LastStatus : execNode(n->right);
+        }
+        return n->alt != NULL && !unwinding() ? execNode(n->alt) : 0;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        while (!unwinding() && (execNode(n->left) == 0) == (n->type == NODE_WHILE) && !unwinding()) {
+            status = execNode(n->right);
+        }
+        return status;
+    case NODE_FOR:
+        return execFor(n);
+    default:
+        return execNode(n->left);
+    }
+}
+
+// Run a compound command in the shell. Its redirections are opened once
+// and dup'ed over the shell's descriptors while it runs, so every command
+// in it, builtins included, shares them.
+static int execCompound(struct node *n) {
+    struct pipeline pl;
+    struct saved_fds saved;
+    int status = 1;
+    if (n->redirs == NULL) {
+        return LastStatus = execBody(n);
+    }
+    if (parsePipeline(n->redirs, &pl) == -1) {
+        return LastStatus = 2;
+    }
+    if (redirectShell(&pl.cmds[0], STDIN_FILENO, STDOUT_FILENO, &saved) == 0) {
+        status = execBody(n);
+    }
+    restoreShell(&saved);
+    freePipeline(&pl);
+    return LastStatus = status;
+}
+
+// In a forked copy of the shell, run a list that is all that is left for
+// the process to do, with its last command replacing the process
+static void execForked(struct node *n) {
+    traceForked();
+    TAIL_EXEC = 1;
+    TAIL_NODE = tailCommand(n);
+    execNode(n);
+    fflush(stdout);
+    fflush(stderr);
+    if (TRACE_BUF != NULL) {
+        traceFlush(TRACE_BUF);
+    }
+    _exit(LastStatus);
+}
+
+// Run a ( ... ) subshell: one fork for the whole list, whose changes to
+// the directory, variables and options are lost with the process
+static int execSubshell(struct node *n) {
+    struct child c;
+    pid_t pid;
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        struct pipeline pl;
+        if (n->redirs != NULL && (parsePipeline(n->redirs, &pl) == -1 ||
+                                applyRedirs(pl.cmds[0].redirs, pl.cmds[0].num_redirs) == -1)) {
+            _exit(EXIT_FAILURE);
+        }
+        execForked(n->left);
+    } else if (pid < 0) {
+        perror("myShell: ");
+    }
+    childInit(&c, pid, 0, 0);
+    waitChildren(&c, 1, 1, 1);
+    return LastStatus = childStatus(&c);
+}
+
+// Run a pipeline with a group in it. Every stage is a forked copy of the
+// shell running that stage's list; a stage that is a plain command execs
+// it in place, so it costs no more than in an ordinary pipeline.
+static int execPipe(struct node *n) {
+    int num = 1, in_fd = STDIN_FILENO, result = 1;
+    for (struct node *p = n; p->type == NODE_PIPE; p = p->right) {
+        num++;
+    }
+    struct node *stages[num];
+    struct child kids[num];
+    for (int i = 0; i < num; i++) {
+        stages[i] = n->type == NODE_PIPE ? n->left : n;
+        n = n->right;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < num; i++) {
+        int pipefd[2] = {-1, STDOUT_FILENO};
+        if (i < num - 1 && pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            num = i;
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Not exec'ed straight away, so close-on-exec does not apply yet
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+                close(in_fd);
+            }
+            if (pipefd[1] != STDOUT_FILENO) {
+                dup2(pipefd[1], STDOUT_FILENO);
+                close(pipefd[1]);
+                close(pipefd[0]);
+            }
+            execForked(stages[i]);
+        } else if (pid < 0) {
+            perror("myShell: ");
+        }
+        childInit(&kids[i], pid, 0, 0);
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (pipefd[1] != STDOUT_FILENO) {
+            close(pipefd[1]);
+        }
+        in_fd = pipefd[0];
+    }
+    if (in_fd != STDIN_FILENO && in_fd != -1) {
+        close(in_fd);
+    }
+    waitChildren(kids, num, num, 1);
+    for (int i = 0; i < num; i++) {
+        int stage = childStatus(&kids[i]);
+        if (PIPEFAIL ? (i == 0 || stage != 0) : i == num - 1) {
+            result = stage;
+        }
+    }
+    return LastStatus = result;
+}
+
+// Run a parsed list. && and || decide from the real exit status of their
+// left side, so a skipped command is never forked.
+static int execNode(struct node *n) {
+    int status, b;
+    switch (n->type) {
+    case NODE_COMMAND:
+        if (n->builtin == -2) {
+            n->builtin = plainBuiltin(n->args);
+        }
+        // Functions are looked up on every run, as they may come and go
+        b = n->builtin;
+        if (b >= 0 && findFunc(n->args[0]) != NULL) {
+            b = FUNC_CALL;
+        } else if (b == FUNC_CALL) {
+            b = -1;
+        }
+        if (b >= 0) {
+            LastStatus = (*builtin_func[b])(n->args);
+            LastComStat = LastStatus == 0;
+            return LastStatus;
+        }
+        TAIL_CALL = n == TAIL_NODE;
+        status = execCommand(n->args);
+        TAIL_CALL = 0;
+        return status;
+    case NODE_AND:
+        status = execNode(n->left);
+        return status == 0 && !unwinding() ? execNode(n->right) : status;
+    case NODE_OR:
+        status = execNode(n->left);
+        return status != 0 && !unwinding() ? execNode(n->right) : status;
+    case NODE_SEQ:
+        status = execNode(n->left);
+        return !unwinding() ? execNode(n->right) : status;
+    case NODE_BACKGROUND:
+        return LastStatus = startJob(n->left);
+    case NODE_GROUP:
+    case NODE_IF:
+    case NODE_WHILE:
+    case NODE_UNTIL:
+    case NODE_FOR:
+        status = execCompound(n);
+        LastComStat = status == 0;
+        return status;
+    case NODE_SUBSHELL:
+        status = execSubshell(n);
+        LastComStat = status == 0;
+        return status;
+    case NODE_PIPE:
+        status = execPipe(n);
+        LastComStat = status == 0;
+        return status;
+    case NODE_FUNCTION:
+        defineFunc(n->name, copyNode(n->left));
+        LastComStat = 1;
+        return LastStatus = 0;
+    }
+    return 1;
+}
+
+// Aliases. Each value is split into tokens once, when it is defined, and
+// an alias in command position is replaced by those tokens before the
+// line is parsed. The batch reader thread expands aliases as it parses
+// ahead, so the table is locked, and ALIAS_GEN counts the changes to it:
+// a line parsed before the latest change is parsed again before it runs.
+#define ALIAS_DEPTH 16
+
+struct alias {
+    char *name;
+    char *value;
+    char **tokens;
+    struct alias *next;
+};
+
+static struct alias *ALIASES[VAR_BUCKETS];
+static int NUM_ALIASES = 0;
+static unsigned ALIAS_GEN = 0;
+static pthread_mutex_t ALIAS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned aliasGeneration() {
+    pthread_mutex_lock(&ALIAS_LOCK);
+    unsigned gen = ALIAS_GEN;
+    pthread_mutex_unlock(&ALIAS_LOCK);
+    return gen;
+}
+
+// The alias named name in its bucket's list, for unlinking. Called locked.
+static struct alias **findAlias(const char *name) {
+    struct alias **a = &ALIASES[varBucket(name, strlen(name))];
+    while (*a != NULL && strcmp((*a)->name, name) != 0) {
+        a = &(*a)->next;
+    }
+    return a;
+}
+
+static void freeAlias(struct alias *a) {
+    free(a->name);
+    free(a->value);
+    free(a->tokens);
+    free(a);
+}
+
+// Whether the token after prev starts a command
+static int commandPosition(char *prev) {
+    return prev == NULL || isListOperator(prev) || isKeyword(prev, "| ( { if then else elif while until do");
+}
+
+// Replace aliases in command position with their tokens. Returns tokens
+// itself if there were none, otherwise a new array laid out as
+// splitLine() lays it out, and frees tokens.
+static char **expandAliases(char **tokens) {
+    struct alias *used[ALIAS_DEPTH];
+    int num_used = 0, changed = 0;
+    size_t n = 0, text = 0;
+    pthread_mutex_lock(&ALIAS_LOCK);
+    if (NUM_ALIASES == 0) {
+        pthread_mutex_unlock(&ALIAS_LOCK);
+        return tokens;
+    }
+    while (tokens[n] != NULL) {
+        n++;
+    }
+    char **work = malloc((n + 1) * sizeof(char *));
+    if (!work) {
+        pthread_mutex_unlock(&ALIAS_LOCK);
+        allocFailed();
+    }
+    memcpy(work, tokens, (n + 1) * sizeof(char *));
+    for (size_t i = 0; work[i] != NULL; ) {
+        struct alias *a = commandPosition(i > 0 ? work[i - 1] : NULL) ? *findAlias(work[i]) : NULL;
+        // An alias is not expanded again in its own expansion
+        for (int j = 0; j < num_used && a != NULL; j++) {
+            if (used[j] == a) {
+                a = NULL;
+            }
+        }
+        if (a == NULL || num_used == ALIAS_DEPTH) {
+            i++;
+            num_used = 0;
+            continue;
+        }
+        used[num_used++] = a;
+        size_t k = countArgs(a->tokens);
+        work = realloc(work, (n + k + 1) * sizeof(char *));
+        if (!work) {
+            pthread_mutex_unlock(&ALIAS_LOCK);
+            allocFailed();
+        }
+        memmove(work + i + k, work + i + 1, (n - i) * sizeof(char *));
+        memcpy(work + i, a->tokens, k * sizeof(char *));
+        n = n + k - 1;
+        changed = 1;
+    }
+    if (!changed) {
+        pthread_mutex_unlock(&ALIAS_LOCK);
+        free(work);
+        return tokens;
+    }
+    for (size_t i = 0; i < n; i++) {
+        text += strlen(work[i]) + 1;
+    }
+    char **out = malloc((n + 1) * sizeof(char *) + text);
+    if (!out) {
+        pthread_mutex_unlock(&ALIAS_LOCK);
+        allocFailed();
+    }
+    char *p = (char *)(out + n + 1);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = strcpy(p, work[i]);
+        p += strlen(p) + 1;
+    }
+    out[n] = NULL;
+    pthread_mutex_unlock(&ALIAS_LOCK);
+    free(work);
+    free(tokens);
+    return out;
+}
+
+// alias [NAME[=value]]...: list aliases, show the named ones, or define
+// one. There is no quoting, so the value is every word after the =.
+static int myShell_alias(char **args) {
+    int status = 0;
+    pthread_mutex_lock(&ALIAS_LOCK);
+    for (int b = 0; args[1] == NULL && b < VAR_BUCKETS; b++) {
+        for (struct alias *a = ALIASES[b]; a != NULL; a = a->next) {
+            printf("alias %s='%s'\n", a->name, a->value);
+        }
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        char *eq = strchr(args[i], '=');
+        if (eq == NULL) {
+            struct alias *a = *findAlias(args[i]);
+            if (a != NULL) {
+                printf("alias %s='%s'\n", a->name, a->value);
+            } else {
+                fprintf(stderr, "alias: %s: not found\n", args[i]);
+                status = 1;
+            }
+            continue;
+        }
+        char *bad = strpbrk(args[i], "/$;|&<>()");
+        if (eq == args[i] || (bad != NULL && bad < eq)) {
+            fprintf(stderr, "alias: `%.*s': invalid alias name\n", (int)(eq - args[i]), args[i]);
+            status = 1;
+            break;
+        }
+        struct strbuf sb = {NULL, 0, 0};
+        struct alias *a = calloc(1, sizeof(struct alias));
+        sbAppend(&sb, eq + 1, strlen(eq + 1));
+        for (int j = i + 1; args[j] != NULL; j++) {
+            sbAppend(&sb, " ", 1);
+            sbAppend(&sb, args[j], strlen(args[j]));
+        }
+        if (!a || !(a->name = strndup(args[i], eq - args[i]))) {
+            allocFailed();
+        }
+        a->value = sb.s;
+        a->tokens = splitLine(a->value);
+        struct alias **old = findAlias(a->name);
+        if (*old != NULL) {
+            struct alias *gone = *old;
+            *old = gone->next;
+            freeAlias(gone);
+            NUM_ALIASES--;
+        }
+        a->next = ALIASES[varBucket(a->name, strlen(a->name))];
+        ALIASES[varBucket(a->name, strlen(a->name))] = a;
+        NUM_ALIASES++;
+        ALIAS_GEN++;
+        break;
+    }
+    pthread_mutex_unlock(&ALIAS_LOCK);
+    return status;
+}
+
+// unalias -a | NAME...
+static int myShell_unalias(char **args) {
+    int status = 0;
+    if (args[1] == NULL) {
+        fprintf(stderr, "unalias: usage: unalias [-a] name...\n");
+        return 1;
+    }
+    pthread_mutex_lock(&ALIAS_LOCK);
+    if (strcmp(args[1], "-a") == 0) {
+        for (int b = 0; b < VAR_BUCKETS; b++) {
+            while (ALIASES[b] != NULL) {
+                struct alias *gone = ALIASES[b];
+                ALIASES[b] = gone->next;
+                freeAlias(gone);
+            }
+        }
+        NUM_ALIASES = 0;
+    }
+    for (int i = 1; args[i] != NULL && strcmp(args[1], "-a") != 0; i++) {
+        struct alias **a = findAlias(args[i]);
+        if (*a == NULL) {
+            fprintf(stderr, "unalias: %s: not found\n", args[i]);
+            status = 1;
+            continue;
+        }
+        struct alias *gone = *a;
+        *a = gone->next;
+        freeAlias(gone);
+        NUM_ALIASES--;
+    }
+    ALIAS_GEN++;
+    pthread_mutex_unlock(&ALIAS_LOCK);
+    return status;
+}
+
+// Tokenize and parse a command. While it is left unfinished, as by an if
+// without its fi, next(arg) supplies the following line, which is appended
+// to *line; *line must then be malloc'ed. Without next, or at the end of
+// the input, an unfinished command is a syntax error.
+static struct node *parseLines(char **line, char ***tokens, char *(*next)(void *), void *arg) {
+    double parsed = traceNow();
+    *tokens = expandAliases(splitLine(*line));
+    int blank = (*tokens)[0] == NULL;
+    struct node *list = parseLine(*tokens);
+    while (list == NULL && PARSE_INCOMPLETE) {
+        char *more = next != NULL ? next(arg) : NULL;
+        if (more == NULL) {
+            if (!SYNTAX_QUIET) {
+                fprintf(stderr, "%s: syntax error: unexpected end of file\n", SHELL_NAME);
+            }
+            break;
+        }
+        size_t len = strlen(*line);
+        char *joined = realloc(*line, len + strlen(more) + 2);
+        if (!joined) {
+            allocFailed();
+        }
+        if (len == 0 || joined[len - 1] != '\n') {
+            joined[len++] = '\n';
+        }
+        strcpy(joined + len, more);
+        free(more);
+        *line = joined;
+        free(*tokens);
+        *tokens = expandAliases(splitLine(*line));
+        blank = (*tokens)[0] == NULL;
+        list = parseLine(*tokens);
+    }
+    PARSE_FAILED = list == NULL && !blank;
+    traceSpan("parse", (*tokens)[0], parsed, traceNow(), 0);
+    return list;
+}
+
+// Run a parsed command. With last set it ends a script and its last command
+// may replace the shell.
+static void runParsed(struct node *list, int last) {
+    if (list != NULL) {
+        TAIL_NODE = last ? tailCommand(list) : NULL;
+        execNode(list);
+        TAIL_NODE = NULL;
+    } else if (PARSE_FAILED) {
+        LastStatus = 2;
+        LastComStat = 0;
+    }
+}
+
+// Tokenize, parse and run one line, which must hold whole commands
+static int runLine(char *line) {
+    char **tokens;
+    reapJobs(0);
+    struct node *list = parseLines(&line, &tokens, NULL, NULL);
+    runParsed(list, 0);
+    freeNode(list);
+    free(tokens);
+    return LastStatus;
+}
+
+// The next line of a file for parseLines, or NULL at its end
+static char *nextFileLine(void *arg) {
+    char *line = NULL;
+    size_t cap = 0;
+    if (getline(&line, &cap, arg) == -1) {
+        free(line);
+        return NULL;
+    }
+    return line;
+}
+
+static char *nextEditLine(void *arg) {
+    return editLine("> ");
+}
+
+// Whether a file has nothing left to read
+static int atEnd(FILE *file) {
+    int c = getc(file);
+    if (c == EOF) {
+        return 1;
+    }
+    ungetc(c, file);
+    return 0;
+}
+
+// When myShell is called Interactively
+static int myShellInteract() {
+    char *line;
+    char prompt[64];
+    historyOpen();
+    completionStart();
+    while (QUIT == 0) {
+        snprintf(prompt, sizeof(prompt), "%s> ", SHELL_NAME);
+        line = editLine(prompt);
+        if (line == NULL) {
+            break;
+        }
+        char *expanded = historyExpand(line);
+        if (expanded == NULL) {
+            free(line);
+            continue;
+        }
+        if (expanded != line) {
+            free(line);
+            line = expanded;
+        }
+        char **tokens;
+        struct node *list = parseLines(&line, &tokens, nextEditLine, NULL);
+        historyAdd(line);
+        //Do Shell
+        reapJobs(0);
+        runParsed(list, 0);
+        freeNode(list);
+        free(tokens);
+        free(line);
+    }
+    return 1;
+}
+
+// Pipelined batch input. A reader thread reads and parses lines ahead of
+// the executor into a bounded single-producer, single-consumer ring, so
+// reading and parsing overlap with the commands running. Each side only
+// advances its own index; the two semaphores count filled and free slots
+// and only enter the kernel when one side has to wait for the other. Free
+// slots are handed back half a queue at a time, so a reader that has
+// caught up refills in a burst instead of waking for every line.
+#define BATCH_QUEUE 64
+
+static int BATCH_SERIAL = 0;      // read, parse and run one line at a time
+
+struct batch_item {
+    char *line;             // NULL marks the end of input
+    char **tokens;
+    struct node *list;      // NULL if the line did not parse
+    unsigned aliases;       // ALIAS_GEN when it was parsed
+    int failed;             // had words but did not parse
+};
+
+struct batch_queue {
+    struct batch_item items[BATCH_QUEUE];
+    unsigned head;          // next slot the executor takes
+    unsigned tail;          // next slot the reader fills
+    sem_t filled;
+    sem_t free;
+    FILE *file;
+    int failed;             // the reader ran out of memory
+};
+
+static void freeBatchItem(void *arg) {
+    struct batch_item *item = arg;
+    freeNode(item->list);
+    free(item->tokens);
+    free(item->line);
+}
+
+// The reader's source of continuation lines, cancellable like its first
+// getline(); a cancel frees the command read so far
+struct batch_next {
+    FILE *file;
+    struct batch_item *item;
+    char *more;
+};
+
+static void freeBatchNext(void *arg) {
+    struct batch_next *next = arg;
+    free(next->more);
+    freeBatchItem(next->item);
+}
+
+static char *nextBatchLine(void *arg) {
+    struct batch_next *next = arg;
+    size_t cap = 0;
+    ssize_t n;
+    next->more = NULL;
+    pthread_cleanup_push(freeBatchNext, next);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    n = getline(&next->more, &cap, next->file);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_cleanup_pop(0);
+    if (n == -1) {
+        free(next->more);
+        return NULL;
+    }
+    return next->more;
+}
+
+static void *batchReader(void *arg) {
+    struct batch_queue *q = arg;
+    sigset_t all;
+    jmp_buf unwind;
+    // Signals are for the executor, which may be waiting on a signalfd
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    SYNTAX_QUIET = 1;
+    if (setjmp(unwind) != 0) {
+        // Out of memory: end the input here, and the executor fails its call
+        q->failed = 1;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        sem_wait(&q->free);
+        q->items[q->tail++ % BATCH_QUEUE] = (struct batch_item){NULL, NULL, NULL, 0, 0};
+        sem_post(&q->filled);
+        return NULL;
+    }
+    ALLOC_UNWIND = &unwind;
+    while (1) {
+        struct batch_item item = {NULL, NULL, NULL, 0, 0};
+        size_t cap = 0;
+        // Only blocking points may be cancelled, once the executor has stopped
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ssize_t n = getline(&item.line, &cap, q->file);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (n == -1) {
+            free(item.line);
+            item.line = NULL;
+        } else {
+            struct batch_next next = {q->file, &item, NULL};
+            item.aliases = aliasGeneration();
+            item.list = parseLines(&item.line, &item.tokens, nextBatchLine, &next);
+            item.failed = PARSE_FAILED;
+        }
+        pthread_cleanup_push(freeBatchItem, &item);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        sem_wait(&q->free);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_cleanup_pop(0);
+        q->items[q->tail++ % BATCH_QUEUE] = item;
+        sem_post(&q->filled);
+        if (item.line == NULL) {
+            return NULL;
+        }
+    }
+}
+
+// When myShell is called with a Script as Argument
+static int myShellBatch(FILE *filename, int echo) {
+    struct batch_queue q;
+    pthread_t reader;
+    int finished = 0, consumed = 0;
+    volatile int failed = 0;
+    jmp_buf unwind, *outer = ALLOC_UNWIND;
+    if (echo) {
+        printf("\nFile Opened. Parsing. Parsed commands displayed first.");
+    }
+    q.head = q.tail = 0;
+    q.file = filename;
+    q.failed = 0;
+    sem_init(&q.filled, 0, 0);
+    sem_init(&q.free, 0, BATCH_QUEUE);
+    // With a single CPU there is nothing to overlap, and a second thread
+    // only makes every later fork and allocation pay for thread safety
+    if (BATCH_SERIAL || sysconf(_SC_NPROCESSORS_ONLN) < 2 ||
+        pthread_create(&reader, NULL, batchReader, &q) != 0) {
+        char *line = NULL;
+        size_t cap = 0;
+        while (QUIT == 0 && getline(&line, &cap, filename) != -1) {
+            char **tokens;
+            struct node *list = parseLines(&line, &tokens, nextFileLine, filename);
+            cap = strlen(line) + 1;
+            if (echo) {
+                printf("\n%s", line);
+            }
+            reapJobs(0);
+            // With tailexec, look ahead to know which command is the last
+            runParsed(list, TAIL_EXEC && atEnd(filename));
+            freeNode(list);
+            free(tokens);
+        }
+        free(line);
+        return 1;
+    }
+    if (setjmp(unwind) == 0) {
+        ALLOC_UNWIND = &unwind;
+    } else {
+        // Out of memory running a command: stop the reader, then unwind
+        failed = 1;
+        finished = 0;
+    }
+    while (QUIT == 0 && !failed) {
+        struct batch_item item;
+        while (sem_wait(&q.filled) == -1 && errno == EINTR) {
+        }
+        item = q.items[q.head++ % BATCH_QUEUE];
+        if (++consumed == BATCH_QUEUE / 2) {
+            for (; consumed > 0; consumed--) {
+                sem_post(&q.free);
+            }
+        }
+        if (item.line == NULL) {
+            finished = 1;
+            break;
+        }
+        if (echo) {
+            printf("\n%s", item.line);
+        }
+        if (item.list != NULL && item.aliases != aliasGeneration()) {
+            // Aliases changed after the reader parsed it; parsed again below
+            freeNode(item.list);
+            item.list = NULL;
+        }
+        if (item.list != NULL) {
+            reapJobs(0);
+            if (TAIL_EXEC) {
+                // Peek at the next slot: the end of input makes this the last line
+                while (sem_wait(&q.filled) == -1 && errno == EINTR) {
+                }
+                TAIL_NODE = q.items[q.head % BATCH_QUEUE].line == NULL ? tailCommand(item.list) : NULL;
+                sem_post(&q.filled);
+            }
+            execNode(item.list);
+            TAIL_NODE = NULL;
+        } else if (item.failed || item.aliases != aliasGeneration()) {
+            // Parse it again here to report any error in order
+            runLine(item.line);
+        }
+        freeBatchItem(&item);
+    }
+    ALLOC_UNWIND = outer;
+    // After exit the rest of the input is left unread
+    if (!finished) {
+        pthread_cancel(reader);
+    }
+    pthread_join(reader, NULL);
+    while (sem_trywait(&q.filled) == 0) {
+        freeBatchItem(&q.items[q.head++ % BATCH_QUEUE]);
+    }
+    sem_destroy(&q.filled);
+    sem_destroy(&q.free);
+    if (failed || q.failed) {
+        allocUnwind();
+    }
+    return 1;
+}
+
+// Library interface, declared in myshell.h. The shell keeps its session
+// state in globals; a context holds its own copy, swapped in for the
+// duration of each call under MSH_LOCK.
+struct msh_ctx {
+    int last_status;
+    int last_com_stat;
+    int quit;
+    int pipefail;
+    int tail_exec;
+    double timeout;
+    int serial;
+    int cwd;                // directory fd, so cd in one context stays there
+};
+
+static pthread_mutex_t MSH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int MSH_CALLER_CWD = -1;
+
+static void ctxEnter(struct msh_ctx *ctx) {
+    pthread_mutex_lock(&MSH_LOCK);
+    LastStatus = ctx->last_status;
+    LastComStat = ctx->last_com_stat;
+    QUIT = ctx->quit;
+    PIPEFAIL = ctx->pipefail;
+    TAIL_EXEC = ctx->tail_exec;
+    COMMAND_TIMEOUT = ctx->timeout;
+    BATCH_SERIAL = ctx->serial;
+    ALLOC_PID = getpid();
+    MSH_CALLER_CWD = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fchdir(ctx->cwd) == -1) {
+        perror("myShell: context directory");
+    }
+}
+
+static void ctxLeave(struct msh_ctx *ctx, int *status) {
+    ctx->last_status = LastStatus;
+    ctx->last_com_stat = LastComStat;
+    ctx->quit = QUIT;
+    ctx->pipefail = PIPEFAIL;
+    ctx->tail_exec = TAIL_EXEC;
+    ctx->timeout = COMMAND_TIMEOUT;
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd != -1) {
+        close(ctx->cwd);
+        ctx->cwd = cwd;
+    }
+    if (MSH_CALLER_CWD != -1) {
+        if (fchdir(MSH_CALLER_CWD) == -1) {
+            perror("myShell: caller directory");
+        }
+        close(MSH_CALLER_CWD);
+        MSH_CALLER_CWD = -1;
+    }
+    fflush(stdout);
+    if (status != NULL) {
+        *status = LastStatus;
+    }
+    ALLOC_UNWIND = NULL;
+    pthread_mutex_unlock(&MSH_LOCK);
+}
+
+struct msh_ctx *msh_ctx_new(void) {
+    struct msh_ctx *ctx = calloc(1, sizeof(struct msh_ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (ctx->cwd == -1) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void msh_ctx_free(struct msh_ctx *ctx) {
+    if (ctx != NULL) {
+        close(ctx->cwd);
+        free(ctx);
+    }
+}
+
+// Each call sets the point an allocation failure unwinds to; what the
+// failed line had allocated is lost, but the caller carries on
+int msh_run_line(struct msh_ctx *ctx, const char *line, int *status) {
+    char *copy;
+    jmp_buf unwind;
+    if (ctx->quit || (copy = strdup(line)) == NULL) {
+        return -1;
+    }
+    ctxEnter(ctx);
+    if (setjmp(unwind) != 0) {
+        ctxLeave(ctx, status);
+        free(copy);
+        return -1;
+    }
+    ALLOC_UNWIND = &unwind;
+    runLine(copy);
+    ctxLeave(ctx, status);
+    free(copy);
+    return 0;
+}
+
+int msh_run_file(struct msh_ctx *ctx, FILE *file, int echo, int *status) {
+    jmp_buf unwind;
+    if (ctx->quit || file == NULL) {
+        return -1;
+    }
+    ctxEnter(ctx);
+    if (setjmp(unwind) != 0) {
+        ctxLeave(ctx, status);
+        return -1;
+    }
+    ALLOC_UNWIND = &unwind;
+    myShellBatch(file, echo);
+    ctxLeave(ctx, status);
+    return 0;
+}
+
+int msh_run_script(struct msh_ctx *ctx, const char *path, int *status) {
+    FILE *file = fopen(path, "re");
+    int result;
+    if (file == NULL) {
+        return -1;
+    }
+    result = msh_run_file(ctx, file, 0, status);
+    fclose(file);
+    return result;
+}
+
+int msh_interact(struct msh_ctx *ctx, int *status) {
+    jmp_buf unwind;
+    if (ctx->quit) {
+        return -1;
+    }
+    ctxEnter(ctx);
+    if (setjmp(unwind) != 0) {
+        ctxLeave(ctx, status);
+        return -1;
+    }
+    ALLOC_UNWIND = &unwind;
+    myShellInteract();
+    ctxLeave(ctx, status);
+    return 0;
+}
+
+int msh_set_timeout(struct msh_ctx *ctx, const char *duration) {
+    double timeout = parseDuration(duration);
+    if (timeout < 0) {
+        return -1;
+    }
+    ctx->timeout = timeout;
+    return 0;
+}
+
+void msh_set_serial(struct msh_ctx *ctx, int serial) {
+    ctx->serial = serial;
+}
+
+int msh_trace(const char *path) {
+    int result;
+    pthread_mutex_lock(&MSH_LOCK);
+    result = TRACE_FD == -1 ? traceOpen(path) : -1;
+    pthread_mutex_unlock(&MSH_LOCK);
+    return result;
+}
+
+int msh_quit(struct msh_ctx *ctx) {
+    return ctx->quit;
+}
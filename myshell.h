@@ -0,0 +1,56 @@
+#ifndef MYSHELL_H
+#define MYSHELL_H
+
+#include <stdio.h>
+
+// libmyshell: the shell's reader, tokenizer, expansion, executor and
+// builtins as a library, so a program can run shell lines in-process
+// instead of spawning a shell per step.
+//
+// A context carries what one shell session remembers between lines: the
+// last exit status ($?), set -o options, the batch-mode timeout, the
+// working directory and whether exit has been run. The shell's internals
+// are process-wide, so calls are serialized; contexts may be used from
+// several threads but run one at a time. Background jobs, history,
+// variables, functions and aliases are shared by every context in the
+// process. A line running exec, or a script ending with set -o tailexec
+// in effect, replaces the calling process just as it would the shell.
+//
+// Functions returning int give 0 on success and -1 on failure. Exit
+// statuses are reported through the status pointer, which may be NULL.
+
+#define MSH_API __attribute__((visibility("default")))
+
+struct msh_ctx;
+
+// A new context starts in the process's current directory. NULL if out of memory.
+MSH_API struct msh_ctx *msh_ctx_new(void);
+MSH_API void msh_ctx_free(struct msh_ctx *ctx);
+
+// Run one line, such as "make -j4 && ./test > log". Fails if the context
+// has already run exit. The status is that of the line's last command.
+MSH_API int msh_run_line(struct msh_ctx *ctx, const char *line, int *status);
+
+// Run a script line by line until its end or an exit builtin. With echo set
+// each line is printed before it runs, as the shell's batch mode does.
+MSH_API int msh_run_file(struct msh_ctx *ctx, FILE *file, int echo, int *status);
+MSH_API int msh_run_script(struct msh_ctx *ctx, const char *path, int *status);
+
+// Read, edit and run lines from the terminal until exit or end of input
+MSH_API int msh_interact(struct msh_ctx *ctx, int *status);
+
+// Kill any command running longer than duration ("30s", "2m", ...), as the
+// shell's -t option does. "0" removes the limit.
+MSH_API int msh_set_timeout(struct msh_ctx *ctx, const char *duration);
+
+// Scripts are normally read and parsed on a separate thread ahead of
+// execution. With serial set, each line is read, parsed and run in turn.
+MSH_API void msh_set_serial(struct msh_ctx *ctx, int serial);
+
+// Write a Chrome trace of everything run in this process to path
+MSH_API int msh_trace(const char *path);
+
+// True once the context has run the exit builtin
+MSH_API int msh_quit(struct msh_ctx *ctx);
+
+#endif
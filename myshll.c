@@ -1,690 +1,343 @@
-#include <fcntl.h>
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
-#include <sys/types.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
-#include <glob.h>
-
-char SHELL_NAME[50] = "myShell";
-int QUIT = 0;
-int LastComStat = 0;
-
-#define MAX_COMMAND_LENGTH 1024
-#define BUFFER_SIZE 4096
+#include "myshell.h"
 
-// Function to read a line from command into the buffer
-char *readLine() {
-    char *line = (char *)malloc(sizeof(char) * 1024);
-    char c;
-    int pos = 0, bufsize = 1024;
-    if (!line) {
-        printf("\nBuffer Allocation Error.");
-        exit(EXIT_FAILURE);
-    }
-    while (1) {
-        c = getchar();
-        if (c == EOF || c == '\n') {
-            line[pos] = '\0';
-            return line;
-        } else {
-            line[pos] = c;
-        }
-        pos++;
-        if (pos >= bufsize) {
-            bufsize += 1024;
-            line = realloc(line, sizeof(char) * bufsize);
-            if (!line) {
-                printf("\nBuffer Allocation Error.");
-                exit(EXIT_FAILURE);
-            }
-        }
-    }
-}
-
-// Function to split a line into constituent commands
-char **splitLine(char *line) {
-    char **tokens = (char **)malloc(sizeof(char *) * 64);
-    char *token;
-    char delim[10] = " \t\n\r\a";
-    int pos = 0, bufsize = 64;
-    if (!tokens) {
-        printf("\nBuffer Allocation Error.");
-        exit(EXIT_FAILURE);
-    }
-    token = strtok(line, delim);
-    while (token != NULL) {
-        tokens[pos] = token;
-        pos++;
-        if (pos >= bufsize) {
-            bufsize += 64;
-            line = realloc(line, bufsize * sizeof(char *));
-            if (!line) {
-                printf("\nBuffer Allocation Error.");
-                exit(EXIT_FAILURE);
-            }
-        }
-        token = strtok(NULL, delim);
+int BMCheck(int argc, char *argv[]) {
+    // Check if there are command-line arguments
+    if (argc > 1) {
+        return 1; // Running in batch mode
     }
-    tokens[pos] = NULL;
-    return tokens;
-}
 
-void input_redirection_files(char ** args, int index){
-    char *first_file = args[index]; // Assuming the first file is at index 1
-    
-    // Open the first file for appending
-    int output_fd = open(first_file, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (output_fd == -1) {
-        perror("Error opening first file");
-        exit(EXIT_FAILURE);
+    // Check if input is being piped
+    if (!isatty(fileno(stdin))) {
+        return 1; // Running in batch mode
     }
 
-    // Iterate through input files starting from the second one
-    for (int i = index+1; args[i] != NULL && strcmp(args[i], ">") != 0 && strcmp(args[i], "|") != 0; i++) {
-        // Open the current input file for reading
-        int input_fd = open(args[i], O_RDONLY);
-        if (input_fd == -1) {
-            perror("Error opening input file");
-            exit(EXIT_FAILURE);
-        }
-
-        // Move to the end of the first file
-        if (lseek(output_fd, 0, SEEK_END) == -1) {
-            perror("Error seeking first file");
-            exit(EXIT_FAILURE);
-        }
-
-        // Copy content of input file to the end of the first file
-        char buffer[4096];
-        ssize_t bytes_read;
-        while ((bytes_read = read(input_fd, buffer, sizeof(buffer))) > 0) {
-            if (write(output_fd, buffer, bytes_read) == -1) {
-                perror("Error writing to first file");
-                exit(EXIT_FAILURE);
-            }
-        }
+    return 0; // Running in interactive mode
+}
 
-        close(input_fd);
+// The library stays quiet when exit runs; the shell says goodbye
+void farewell(struct msh_ctx *ctx) {
+    if (msh_quit(ctx)) {
+        printf("Exiting Shell... See you soon!!\n");
     }
-
-    close(output_fd);
-
-
 }
 
-// Function Declarations
-int myShell_cd(char **args);
-int myShell_exit();
-int myShell_execute(char **args);
-int myShell_pwd();
-int myShell_which(char **args);
-
-
-// Definitions
-char *builtin_cmd[] = {"cd", "exit", "pwd", "which"};
-
-int (*builtin_func[])(char **) = {&myShell_cd, &myShell_exit, &myShell_pwd, &myShell_which};
-
-int numBuiltin() {
-    return sizeof(builtin_cmd) / sizeof(char *);
+// Running several scripts at once (-P). Each script runs in a forked copy
+// of the shell, so its directory, variables and options are its own, with
+// stdout and stderr on a pipe back to this process. In ordered mode the
+// earliest unfinished script streams straight through while later ones
+// are held back until their turn; a held script keeps its first
+// SPILL_SIZE bytes in memory and the rest in a memfd. In interleaved mode
+// (-I) lines are written as they arrive, prefixed with the script's name.
+#define SPILL_SIZE (64 * 1024)
+
+struct script {
+    const char *path;
+    pid_t pid;
+    int fd;          // read end of its output pipe, -1 once at end of file
+    char *buf;       // held output, or the unfinished last line with -I
+    size_t len;
+    int spill;       // memfd for held output past SPILL_SIZE, -1 if none
+    int status;
+    int done;
+    double started, ended;
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// Builtin command definitions
-int myShell_cd(char **args) {
-    if (args[1] == NULL) {
-        printf("myShell: expected argument to \"cd\"\n");
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("myShell: ");
+void writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            return;
         }
+        data += n;
+        len -= n;
     }
-    return 1;
-}
-
-int myShell_exit() {
-    printf("Exiting Shell... See you soon!!\n");
-    QUIT = 1;
-    return 0;
 }
 
-int myShell_pwd(){
-    // dynamic array?????
-    char pwd[1024]; 
-
-    if (getcwd(pwd, sizeof(pwd)) != NULL) {
-        printf("%s\n", pwd);
-    } else {
-        perror("pwd error");
-        return 1;
+void holdOutput(struct script *s, const char *data, size_t len) {
+    if (s->spill == -1 && s->len + len > SPILL_SIZE) {
+        s->spill = memfd_create("myshll-output", MFD_CLOEXEC);
     }
-
-    return 0;
-}
-
-int myShell_which(char **args) {
-    int argc = 0;
-
-    // Count the number of arguments
-    while (args[argc] != NULL) {
-        argc++;
+    if (s->spill != -1) {
+        writeAll(s->spill, data, len);
+        return;
     }
-
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <program_name>\n", args[0]);
-        return 1; // Return error code 1 for wrong number of arguments
+    s->buf = realloc(s->buf, s->len + len);
+    if (!s->buf) {
+        printf("\nBuffer Allocation Error.");
+        exit(EXIT_FAILURE);
     }
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+}
 
-    char *program_name = args[1];
-    
-    /*
-    if(strcmp(program_name, "exit") == 0 || strcmp(program_name, "cd") == 0 || strcmp(program_name, "pwd") == 0 || strcmp(program_name, "which") == 0) {
-        printf("Built-in Command does not have Path\n");
-        return 1; 
+// Write out what a script has held back, in the order it was produced
+void releaseOutput(struct script *s) {
+    char block[SPILL_SIZE];
+    ssize_t n;
+    writeAll(STDOUT_FILENO, s->buf, s->len);
+    if (s->spill != -1) {
+        lseek(s->spill, 0, SEEK_SET);
+        while ((n = read(s->spill, block, sizeof(block))) > 0) {
+            writeAll(STDOUT_FILENO, block, n);
+        }
+        close(s->spill);
+        s->spill = -1;
     }
-    */
-    
-
-    char *path = getenv("PATH");
+    free(s->buf);
+    s->buf = NULL;
+    s->len = 0;
+}
 
-    if (path == NULL) {
-        fprintf(stderr, "Error: PATH environment variable is not set.\n");
-        return 1;
+// Write each complete line of data with the script's name in front,
+// keeping an unfinished last line until the rest of it arrives
+void prefixOutput(struct script *s, const char *data, size_t len) {
+    const char *nl;
+    while ((nl = memchr(data, '\n', len)) != NULL) {
+        size_t n = nl - data + 1;
+        dprintf(STDOUT_FILENO, "[%s] ", s->path);
+        writeAll(STDOUT_FILENO, s->buf, s->len);
+        writeAll(STDOUT_FILENO, data, n);
+        s->len = 0;
+        data += n;
+        len -= n;
     }
-
-    char *path_copy = strdup(path);
-    if (path_copy == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed.\n");
-        return 1;
+    if (len > 0 && s->len + len > SPILL_SIZE) {
+        // Too long to hold as one line, so it is broken here
+        dprintf(STDOUT_FILENO, "[%s] ", s->path);
+        writeAll(STDOUT_FILENO, s->buf, s->len);
+        writeAll(STDOUT_FILENO, data, len);
+        writeAll(STDOUT_FILENO, "\n", 1);
+        s->len = 0;
+    } else if (len > 0) {
+        holdOutput(s, data, len);
     }
+}
 
-    char *token;
-    char file_path[1024];
-
-    token = strtok(path_copy, ":");
-    while (token != NULL) {
-        snprintf(file_path, 1024, "%s/%s", token, program_name);
-        if (access(file_path, X_OK) == 0) {
-            printf("%s\n", file_path);
-            free(path_copy);
-            return 0;
+int startScript(struct msh_ctx *ctx, struct script *s) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    s->started = now();
+    s->pid = fork();
+    if (s->pid == 0) {
+        int status = 1, null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        if (msh_run_script(ctx, s->path, &status) == -1) {
+            fprintf(stderr, "myShell: %s: %s\n", s->path, strerror(errno));
+            status = 127;
         }
-        token = strtok(NULL, ":");
+        farewell(ctx);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    } else if (s->pid < 0) {
+        perror("myShell");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
     }
-
-    free(path_copy);
-
-    fprintf(stderr, "%s: program not found\n", args[1]);
-    return 1;
+    close(pipefd[1]);
+    s->fd = pipefd[0];
+    return 0;
 }
 
-int execute_command(char **args, char *output_file){
-    int i = 0;
-    int redirect_input = 0, redirect_output = 0, piping = 0;
-    char *input_file = NULL, *pipe_file_1 = NULL, *pipe_file_2 = NULL;
-    char input_buffer[BUFFER_SIZE];
-    ssize_t input_buffer_size = 0;
-
-    // Find input and output files
-    while (args[i] != NULL) {
-        if (strcmp(args[i], "<") == 0) {
-            if (args[i + 1] == NULL) {
-                printf("Missing filename after <\n");
-                return 1;
-            }
-            input_file = args[i+1];
-            redirect_input = 1;
-
-            // Read the contents of the input file into the buffer
-            int input_fd = open(input_file, O_RDONLY);
-            if (input_fd == -1) {
-                perror("open");
-                return 1;
-            }
-            ssize_t bytes_read;
-            while ((bytes_read = read(input_fd, input_buffer + input_buffer_size, BUFFER_SIZE - input_buffer_size)) > 0) {
-                input_buffer_size += bytes_read;
-                if (input_buffer_size >= BUFFER_SIZE) {
-                    printf("Input file too large to handle\n");
-                    close(input_fd);
-                    return 1;
-                }
+// Run the scripts at most jobs at a time and print how each one finished.
+// Returns the highest exit status among them.
+int runScripts(struct msh_ctx *ctx, char **paths, int count, int jobs, int interleave) {
+    struct script scripts[count];
+    struct pollfd fds[jobs];
+    int owner[jobs];
+    int next = 0, running = 0, head = 0, result = 0;
+    char block[SPILL_SIZE];
+    double begun = now();
+    fflush(stdout);
+    memset(scripts, 0, sizeof(scripts));
+    for (int i = 0; i < count; i++) {
+        scripts[i].path = paths[i];
+        scripts[i].fd = -1;
+        scripts[i].spill = -1;
+    }
+    while (head < count) {
+        while (running < jobs && next < count) {
+            struct script *s = &scripts[next++];
+            if (startScript(ctx, s) == -1) {
+                s->status = 127;
+                s->done = 1;
+                s->started = s->ended = now();
+            } else {
+                running++;
             }
-            close(input_fd);
-            if (bytes_read == -1) {
-                perror("read");
-                return 1;
+        }
+        // In ordered mode the head streams live, so flush what it held
+        // while it waited and move past every script that has finished
+        while (!interleave && head < count) {
+            releaseOutput(&scripts[head]);
+            if (!scripts[head].done) {
+                break;
             }
-
-            input_redirection_files(args, i+1);
-        } else if (strcmp(args[i], ">") == 0) {
-            redirect_output = 1;
-        } else if (strcmp(args[i], "|") == 0){
-            if (args[i + 1] == NULL) {
-                printf("Missing command after |\n");
-                return 1;
+            head++;
+        }
+        if (interleave) {
+            while (head < count && scripts[head].done) {
+                head++;
             }
-            pipe_file_1 = args[i - 1];
-            pipe_file_2 = args[i + 1];
-
-            piping = 1;
         }
-        i++;
-    }
-
-    int pid;
-    int pipefd[2];
-    
-    if (piping) {
-        if (pipe(pipefd) == -1) {
-            perror("pipe");
-            return 1;
+        if (running == 0) {
+            continue;
         }
-    }
-
-    if(redirect_input && redirect_output && !piping){
-        pid = fork();
-
-        if (pid == 0) {
-            // Child process
-
-            
-            if (redirect_input) {
-                int input_fd = open(input_file, O_RDONLY);
-                if (input_fd == -1) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(input_fd, STDIN_FILENO);
-                close(input_fd);
-            }
-
-            if (redirect_output) {
-                int output_fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-                if (output_fd == -1) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(output_fd, STDOUT_FILENO);
-                close(output_fd);
-            }
-
-            execvp(args[0], args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            // Forking Error
-            perror("fork");
-            return 1;
-        } else {
-            // Inside the parent process
-            int status;
-            waitpid(pid, &status, 0); // Wait for the child process to complete
-            
-            // If input redirection is enabled, overwrite the input file with the buffer contents
-            if (redirect_input) {
-                int input_fd = open(input_file, O_WRONLY | O_TRUNC);
-                if (input_fd == -1) {
-                    perror("open");
-                    return 1;
-                }
-                if (write(input_fd, input_buffer, input_buffer_size) == -1) {
-                    perror("write");
-                    return 1;
-                }
-                close(input_fd);
+        int n = 0;
+        for (int i = 0; i < next; i++) {
+            if (scripts[i].fd != -1) {
+                fds[n].fd = scripts[i].fd;
+                fds[n].events = POLLIN;
+                owner[n++] = i;
             }
-
-            return 1;
         }
-    }else{
-    
-    
-        pid = fork();
-
-        if (pid == 0) {
-            // Child process
-            
-            if (redirect_input) {
-                int input_fd = open(input_file, O_RDONLY);
-                if (input_fd == -1) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(input_fd, STDIN_FILENO);
-                close(input_fd);
-            }
-
-            if (piping) {
-                close(pipefd[0]); // Close unused read end of the pipe
-                dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to the write end of the pipe
-                close(pipefd[1]); // Close the write end of the pipe
-            }
-
-            if(redirect_output && !piping){
-                int output_fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-                if (output_fd == -1) {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(output_fd, STDOUT_FILENO);
-                close(output_fd);
-
-                execvp(args[0], args);
-                perror("execvp");
-                exit(EXIT_FAILURE);
+        if (poll(fds, n, -1) == -1) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            struct script *s = &scripts[owner[i]];
+            ssize_t got;
+            if (fds[i].revents == 0) {
+                continue;
             }
-
-            execvp(args[0], args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            // Forking Error
-            perror("fork");
-            return 1;
-        } else {
-            // Inside the parent process
-            int status;
-            waitpid(pid, &status, 0); // Wait for the child process to complete
-
-            if (piping) {
-                int pid2 = fork();
-                if (pid2 == 0) {
-                    // Child process for the second command in the pipeline
-                    close(pipefd[1]); // Close unused write end of the pipe
-                    dup2(pipefd[0], STDIN_FILENO); // Redirect stdin to the read end of the pipe
-                    close(pipefd[0]); // Close the read end of the pipe
-
-                    if (redirect_output) {
-                        int output_fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-                        if (output_fd == -1) {
-                            perror("open");
-                            exit(EXIT_FAILURE);
-                        }
-                        dup2(output_fd, STDOUT_FILENO);
-                        close(output_fd);
-                    }
-
-                    char *args2[] = {pipe_file_2, NULL};
-                    execvp(args2[0], args2);
-                    perror("execvp");
-                    exit(EXIT_FAILURE);
-                } else if (pid2 < 0) {
-                    perror("fork");
-                    return 1;
+            got = read(s->fd, block, sizeof(block));
+            if (got > 0) {
+                if (interleave) {
+                    prefixOutput(s, block, got);
+                } else if (owner[i] == head) {
+                    writeAll(STDOUT_FILENO, block, got);
+                } else {
+                    holdOutput(s, block, got);
                 }
-                close(pipefd[0]); // Close the read end of the pipe in the parent process
-                close(pipefd[1]); // Close the write end of the pipe in the parent process
-                waitpid(pid2, &status, 0); // Wait for the second child process to complete
-            } else if (redirect_output) {
-                int pid3 = fork();
-                if (pid3 == 0) {
-                    // Child process for redirecting output to file without piping
-                    int output_fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-                    if (output_fd == -1) {
-                        perror("open");
-                        exit(EXIT_FAILURE);
-                    }
-                    dup2(output_fd, STDOUT_FILENO);
-                    close(output_fd);
-
-                    execvp(args[0], args);
-                    perror("execvp");
-                    exit(EXIT_FAILURE);
-                } else if (pid3 < 0) {
-                    perror("fork");
-                    return 1;
-                }
-                waitpid(pid3, &status, 0); // Wait for the child process to complete
+                continue;
             }
-
-            // If input redirection is enabled, overwrite the input file with the buffer contents
-            if (redirect_input) {
-                int input_fd = open(input_file, O_WRONLY | O_TRUNC);
-                if (input_fd == -1) {
-                    perror("open");
-                    return 1;
+            // End of output: the script is done, or near enough to wait for
+            close(s->fd);
+            s->fd = -1;
+            if (interleave) {
+                if (s->len > 0) {
+                    prefixOutput(s, "\n", 1);
                 }
-                if (write(input_fd, input_buffer, input_buffer_size) == -1) {
-                    perror("write");
-                    return 1;
-                }
-                close(input_fd);
+                free(s->buf);
+                s->buf = NULL;
             }
-
-            return 1;
-        }
-    }
-
-    
-
-    return 0;
-}
-
-
-int myShell_execute(char **args) {
-    char *output_files[100];
-    int num_output_files = 0;
-    int store_output = 0; // Flag to indicate when to start storing output files
-
-    int ret = 0;
-
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], ">") == 0) {
-            store_output = 1; // Set the flag to start storing output files
-            continue; // Move to the next argument
-        }
-
-        if (store_output) {
-            output_files[num_output_files++] = args[i];
+            waitpid(s->pid, &s->status, 0);
+            s->status = WIFEXITED(s->status) ? WEXITSTATUS(s->status) : 128 + WTERMSIG(s->status);
+            s->ended = now();
+            s->done = 1;
+            running--;
         }
     }
 
-    // Print the parsed output file names
-    for (int i = 0; i < num_output_files; i++) {
-        ret = execute_command(args, output_files[i]);
-    }
-
-    return ret;
-}
-
-char **expand_wildcards(char *tokens[]) {
-    glob_t glob_result;
-    int i, flags = 0;
-    char **expanded_strings = NULL;
-    size_t num_strings = 0;
-
-    // Iterate over tokens until NULL is encountered
-    for (i = 0; tokens[i] != NULL; i++) {
-        // If the token contains wildcard characters
-        if (strchr(tokens[i], '*') != NULL || strchr(tokens[i], '?') != NULL) {
-            // Use glob to expand the wildcard pattern
-            if (glob(tokens[i], flags, NULL, &glob_result) == 0) {
-                // Allocate memory for expanded strings
-                expanded_strings = (char **)realloc(expanded_strings, (num_strings + glob_result.gl_pathc) * sizeof(char *));
-                if (expanded_strings == NULL) {
-                    perror("Memory allocation failed");
-                    return NULL;
-                }
-                // Copy expanded filenames
-                for (int j = 0; j < glob_result.gl_pathc; j++) {
-                    expanded_strings[num_strings++] = strdup(glob_result.gl_pathv[j]);
-                    if (expanded_strings[num_strings - 1] == NULL) {
-                        perror("Memory allocation failed");
-                        return NULL;
-                    }
-                }
-                // Free memory allocated by glob
-                globfree(&glob_result);
-            }
-        } else {
-            // No wildcards, just copy the token
-            expanded_strings = (char **)realloc(expanded_strings, (num_strings + 1) * sizeof(char *));
-            if (expanded_strings == NULL) {
-                perror("Memory allocation failed");
-                return NULL;
-            }
-            expanded_strings[num_strings++] = strdup(tokens[i]);
-            if (expanded_strings[num_strings - 1] == NULL) {
-                perror("Memory allocation failed");
-                return NULL;
-            }
+    fprintf(stderr, "\n%-30s %6s %10s\n", "script", "status", "seconds");
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%-30s %6d %10.3f\n", scripts[i].path, scripts[i].status,
+                scripts[i].ended - scripts[i].started);
+        if (scripts[i].status > result) {
+            result = scripts[i].status;
         }
     }
-    // Add a NULL terminator to the expanded strings array
-    expanded_strings = (char **)realloc(expanded_strings, (num_strings + 1) * sizeof(char *));
-    if (expanded_strings == NULL) {
-        perror("Memory allocation failed");
-        return NULL;
-    }
-    expanded_strings[num_strings] = NULL;
-    return expanded_strings;
-}
-
-int myShellLaunch(char **args) {
-    pid_t pid, wpid;
-    int status;
-    pid = fork();
-    if (pid == 0) {
-        // The Child Process
-        if (execvp(args[0], args) == -1) {
-            perror("myShell: ");
-            exit(EXIT_FAILURE);
-            LastComStat = 0;
-        }
-        exit(EXIT_SUCCESS);
-        LastComStat = 1;
-    } else if (pid < 0) {
-        // Forking Error
-        perror("myShell: ");
-    } else {
-        // The Parent Process
-        do {
-            wpid = waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-    }
-    return 1;
+    fprintf(stderr, "%d scripts, %d at a time, %.3f seconds\n", count, jobs, now() - begun);
+    return result;
 }
 
-// Function to execute command from terminal
-int execShell(char **args) {
-    if (args[0] == NULL) {
-        return 1;
-    }
-    char **expanded_args = expand_wildcards(args); // Now expand_wildcards returns char **
-    if (expanded_args == NULL) {
-        return 1;
-    }
-
-
-
-    // Loop to check for builtin functions
-    for (int i = 1; i < numBuiltin(); i++) {
-        if (strcmp(expanded_args[0], builtin_cmd[i]) == 0) {
-            int result = (*builtin_func[i])(expanded_args);
-            free(expanded_args); // Free memory allocated by expand_wildcards
-            return result;
-        }
-    }
-
-    // Handle redirection
-    if (myShell_execute(expanded_args)) {
-        free(expanded_args); // Free memory allocated by expand_wildcards
-        LastComStat = 1;
+int main(int argc, char **argv) {
+    struct msh_ctx *ctx = msh_ctx_new();
+    int status = 0, jobs = 0, interleave = 0;
+    if (ctx == NULL) {
+        perror("myShell");
         return 1;
     }
-
-    // If no piping or redirection, launch command normally
-    int result = myShellLaunch(expanded_args);
-    free(expanded_args); // Free memory allocated by expand_wildcards
-    return result;
-}
-
-// When myShell is called Interactively
-int myShellInteract() {
-    char *line;
-    char **args;
-    while (QUIT == 0) {
-        printf("%s> ", SHELL_NAME);
-        line = readLine();
-        args = splitLine(line);
-        //Do Shell
-        if (strcmp(args[0], "then") == 0 && LastComStat == 0){
-            printf("nope\n");
-            LastComStat = 0;
-        } else if (strcmp(args[0], "else") == 0 && LastComStat == 1){
-            printf("nope\n");
-            LastComStat = 0;
-        } else if (strcmp(args[0], "then") == 0 || strcmp(args[0], "else") == 0){
-            execShell(args + 1);
+    // Options come before the script: -t DURATION kills any command that
+    // runs longer than DURATION, --trace FILE records a trace of the run,
+    // -S reads and parses the script one line at a time as it runs, -P N
+    // runs up to N of the scripts at once and -I interleaves their output
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        if (strcmp(argv[1], "-t") == 0 && argc > 2 && strtod(argv[2], NULL) > 0 &&
+            msh_set_timeout(ctx, argv[2]) == 0) {
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "-S") == 0) {
+            msh_set_serial(ctx, 1);
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "-P") == 0 && argc > 2 && atoi(argv[2]) > 0) {
+            jobs = atoi(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "-I") == 0) {
+            interleave = 1;
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--trace") == 0 && argc > 2) {
+            if (msh_trace(argv[2]) == -1) {
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
         } else {
-            execShell(args);
+            fprintf(stderr, "usage: %s [-S] [-t DURATION] [--trace FILE] [-P N] [-I] [script...]\n", argv[0]);
+            return 2;
         }
-        free(line);
-        free(args);
     }
-    return 1;
-}
-
-// When myShell is called with a Script as Argument
-int myShellBatch(FILE *filename) {
-    char line[MAX_COMMAND_LENGTH];
-    char **args;
-    if (filename == NULL) {
-        printf("\nUnable to open file.");
-        return 1;
-    } else {
-        printf("\nFile Opened. Parsing. Parsed commands displayed first.");
-        while (fgets(line, sizeof(line), filename) != NULL) {
-            printf("\n%s", line);
-            args = splitLine(line);
-            execShell(args);
-        }
-    }
-    free(args);
-    fclose(filename);
-    return 1;
-}
-
-int BMCheck(int argc, char *argv[]) {
-    // Check if there are command-line arguments
-    if (argc > 1) {
-        return 1; // Running in batch mode
-    }
-
-    // Check if input is being piped
-    if (!isatty(fileno(stdin))) {
-        return 1; // Running in batch mode
-    }
-
-    return 0; // Running in interactive mode
-}
-
-int main(int argc, char **argv) {
     // Parsing commands Interactive mode or Script Mode
-    if (BMCheck(argc, argv)) {
+    // Several scripts run together only with -P; otherwise argv[1] is the script
+    if (jobs > 0 && argc > 1) {
+        status = runScripts(ctx, argv + 1, argc - 1, jobs, interleave);
+    } else if (BMCheck(argc, argv)) {
         if (argc > 1) {
             printf("Running in batch mode with file: %s\n", argv[1]);
-            FILE *file = fopen(argv[1], "r");
+            FILE *file = fopen(argv[1], "re");
             if (file == NULL) {
                 perror("Error opening file");
                 return 1;
             }
-            myShellBatch(file);
+            if (msh_run_file(ctx, file, 1, &status) == -1) {
+                status = EXIT_FAILURE;
+            }
+            fclose(file);
         } else {
             printf("Running in batch mode with piped input\n");
-            myShellBatch(stdin);
+            if (msh_run_file(ctx, stdin, 1, &status) == -1) {
+                status = EXIT_FAILURE;
+            }
         }
+        farewell(ctx);
 
     } else {
         printf("Running in interactive mode\n");
         printf("Welcome to your personal Shell!!\n");
-        myShellInteract();
+        if (msh_interact(ctx, &status) == -1) {
+            status = EXIT_FAILURE;
+        }
+        farewell(ctx);
 
     }
-    
-    // Exit the Shell
-    return EXIT_SUCCESS;
+
+    msh_ctx_free(ctx);
+    // Exit the Shell with the status of the last command
+    return status;
 }